@@ -11,11 +11,45 @@
 #include <string>
 #include <vector>
 #include <cstdlib>
+#include <cmath>
 #include <ctime>
 #include <fstream>
 #include <sstream>
 #include <algorithm>
 #include <random>
+#include <list>
+#include <unordered_map>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <cstdarg>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <memory_resource>
+#include <string_view>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <filesystem>
+#ifdef _WIN32
+#include <io.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#endif
+#if defined(BUILD_ENV_LIBRARY) || defined(RUN_BENCHMARKS)
+#include "pokemon_env.h"
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 
 using namespace std;
 
@@ -26,7 +60,12 @@ using namespace std;
 // Window settings
 const int WINDOW_WIDTH = 1150;
 const int WINDOW_HEIGHT = 780;
-const int FRAME_RATE = 60;
+const int FRAME_RATE = 60;        // Render rate cap
+
+// Simulation settings - logic runs at a fixed rate independent of rendering
+const int SIM_TICK_RATE = 60;
+const double SIM_TICK_MS = 1000.0 / SIM_TICK_RATE;
+const int MAX_SIM_TICKS_PER_FRAME = 10; // Drop backlog after long stalls
 
 // Fighter positions
 const int PLAYER_X = 260;
@@ -56,7 +95,7 @@ const int MOVE_BUTTON_SPACING = 260;
 const int SWITCH_BUTTON_HEIGHT = 46;
 const int SWITCH_BUTTON_Y = MOVE_BUTTON_Y - SWITCH_BUTTON_HEIGHT - 15;
 
-// Animation settings
+// Animation settings (in simulation ticks and pixels per tick)
 const int ANIMATION_FRAMES = 18;
 const int ANIMATION_SPEED = 4;
 
@@ -74,6 +113,8 @@ const double HP_RED_THRESHOLD = 0.25;
 
 // Damage calculation
 const double RANDOM_FACTOR_MIN = 0.9;
+const int RANDOM_FACTOR_STEPS = 20; // Random factor is RANDOM_FACTOR_MIN + step / 100
+const int CRIT_ROLL_RANGE = 1000;   // Critical if roll / 1000 < the move's crit chance
 const int MIN_DAMAGE = 1;
 
 // Music settings
@@ -84,6 +125,9 @@ const int NUM_BACKGROUNDS = 5; // Number of background images available
 
 // User data file
 const string USER_DATA_FILE = "userdata.txt";
+const string USER_LOG_SUFFIX = ".log";           // Stat updates since userdata.txt was written
+const unsigned int GROUP_COMMIT_INTERVAL_MS = 500; // Longest a logged change waits for its fsync
+const int LOG_CHECKPOINT_RECORDS = 256;          // Fold the log into userdata.txt after this many
 
 // Login UI constants
 const int LOGIN_BOX_WIDTH = 520;
@@ -94,17 +138,188 @@ const int INPUT_FIELD_WIDTH = 360;
 const int INPUT_FIELD_HEIGHT = 48;
 const int BUTTON_WIDTH = 190;
 const int BUTTON_HEIGHT = 50;
+const int LOGIN_FIELD_X = LOGIN_BOX_X + 50;
+const int LOGIN_USERNAME_FIELD_Y = LOGIN_BOX_Y + 180;
+const int LOGIN_PASSWORD_FIELD_Y = LOGIN_BOX_Y + 290;
+const int LOGIN_PRIMARY_BUTTON_X = LOGIN_BOX_X + 60;
+const int LOGIN_SECONDARY_BUTTON_X = LOGIN_BOX_X + LOGIN_BOX_WIDTH - BUTTON_WIDTH - 60;
+const int LOGIN_BUTTON_Y = LOGIN_BOX_Y + LOGIN_BOX_HEIGHT - 120;
 
 // Menu constants
 const int MENU_BUTTON_WIDTH = 360;
 const int MENU_BUTTON_HEIGHT = 72;
 const int MENU_BUTTON_SPACING = 90;
+const int MENU_BUTTON_X = WINDOW_WIDTH / 2 - MENU_BUTTON_WIDTH / 2;
+const int MENU_FIRST_BUTTON_Y = 250;
 
 // Leaderboard constants
 const int LEADERBOARD_WIDTH = 880;
 const int LEADERBOARD_HEIGHT = 560;
 const int LEADERBOARD_X = (WINDOW_WIDTH - LEADERBOARD_WIDTH) / 2;
 const int LEADERBOARD_Y = (WINDOW_HEIGHT - LEADERBOARD_HEIGHT) / 2;
+const int LEADERBOARD_ROWS = 13;      // Rows shown per page
+const int LEADERBOARD_ROW_HEIGHT = 35;
+const int BACK_BUTTON_WIDTH = 150;
+const int BACK_BUTTON_HEIGHT = 45;
+const int BACK_BUTTON_X = WINDOW_WIDTH / 2 - BACK_BUTTON_WIDTH / 2;
+const int BACK_BUTTON_Y = LEADERBOARD_Y + LEADERBOARD_HEIGHT + 20;
+
+// ============================================================================
+// ALLOCATION TRACKING - Build with -DTRACK_ALLOCATIONS to count heap use
+// ============================================================================
+
+// Subsystems that allocations are charged to. Code marks itself with an
+// AllocationScope; anything outside a scope is counted as ALLOC_OTHER.
+enum AllocationTag {
+    ALLOC_OTHER,
+    ALLOC_INPUT,
+    ALLOC_RENDER,
+    ALLOC_BATTLE,
+    ALLOC_PERSISTENCE,
+    NUM_ALLOCATION_TAGS
+};
+
+const char* const ALLOCATION_TAG_NAMES[NUM_ALLOCATION_TAGS] = {
+    "other", "input", "render", "battle", "persistence"
+};
+
+const unsigned int ALLOCATION_REPORT_INTERVAL_MS = 5000;
+
+// Benchmarks report allocations per operation, so they always get the hooks
+#if defined(TRACK_ALLOCATIONS) || defined(RUN_BENCHMARKS)
+#define ALLOCATION_HOOKS 1
+
+atomic<long long> allocation_counts[NUM_ALLOCATION_TAGS];
+atomic<long long> allocation_bytes[NUM_ALLOCATION_TAGS];
+thread_local AllocationTag current_allocation_tag = ALLOC_OTHER;
+
+// GCC can't see that these news and deletes are a matched malloc/free pair
+// and flags every inlined delete with -Wmismatched-new-delete
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void* operator new(size_t size) {
+    allocation_counts[current_allocation_tag].fetch_add(1, memory_order_relaxed);
+    allocation_bytes[current_allocation_tag].fetch_add(size, memory_order_relaxed);
+    if (void* memory = malloc(size ? size : 1)) return memory;
+    throw bad_alloc();
+}
+
+void operator delete(void* memory) noexcept {
+    free(memory);
+}
+
+void operator delete(void* memory, size_t) noexcept {
+    free(memory);
+}
+
+// Over-aligned requests (std::pmr's default resource uses these)
+void* operator new(size_t size, align_val_t alignment) {
+    allocation_counts[current_allocation_tag].fetch_add(1, memory_order_relaxed);
+    allocation_bytes[current_allocation_tag].fetch_add(size, memory_order_relaxed);
+    size_t align = static_cast<size_t>(alignment);
+    size_t rounded = (size + align - 1) / align * align; // aligned_alloc needs a multiple
+    if (void* memory = aligned_alloc(align, rounded ? rounded : align)) return memory;
+    throw bad_alloc();
+}
+
+void operator delete(void* memory, align_val_t) noexcept {
+    free(memory);
+}
+
+void operator delete(void* memory, size_t, align_val_t) noexcept {
+    free(memory);
+}
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+// Charges allocations on this thread to a tag until the scope ends
+struct AllocationScope {
+    AllocationTag previous;
+    explicit AllocationScope(AllocationTag tag) : previous(current_allocation_tag) {
+        current_allocation_tag = tag;
+    }
+    ~AllocationScope() { current_allocation_tag = previous; }
+};
+
+long long totalAllocationCount() {
+    long long total = 0;
+    for (const atomic<long long>& count : allocation_counts) {
+        total += count.load(memory_order_relaxed);
+    }
+    return total;
+}
+
+void readAllocationCounts(long long counts[NUM_ALLOCATION_TAGS]) {
+    for (int tag = 0; tag < NUM_ALLOCATION_TAGS; tag++) {
+        counts[tag] = allocation_counts[tag].load(memory_order_relaxed);
+    }
+}
+
+#else
+
+// Tracking disabled: scopes compile away to nothing
+struct AllocationScope {
+    explicit AllocationScope(AllocationTag) {}
+};
+
+#endif
+
+#ifdef TRACK_ALLOCATIONS
+
+long long battle_start_counts[NUM_ALLOCATION_TAGS];
+long long interval_start_counts[NUM_ALLOCATION_TAGS];
+unsigned int interval_start_ticks = 0;
+int interval_frames = 0;
+
+// "input 0.0  render 3.2  ..." - allocations per tag between two readings
+string formatAllocationCounts(const long long before[], const long long after[], double divisor) {
+    string text;
+    char part[64];
+    for (int tag = 0; tag < NUM_ALLOCATION_TAGS; tag++) {
+        snprintf(part, sizeof(part), "%s%s %.1f", tag == 0 ? "" : "  ",
+                 ALLOCATION_TAG_NAMES[tag], (after[tag] - before[tag]) / divisor);
+        text += part;
+    }
+    return text;
+}
+
+void beginBattleAllocations() {
+    readAllocationCounts(battle_start_counts);
+}
+
+void reportBattleAllocations() {
+    long long now[NUM_ALLOCATION_TAGS];
+    readAllocationCounts(now);
+    write_line("Allocations this battle: " + formatAllocationCounts(battle_start_counts, now, 1.0));
+}
+
+// Call once at the end of every frame; prints the average every few seconds
+void endFrameAllocations() {
+    interval_frames++;
+    if (current_ticks() - interval_start_ticks < ALLOCATION_REPORT_INTERVAL_MS) return;
+
+    long long now[NUM_ALLOCATION_TAGS];
+    readAllocationCounts(now);
+    write_line("Allocations per frame: " + formatAllocationCounts(interval_start_counts, now, interval_frames));
+    for (int tag = 0; tag < NUM_ALLOCATION_TAGS; tag++) {
+        interval_start_counts[tag] = now[tag];
+    }
+    interval_start_ticks = current_ticks();
+    interval_frames = 0;
+}
+
+#else
+
+void beginBattleAllocations() {}
+void reportBattleAllocations() {}
+void endFrameAllocations() {}
+
+#endif
 
 //=============================================================================
 // DAMAGE RESULT STRUCTURE
@@ -145,7 +360,7 @@ public:
 
     // Getters
     string getUsername() const { return username; }
-    string getPassword() const { return password; }
+    string getPassword() const { return password; } // Stored record, normally a hash
     int getWins() const { return wins; }
     int getLosses() const { return losses; }
     int getCurrentStreak() const { return current_streak; }
@@ -176,6 +391,8 @@ public:
         total_score += 10; // Small consolation points
     }
 
+    void setPassword(const string& record) { password = record; }
+
     // Serialize to string for file storage
     string serialize() const {
         return username + "," + password + "," +
@@ -250,13 +467,16 @@ public:
     Move(string n, int dmg, string t, int acc = 100, double crit = 0.0625)
         : name(n), damage(dmg), type(t), accuracy(acc), critChance(crit) {}
     
-    string getName() const { return name; }
+    const string& getName() const { return name; }
     int getDamage() const { return damage; }
-    string getType() const { return type; }
+    const string& getType() const { return type; }
     int getAccuracy() const { return accuracy; }
     double getCritChance() const { return critChance; }
 };
 
+// Per-fighter storage comes from whatever memory resource owns the team
+using MoveList = pmr::vector<Move>;
+
 // ============================================================================
 // FIGHTER CLASS - Represents a Pokemon
 // ============================================================================
@@ -270,21 +490,42 @@ private:
     int defense;
     int speed;
     string fighter_type;
-    vector<Move> moves;
-    string sprite_path;
+    MoveList moves;
+    pmr::string sprite_path;
     
 public:
+    // Lets a Team hand its memory resource down to each fighter's moves
+    using allocator_type = pmr::polymorphic_allocator<char>;
+
     // Constructor
-    Fighter(string n, int maxHp, int atk, int def, int spd, string type)
+    Fighter(string n, int maxHp, int atk, int def, int spd, string type,
+            const allocator_type& alloc = {})
         : name(n), hp(maxHp), max_hp(maxHp), attack(atk), defense(def), 
-          speed(spd), fighter_type(type) {}
+          speed(spd), fighter_type(type), moves(alloc), sprite_path(alloc) {}
+
+    // Plain copies use the default heap; these are used when a team copies
+    // a fighter into its own memory resource
+    Fighter(const Fighter& other) = default;
+    Fighter(Fighter&& other) = default;
+    Fighter& operator=(const Fighter& other) = default;
+    Fighter& operator=(Fighter&& other) = default;
+
+    Fighter(const Fighter& other, const allocator_type& alloc)
+        : name(other.name), hp(other.hp), max_hp(other.max_hp), attack(other.attack),
+          defense(other.defense), speed(other.speed), fighter_type(other.fighter_type),
+          moves(other.moves, alloc), sprite_path(other.sprite_path, alloc) {}
+
+    Fighter(Fighter&& other, const allocator_type& alloc)
+        : name(std::move(other.name)), hp(other.hp), max_hp(other.max_hp), attack(other.attack),
+          defense(other.defense), speed(other.speed), fighter_type(std::move(other.fighter_type)),
+          moves(std::move(other.moves), alloc), sprite_path(std::move(other.sprite_path), alloc) {}
     
     // Move management
     void addMove(const Move& move) {
         moves.push_back(move);
     }
     
-    const vector<Move>& getMoves() const {
+    const MoveList& getMoves() const {
         return moves;
     }
     
@@ -304,25 +545,94 @@ public:
     }
     
     // Getters
-    string getName() const { return name; }
+    const string& getName() const { return name; }
     int getHP() const { return hp; }
     int getMaxHP() const { return max_hp; }
     int getAttack() const { return attack; }
     int getDefense() const { return defense; }
     int getSpeed() const { return speed; }
-    string getType() const { return fighter_type; }
+    const string& getType() const { return fighter_type; }
     
     double getHPPercentage() const {
         return (double)hp / (double)max_hp;
     }
     
     // Sprite management
-    void setSpritePath(string path) {
-        sprite_path = path;
+    void setSpritePath(string_view path) {
+        sprite_path.assign(path.data(), path.size());
     }
     
     string getSpritePath() const {
-        return sprite_path;
+        return string(sprite_path);
+    }
+};
+
+const int MAX_TEAM_SIZE = 64;   // One bit per fighter in Team's alive mask
+
+// Index of the lowest set bit of a non-zero mask
+int lowestSetBit(uint64_t mask) {
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward64(&index, mask);
+    return (int)index;
+#else
+    return __builtin_ctzll(mask);
+#endif
+}
+
+// A side's fighters, sharing one memory resource with their moves, and a
+// bitmask of the ones still standing so checking for survivors and picking
+// a replacement are single bit operations. HP changes go through the team
+// to keep the mask in step.
+class Team {
+private:
+    pmr::vector<Fighter> fighters;
+    uint64_t alive = 0;   // Bit i is set while fighters[i] has HP left
+
+    void updateAliveBit(int index) {
+        uint64_t bit = (uint64_t)1 << index;
+        alive = fighters[index].isAlive() ? (alive | bit) : (alive & ~bit);
+    }
+
+public:
+    Team() = default;
+    explicit Team(pmr::memory_resource* memory) : fighters(memory) {}
+
+    size_t size() const { return fighters.size(); }
+    bool empty() const { return fighters.empty(); }
+    const Fighter& operator[](size_t index) const { return fighters[index]; }
+    pmr::vector<Fighter>::const_iterator begin() const { return fighters.begin(); }
+    pmr::vector<Fighter>::const_iterator end() const { return fighters.end(); }
+
+    void reserve(size_t count) { fighters.reserve(min(count, (size_t)MAX_TEAM_SIZE)); }
+
+    // Copies the fighter into the team's memory and returns it so its moves
+    // can be added there too. Returns nullptr once the team is full.
+    Fighter* add(Fighter fighter) {
+        if ((int)fighters.size() >= MAX_TEAM_SIZE) return nullptr;
+        fighters.push_back(std::move(fighter));
+        updateAliveBit((int)fighters.size() - 1);
+        return &fighters.back();
+    }
+
+    void takeDamage(int index, int damage) {
+        fighters[index].takeDamage(damage);
+        updateAliveBit(index);
+    }
+
+    void heal(int index, int amount) {
+        fighters[index].heal(amount);
+        updateAliveBit(index);
+    }
+
+    uint64_t aliveMask() const { return alive; }
+    bool hasLiving() const { return alive != 0; }
+
+    // First fighter still standing other than skip_index, or -1
+    int nextAlive(int skip_index) const {
+        uint64_t candidates = alive;
+        if (skip_index >= 0 && skip_index < MAX_TEAM_SIZE) candidates &= ~((uint64_t)1 << skip_index);
+        return candidates != 0 ? lowestSetBit(candidates) : -1;
     }
 };
 
@@ -400,7 +710,7 @@ Fighter createStarterByName(const string& name) {
 }
 
 void assignMovesAndSprite(Fighter& fighter, bool is_player) {
-    string name = fighter.getName();
+    const string& name = fighter.getName();
     if (name == "Charizard") {
         fighter.addMove(Move("Fire Blast", 40, "Fire", 80));
         fighter.addMove(Move("Flamethrower", 32, "Fire", 85));
@@ -422,21 +732,46 @@ void assignMovesAndSprite(Fighter& fighter, bool is_player) {
     }
 }
 
-vector<Fighter> createRandomTeam(bool is_player) {
-    vector<string> pool = STARTER_POOL;
+// The team, its fighters and their moves are allocated from memory
+Team createRandomTeam(bool is_player, pmr::memory_resource* memory = pmr::get_default_resource()) {
     static random_device rd;
     static mt19937 rng(rd());
+    pmr::vector<const string*> pool(memory);
+    pool.reserve(STARTER_POOL.size());
+    for (const string& name : STARTER_POOL) pool.push_back(&name);
     shuffle(pool.begin(), pool.end(), rng);
 
-    vector<Fighter> team;
-    for (const string& name : pool) {
-        Fighter fighter = createStarterByName(name);
-        assignMovesAndSprite(fighter, is_player);
-        team.push_back(fighter);
+    Team team(memory);
+    team.reserve(pool.size());
+    for (const string* name : pool) {
+        Fighter* fighter = team.add(createStarterByName(*name));
+        if (fighter != nullptr) assignMovesAndSprite(*fighter, is_player);
     }
     return team;
 }
 
+// Damage for a hit once the crit and random-factor rolls are known. Split
+// out so the exact solver can enumerate every outcome calculateDamage can roll.
+int damageForRolls(const Fighter& attacker, const Fighter& defender, const Move& move,
+                   double type_multiplier, bool critical, int random_step) {
+    // Base damage
+    double base_damage = (attacker.getAttack() * move.getDamage()) / (double)defender.getDefense();
+
+    // STAB bonus
+    double stab = (move.getType() == attacker.getType()) ? 1.5 : 1.0;
+
+    // Random factor 0.9–1.1
+    double random_factor = RANDOM_FACTOR_MIN + random_step / 100.0;
+
+    // Final damage
+    int damage = (int)(base_damage * stab * type_multiplier *
+                       (critical ? 1.5 : 1.0) * random_factor);
+
+    // Minimum damage safeguard
+    if (damage < MIN_DAMAGE) damage = MIN_DAMAGE;
+    return damage;
+}
+
 DamageResult calculateDamage(const Fighter& attacker, const Fighter& defender, const Move& move) {
     DamageResult result;
     result.damage = 0;
@@ -451,29 +786,323 @@ DamageResult calculateDamage(const Fighter& attacker, const Fighter& defender, c
         return result;
     }
 
-    // Base damage
-    double base_damage = (attacker.getAttack() * move.getDamage()) / (double)defender.getDefense();
-
-    // STAB bonus
-    double stab = (move.getType() == attacker.getType()) ? 1.5 : 1.0;
-
     // Critical hit chance
-    if (((rand() % 1000) / 1000.0) < move.getCritChance()) {
+    if (((rand() % CRIT_ROLL_RANGE) / (double)CRIT_ROLL_RANGE) < move.getCritChance()) {
         result.critical = true;
     }
 
-    // Random factor 0.9–1.1
-    double random_factor = RANDOM_FACTOR_MIN + (rand() % 20) / 100.0;
+    int random_step = rand() % RANDOM_FACTOR_STEPS;
+    result.damage = damageForRolls(attacker, defender, move, result.typeMultiplier,
+                                   result.critical, random_step);
+    return result;
+}
 
-    // Final damage
-    result.damage = (int)(base_damage * stab * result.typeMultiplier *
-                          (result.critical ? 1.5 : 1.0) * random_factor);
 
-    // Minimum damage safeguard
-    if (result.damage < MIN_DAMAGE) result.damage = MIN_DAMAGE;
-    return result;
+// ============================================================================
+// WIN PROBABILITY SOLVER - Exact odds under random play, no sampling
+// ============================================================================
+
+// Both sides pick a uniformly random move every turn and never switch by
+// choice, which is how the enemy AI plays. A fainted fighter is then always
+// replaced by the next one in line, so each side is fully described by its
+// place in that line and the active fighter's HP: everyone earlier has
+// fainted and everyone later is untouched. The odds from a state only depend
+// on states with less total HP left, apart from the miss/miss loop at the
+// same HP, which is solved in closed form. States with the same total HP are
+// independent of each other, so each such layer is split across threads.
+
+// Exact result of one random move: the chance of a miss, and every damage
+// value a hit can roll together with its chance
+struct AttackDistribution {
+    double miss_chance = 0.0;
+    vector<pair<int, double>> hits;
+};
+
+// Enumerates the same rolls calculateDamage draws: accuracy, critical hit
+// and the RANDOM_FACTOR_STEPS random factors
+AttackDistribution buildAttackDistribution(const Fighter& attacker, const Fighter& defender) {
+    AttackDistribution distribution;
+    const MoveList& moves = attacker.getMoves();
+    if (moves.empty()) {
+        distribution.miss_chance = 1.0;
+        return distribution;
+    }
+
+    double move_chance = 1.0 / moves.size();
+    vector<pair<int, double>> rolls;
+    for (const Move& move : moves) {
+        double hit_chance = max(0, min(100, move.getAccuracy())) / 100.0;
+        distribution.miss_chance += move_chance * (1.0 - hit_chance);
+
+        int crit_rolls = 0;
+        for (int roll = 0; roll < CRIT_ROLL_RANGE; roll++) {
+            if ((roll / (double)CRIT_ROLL_RANGE) < move.getCritChance()) crit_rolls++;
+        }
+        double crit_chance = crit_rolls / (double)CRIT_ROLL_RANGE;
+        double type_multiplier = getTypeMultiplier(move.getType(), defender.getType());
+
+        for (int critical = 0; critical <= 1; critical++) {
+            double chance = move_chance * hit_chance * (critical ? crit_chance : 1.0 - crit_chance) /
+                            RANDOM_FACTOR_STEPS;
+            if (chance <= 0.0) continue;
+            for (int step = 0; step < RANDOM_FACTOR_STEPS; step++) {
+                rolls.push_back({ damageForRolls(attacker, defender, move, type_multiplier,
+                                                 critical == 1, step), chance });
+            }
+        }
+    }
+
+    // Merge rolls that deal the same damage
+    sort(rolls.begin(), rolls.end());
+    for (const pair<int, double>& roll : rolls) {
+        if (!distribution.hits.empty() && distribution.hits.back().first == roll.first) {
+            distribution.hits.back().second += roll.second;
+        } else {
+            distribution.hits.push_back(roll);
+        }
+    }
+    return distribution;
+}
+
+// Lets the solver's threads finish one layer before any starts the next
+class ThreadBarrier {
+private:
+    mutex barrier_mutex;
+    condition_variable released;
+    unsigned int thread_count;
+    unsigned int waiting = 0;
+    unsigned long generation = 0;
+
+public:
+    explicit ThreadBarrier(unsigned int threads) : thread_count(threads) {}
+
+    void arriveAndWait() {
+        unique_lock<mutex> lock(barrier_mutex);
+        unsigned long arrived_generation = generation;
+        if (++waiting == thread_count) {
+            waiting = 0;
+            generation++;
+            released.notify_all();
+        } else {
+            released.wait(lock, [&] { return generation != arrived_generation; });
+        }
+    }
+};
+
+class WinProbabilitySolver {
+private:
+    // One side's line of fighters: the active one first, then the others
+    // in the order findReplacementIndex sends them out
+    struct SideLine {
+        vector<int> start_hp;      // HP each fighter has when it comes in
+        vector<int> hp_behind;     // Total HP of the fighters after it
+        vector<pair<int, int>> by_remaining; // Total HP left -> (place, HP)
+    };
+
+    SideLine player_line;
+    SideLine enemy_line;
+    vector<AttackDistribution> player_attacks; // [player place][enemy place]
+    vector<AttackDistribution> enemy_attacks;  // [enemy place][player place]
+    int hp_stride = 1;
+    vector<double> player_to_move; // Player's win chance, indexed by stateIndex
+    vector<double> enemy_to_move;
+    bool solved = false;
+
+    static SideLine buildLine(const Team& team, int active_index, vector<int>& team_indices) {
+        SideLine line;
+        team_indices.clear();
+        if (active_index >= 0 && active_index < (int)team.size() && team[active_index].isAlive()) {
+            team_indices.push_back(active_index);
+        }
+        for (int i = 0; i < (int)team.size(); i++) {
+            if (i != active_index && team[i].isAlive()) team_indices.push_back(i);
+        }
+
+        int total = 0;
+        line.start_hp.resize(team_indices.size());
+        line.hp_behind.resize(team_indices.size());
+        for (int place = (int)team_indices.size() - 1; place >= 0; place--) {
+            line.start_hp[place] = team[team_indices[place]].getHP();
+            line.hp_behind[place] = total;
+            total += line.start_hp[place];
+        }
+        line.by_remaining.assign(total + 1, { -1, 0 });
+        for (int place = 0; place < (int)team_indices.size(); place++) {
+            for (int hp = 1; hp <= line.start_hp[place]; hp++) {
+                line.by_remaining[line.hp_behind[place] + hp] = { place, hp };
+            }
+        }
+        return line;
+    }
+
+    size_t stateIndex(int player_place, int player_hp, int enemy_place, int enemy_hp) const {
+        return (((size_t)player_place * hp_stride + player_hp) * enemy_line.start_hp.size() +
+                enemy_place) * hp_stride + enemy_hp;
+    }
+
+    // Player's win chance once the player's hit for damage has landed
+    double afterPlayerHit(int player_place, int player_hp, int enemy_place, int enemy_hp, int damage) const {
+        if (enemy_hp > damage) {
+            return enemy_to_move[stateIndex(player_place, player_hp, enemy_place, enemy_hp - damage)];
+        }
+        if (enemy_place + 1 >= (int)enemy_line.start_hp.size()) return 1.0;
+        return enemy_to_move[stateIndex(player_place, player_hp, enemy_place + 1,
+                                        enemy_line.start_hp[enemy_place + 1])];
+    }
+
+    double afterEnemyHit(int player_place, int player_hp, int enemy_place, int enemy_hp, int damage) const {
+        if (player_hp > damage) {
+            return player_to_move[stateIndex(player_place, player_hp - damage, enemy_place, enemy_hp)];
+        }
+        if (player_place + 1 >= (int)player_line.start_hp.size()) return 0.0;
+        return player_to_move[stateIndex(player_place + 1, player_line.start_hp[player_place + 1],
+                                         enemy_place, enemy_hp)];
+    }
+
+    void solveState(int player_place, int player_hp, int enemy_place, int enemy_hp) {
+        const AttackDistribution& player_attack =
+            player_attacks[player_place * enemy_line.start_hp.size() + enemy_place];
+        const AttackDistribution& enemy_attack =
+            enemy_attacks[enemy_place * player_line.start_hp.size() + player_place];
+
+        double after_player_hit = 0.0;
+        for (const pair<int, double>& hit : player_attack.hits) {
+            after_player_hit += hit.second * afterPlayerHit(player_place, player_hp, enemy_place, enemy_hp, hit.first);
+        }
+        double after_enemy_hit = 0.0;
+        for (const pair<int, double>& hit : enemy_attack.hits) {
+            after_enemy_hit += hit.second * afterEnemyHit(player_place, player_hp, enemy_place, enemy_hp, hit.first);
+        }
+
+        // A miss hands the same state to the other side:
+        //   P = after_player_hit + player_miss * E
+        //   E = after_enemy_hit + enemy_miss * P
+        double player_miss = player_attack.miss_chance;
+        double enemy_miss = enemy_attack.miss_chance;
+        double both_miss = player_miss * enemy_miss;
+        double player_value = both_miss < 1.0
+            ? (after_player_hit + player_miss * after_enemy_hit) / (1.0 - both_miss)
+            : 0.0; // Neither side can ever land a hit; count it as a loss
+        size_t index = stateIndex(player_place, player_hp, enemy_place, enemy_hp);
+        player_to_move[index] = player_value;
+        enemy_to_move[index] = after_enemy_hit + enemy_miss * player_value;
+    }
+
+    // Solves every state whose player line gets thread's share of the layers
+    void solveLayers(unsigned int thread, unsigned int threads, ThreadBarrier* barrier) {
+        int player_total = (int)player_line.by_remaining.size() - 1;
+        int enemy_total = (int)enemy_line.by_remaining.size() - 1;
+        for (int layer = 2; layer <= player_total + enemy_total; layer++) {
+            int first = max(1, layer - enemy_total);
+            int last = min(player_total, layer - 1);
+            for (int player_remaining = first + (int)thread; player_remaining <= last;
+                 player_remaining += threads) {
+                pair<int, int> player_state = player_line.by_remaining[player_remaining];
+                pair<int, int> enemy_state = enemy_line.by_remaining[layer - player_remaining];
+                solveState(player_state.first, player_state.second, enemy_state.first, enemy_state.second);
+            }
+            if (barrier != nullptr) barrier->arriveAndWait();
+        }
+    }
+
+public:
+    // Reads both teams as they stand, so a battle can be solved mid-way
+    WinProbabilitySolver(const Team& player, int player_active, const Team& enemy, int enemy_active) {
+        vector<int> player_indices, enemy_indices;
+        player_line = buildLine(player, player_active, player_indices);
+        enemy_line = buildLine(enemy, enemy_active, enemy_indices);
+
+        for (int player_index : player_indices) {
+            for (int enemy_index : enemy_indices) {
+                player_attacks.push_back(buildAttackDistribution(player[player_index], enemy[enemy_index]));
+            }
+        }
+        for (int enemy_index : enemy_indices) {
+            for (int player_index : player_indices) {
+                enemy_attacks.push_back(buildAttackDistribution(enemy[enemy_index], player[player_index]));
+            }
+        }
+
+        for (int hp : player_line.start_hp) hp_stride = max(hp_stride, hp + 1);
+        for (int hp : enemy_line.start_hp) hp_stride = max(hp_stride, hp + 1);
+    }
+
+    void solve(unsigned int threads) {
+        size_t states = player_line.start_hp.size() * enemy_line.start_hp.size() *
+                        (size_t)hp_stride * hp_stride;
+        player_to_move.assign(states, 0.0);
+        enemy_to_move.assign(states, 0.0);
+
+        threads = max(1u, threads);
+        if (threads == 1) {
+            solveLayers(0, 1, nullptr);
+        } else {
+            ThreadBarrier barrier(threads);
+            vector<thread> workers;
+            for (unsigned int t = 1; t < threads; t++) {
+                workers.emplace_back([this, t, threads, &barrier] { solveLayers(t, threads, &barrier); });
+            }
+            solveLayers(0, threads, &barrier);
+            for (thread& worker : workers) worker.join();
+        }
+        solved = true;
+    }
+
+    // Number of distinct (player, enemy) positions, each solved for both sides to move
+    size_t stateCount() const {
+        return (player_line.by_remaining.size() - 1) * (enemy_line.by_remaining.size() - 1);
+    }
+
+    // After solve(), calls fn(player_place, player_hp, enemy_place, enemy_hp,
+    // win chance with the player to move, win chance with the enemy to move)
+    // for every state. A place is a position in the line; for a fresh team
+    // whose lead is slot 0 it is the fighter's slot.
+    template <typename Fn>
+    void forEachState(Fn fn) const {
+        for (int player_place = 0; player_place < (int)player_line.start_hp.size(); player_place++) {
+            for (int player_hp = 1; player_hp <= player_line.start_hp[player_place]; player_hp++) {
+                for (int enemy_place = 0; enemy_place < (int)enemy_line.start_hp.size(); enemy_place++) {
+                    for (int enemy_hp = 1; enemy_hp <= enemy_line.start_hp[enemy_place]; enemy_hp++) {
+                        size_t index = stateIndex(player_place, player_hp, enemy_place, enemy_hp);
+                        fn(player_place, player_hp, enemy_place, enemy_hp,
+                           player_to_move[index], enemy_to_move[index]);
+                    }
+                }
+            }
+        }
+    }
+
+    // Player's chance of winning from the teams given to the constructor
+    double playerWinChance(bool player_moves_first = true) const {
+        if (player_line.start_hp.empty()) return 0.0;
+        if (enemy_line.start_hp.empty()) return 1.0;
+        if (!solved) return 0.0;
+        size_t start = stateIndex(0, player_line.start_hp[0], 0, enemy_line.start_hp[0]);
+        return player_moves_first ? player_to_move[start] : enemy_to_move[start];
+    }
+};
+
+// Builds a full-health team in the given order, e.g. {"Venusaur", "Charizard", "Blastoise"}
+Team createTeamInOrder(const vector<string>& order, bool is_player,
+                       pmr::memory_resource* memory = pmr::get_default_resource()) {
+    Team team(memory);
+    team.reserve(order.size());
+    for (const string& name : order) {
+        Fighter* fighter = team.add(createStarterByName(name));
+        if (fighter != nullptr) assignMovesAndSprite(*fighter, is_player);
+    }
+    return team;
 }
 
+// Player's exact chance to win a fresh battle between two team orders
+double solveWinProbability(const vector<string>& player_order, const vector<string>& enemy_order,
+                           unsigned int threads) {
+    Team player = createTeamInOrder(player_order, true);
+    Team enemy = createTeamInOrder(enemy_order, false);
+    WinProbabilitySolver solver(player, 0, enemy, 0);
+    solver.solve(threads);
+    return solver.playerWinChance();
+}
 
 // ============================================================================
 // MUSIC FUNCTIONS
@@ -536,108 +1165,1094 @@ void loadRandomBackground() {
 }
 
 // ============================================================================
-// USER DATA MANAGEMENT FUNCTIONS
+// PASSWORD HASHING - Salted PBKDF2-HMAC-SHA256, run off the render thread
 // ============================================================================
 
-vector<User> loadAllUsers() {
-    vector<User> users;
-    ifstream file(USER_DATA_FILE);
+// Stored passwords look like "pbkdf2$<iterations>$<salt hex>$<hash hex>".
+// Records without the prefix are old plain-text passwords, upgraded the next
+// time their owner logs in. Records with fewer iterations than the current
+// cost are rehashed on login the same way.
+const string PASSWORD_HASH_PREFIX = "pbkdf2$";
+const size_t PASSWORD_SALT_BYTES = 16;
+const size_t SHA256_BYTES = 32;
+
+// Hashing cost. Build with -DPASSWORD_ITERATIONS=<n> to tune it; the
+// benchmarks show what a login costs at a few settings.
+#ifndef PASSWORD_ITERATIONS
+#define PASSWORD_ITERATIONS 100000
+#endif
+const int PASSWORD_HASH_ITERATIONS = PASSWORD_ITERATIONS;
+
+class Sha256 {
+private:
+    uint32_t state[8];
+    uint64_t total_bytes = 0;
+    uint8_t block[64];
+    size_t used = 0;
+
+    static uint32_t rotr(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+    void compress(const uint8_t* chunk) {
+        static const uint32_t K[64] = {
+            0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+            0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+            0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+            0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+            0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+            0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+            0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+            0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+        };
+        uint32_t w[64];
+        for (int i = 0; i < 16; i++) {
+            w[i] = (uint32_t)chunk[i * 4] << 24 | (uint32_t)chunk[i * 4 + 1] << 16 |
+                   (uint32_t)chunk[i * 4 + 2] << 8 | chunk[i * 4 + 3];
+        }
+        for (int i = 16; i < 64; i++) {
+            uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; i++) {
+            uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + K[i] + w[i];
+            uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+        state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+        state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+    }
 
-    if (!file.is_open()) {
-        return users; // Return empty vector if file doesn't exist yet
+public:
+    Sha256() {
+        static const uint32_t INITIAL[8] = {
+            0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+        };
+        memcpy(state, INITIAL, sizeof(state));
     }
 
-    string line;
-    while (getline(file, line)) {
-        if (!line.empty()) {
-            users.push_back(User::deserialize(line));
+    void update(const uint8_t* data, size_t size) {
+        total_bytes += size;
+        while (size > 0) {
+            size_t take = min(size, sizeof(block) - used);
+            memcpy(block + used, data, take);
+            used += take;
+            data += take;
+            size -= take;
+            if (used == sizeof(block)) {
+                compress(block);
+                used = 0;
+            }
         }
     }
 
-    file.close();
-    return users;
-}
-
-void saveAllUsers(const vector<User>& users) {
-    ofstream file(USER_DATA_FILE);
+    void finish(uint8_t out[SHA256_BYTES]) {
+        uint64_t bit_length = total_bytes * 8;
+        block[used++] = 0x80;
+        if (used > 56) {
+            memset(block + used, 0, sizeof(block) - used);
+            compress(block);
+            used = 0;
+        }
+        memset(block + used, 0, 56 - used);
+        for (int i = 0; i < 8; i++) block[56 + i] = (uint8_t)(bit_length >> (56 - 8 * i));
+        compress(block);
+        for (int i = 0; i < 8; i++) {
+            out[i * 4] = (uint8_t)(state[i] >> 24);
+            out[i * 4 + 1] = (uint8_t)(state[i] >> 16);
+            out[i * 4 + 2] = (uint8_t)(state[i] >> 8);
+            out[i * 4 + 3] = (uint8_t)state[i];
+        }
+    }
+};
 
-    if (!file.is_open()) {
-        write_line("Error: Could not save user data!");
-        return;
+// PBKDF2-HMAC-SHA256 producing one 32-byte block. The keyed inner and outer
+// hash states are built once and copied for each iteration.
+void pbkdf2Sha256(const string& password, const uint8_t* salt, size_t salt_size,
+                  int iterations, uint8_t out[SHA256_BYTES]) {
+    uint8_t key[64] = {0};
+    if (password.size() > sizeof(key)) {
+        Sha256 key_hash;
+        key_hash.update((const uint8_t*)password.data(), password.size());
+        key_hash.finish(key);
+    } else {
+        memcpy(key, password.data(), password.size());
+    }
+    uint8_t inner_pad[64], outer_pad[64];
+    for (int i = 0; i < 64; i++) {
+        inner_pad[i] = key[i] ^ 0x36;
+        outer_pad[i] = key[i] ^ 0x5c;
     }
+    Sha256 inner_keyed, outer_keyed;
+    inner_keyed.update(inner_pad, sizeof(inner_pad));
+    outer_keyed.update(outer_pad, sizeof(outer_pad));
+
+    auto hmac = [&](const uint8_t* message, size_t size, const uint8_t* suffix, size_t suffix_size,
+                    uint8_t result[SHA256_BYTES]) {
+        uint8_t inner_digest[SHA256_BYTES];
+        Sha256 inner = inner_keyed;
+        inner.update(message, size);
+        if (suffix_size > 0) inner.update(suffix, suffix_size);
+        inner.finish(inner_digest);
+        Sha256 outer = outer_keyed;
+        outer.update(inner_digest, sizeof(inner_digest));
+        outer.finish(result);
+    };
+
+    const uint8_t block_index[4] = {0, 0, 0, 1};
+    uint8_t u[SHA256_BYTES];
+    hmac(salt, salt_size, block_index, sizeof(block_index), u);
+    memcpy(out, u, SHA256_BYTES);
+    for (int i = 1; i < iterations; i++) {
+        hmac(u, sizeof(u), nullptr, 0, u);
+        for (size_t j = 0; j < SHA256_BYTES; j++) out[j] ^= u[j];
+    }
+}
 
-    for (const User& user : users) {
-        file << user.serialize() << "\n";
+string toHex(const uint8_t* data, size_t size) {
+    static const char DIGITS[] = "0123456789abcdef";
+    string hex(size * 2, '0');
+    for (size_t i = 0; i < size; i++) {
+        hex[i * 2] = DIGITS[data[i] >> 4];
+        hex[i * 2 + 1] = DIGITS[data[i] & 0xF];
     }
+    return hex;
+}
 
-    file.close();
+bool fromHex(const string& hex, vector<uint8_t>& out) {
+    if (hex.size() % 2 != 0) return false;
+    out.clear();
+    for (size_t i = 0; i < hex.size(); i += 2) {
+        char pair[3] = { hex[i], hex[i + 1], '\0' };
+        char* end = nullptr;
+        unsigned long value = strtoul(pair, &end, 16);
+        if (end != pair + 2) return false;
+        out.push_back((uint8_t)value);
+    }
+    return true;
 }
 
-User* authenticateUser(vector<User>& users, const string& username, const string& password) {
-    for (size_t i = 0; i < users.size(); i++) {
-        if (users[i].getUsername() == username && users[i].getPassword() == password) {
-            return &users[i];
-        }
+// Compare without stopping at the first difference, so timing reveals
+// nothing about how much of a guess was right
+bool constantTimeEquals(const string& a, const string& b) {
+    unsigned char difference = a.size() == b.size() ? 0 : 1;
+    size_t length = max(a.size(), b.size());
+    for (size_t i = 0; i < length; i++) {
+        unsigned char x = i < a.size() ? a[i] : 0;
+        unsigned char y = i < b.size() ? b[i] : 0;
+        difference |= x ^ y;
     }
-    return nullptr;
+    return difference == 0;
 }
 
-bool usernameExists(const vector<User>& users, const string& username) {
-    for (const User& user : users) {
-        if (user.getUsername() == username) {
-            return true;
-        }
+// A new stored record for the password, with a fresh random salt
+string hashPassword(const string& password, int iterations = PASSWORD_HASH_ITERATIONS) {
+    static thread_local random_device device;
+    uint8_t salt[PASSWORD_SALT_BYTES];
+    for (size_t i = 0; i < PASSWORD_SALT_BYTES; i += 4) {
+        uint32_t random = device();
+        memcpy(salt + i, &random, min((size_t)4, PASSWORD_SALT_BYTES - i));
     }
-    return false;
+    uint8_t hash[SHA256_BYTES];
+    pbkdf2Sha256(password, salt, sizeof(salt), iterations, hash);
+    return PASSWORD_HASH_PREFIX + to_string(iterations) + "$" + toHex(salt, sizeof(salt)) +
+           "$" + toHex(hash, sizeof(hash));
 }
 
-bool registerUser(vector<User>& users, const string& username, const string& password) {
-    if (username.empty() || password.empty()) {
-        return false;
+bool isHashedPassword(const string& record) {
+    return record.compare(0, PASSWORD_HASH_PREFIX.size(), PASSWORD_HASH_PREFIX) == 0;
+}
+
+struct PasswordCheck {
+    bool matches = false;
+    string upgraded_record; // Set when the stored record should be replaced
+};
+
+// Check a password against a stored record (hashed or legacy plain text)
+PasswordCheck verifyPassword(const string& password, const string& record) {
+    PasswordCheck check;
+    if (!isHashedPassword(record)) {
+        check.matches = !record.empty() && constantTimeEquals(password, record);
+        if (check.matches) check.upgraded_record = hashPassword(password);
+        return check;
     }
 
-    if (usernameExists(users, username)) {
-        return false;
+    size_t iterations_end = record.find('$', PASSWORD_HASH_PREFIX.size());
+    size_t salt_end = iterations_end == string::npos ? string::npos : record.find('$', iterations_end + 1);
+    if (salt_end == string::npos) return check;
+    // Digits only, and few enough that they cannot overflow an int
+    string iterations_text = record.substr(PASSWORD_HASH_PREFIX.size(), iterations_end - PASSWORD_HASH_PREFIX.size());
+    if (iterations_text.empty() || iterations_text.size() > 9) return check;
+    int iterations = 0;
+    for (char c : iterations_text) {
+        if (c < '0' || c > '9') return check;
+        iterations = iterations * 10 + (c - '0');
+    }
+    vector<uint8_t> salt;
+    if (iterations <= 0 || !fromHex(record.substr(iterations_end + 1, salt_end - iterations_end - 1), salt)) {
+        return check;
     }
 
-    users.push_back(User(username, password));
-    saveAllUsers(users);
-    return true;
+    uint8_t hash[SHA256_BYTES];
+    pbkdf2Sha256(password, salt.data(), salt.size(), iterations, hash);
+    check.matches = constantTimeEquals(toHex(hash, sizeof(hash)), record.substr(salt_end + 1));
+    if (check.matches && iterations < PASSWORD_HASH_ITERATIONS) {
+        check.upgraded_record = hashPassword(password);
+    }
+    return check;
 }
 
-void updateUserStats(vector<User>& users, User* current_user) {
-    // Find and update the user in the vector
-    for (size_t i = 0; i < users.size(); i++) {
-        if (users[i].getUsername() == current_user->getUsername()) {
-            users[i] = *current_user;
-            break;
+// Checked against when a username does not exist, so unknown names take as
+// long to reject as wrong passwords. main hashes it before the login screen
+// opens; hashing it on first use would make the first unknown name slower.
+const string& decoyPasswordRecord() {
+    static const string record = hashPassword("decoy");
+    return record;
+}
+
+// Small fixed pool of threads for password work. Jobs are rare (one per
+// login), so a mutex-guarded queue is plenty.
+class HashWorkerPool {
+private:
+    vector<thread> workers;
+    deque<function<void()>> jobs;
+    mutex jobs_mutex;
+    condition_variable wake;
+    bool running = false;
+
+    void run() {
+        while (true) {
+            function<void()> job;
+            {
+                unique_lock<mutex> lock(jobs_mutex);
+                wake.wait(lock, [this] { return !running || !jobs.empty(); });
+                if (!running && jobs.empty()) return;
+                job = std::move(jobs.front());
+                jobs.pop_front();
+            }
+            job();
+        }
+    }
+
+public:
+    void start(unsigned int count) {
+        lock_guard<mutex> lock(jobs_mutex);
+        if (running) return;
+        running = true;
+        for (unsigned int i = 0; i < max(count, 1u); i++) {
+            workers.emplace_back(&HashWorkerPool::run, this);
         }
     }
-    saveAllUsers(users);
-}
 
-vector<User> getLeaderboard(const vector<User>& users) {
-    vector<User> leaderboard = users;
+    // Finishes queued jobs first
+    void stop() {
+        {
+            lock_guard<mutex> lock(jobs_mutex);
+            running = false;
+        }
+        wake.notify_all();
+        for (thread& worker : workers) worker.join();
+        workers.clear();
+    }
 
-    // Sort by total score (descending)
-    sort(leaderboard.begin(), leaderboard.end(),
-         [](const User& a, const User& b) {
-             return a.getTotalScore() > b.getTotalScore();
-         });
+    // Runs fn on a worker, or inline when the pool is not running
+    template <typename Result>
+    future<Result> submit(function<Result()> fn) {
+        auto task = make_shared<packaged_task<Result()>>(std::move(fn));
+        future<Result> result = task->get_future();
+        {
+            lock_guard<mutex> lock(jobs_mutex);
+            if (running) {
+                jobs.push_back([task] { (*task)(); });
+                wake.notify_one();
+                return result;
+            }
+        }
+        (*task)();
+        return result;
+    }
+};
 
-    return leaderboard;
-}
+HashWorkerPool password_workers;
 
 // ============================================================================
-// DRAWING FUNCTIONS - All graphics rendering
+// LEADERBOARD INDEX - Ranks kept up to date as scores change, no full sorts
 // ============================================================================
 
-color getHPBarColor(double hp_percentage) {
-    if (hp_percentage > HP_YELLOW_THRESHOLD) return COLOR_GREEN;
-    if (hp_percentage > HP_RED_THRESHOLD) return COLOR_YELLOW;
-    return COLOR_RED;
-}
-
+// Order-statistic treap over users: higher score first, ties to the earlier
+// account. Node i belongs to user i. Updating a score, finding a user's rank
+// and reading a page of ranks are all O(log n) (+ page size).
+class LeaderboardIndex {
+private:
+    struct Node {
+        int score = 0;
+        uint32_t priority = 0;
+        int left = -1;
+        int right = -1;
+        int size = 1;
+        bool present = false;
+    };
+    vector<Node> nodes;
+    int root = -1;
+    uint32_t seed = 2463534242u;
+
+    uint32_t nextPriority() {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        return seed;
+    }
+
+    bool before(int a, int b) const {
+        if (nodes[a].score != nodes[b].score) return nodes[a].score > nodes[b].score;
+        return a < b;
+    }
+
+    int sizeOf(int n) const { return n < 0 ? 0 : nodes[n].size; }
+
+    void pull(int n) { nodes[n].size = 1 + sizeOf(nodes[n].left) + sizeOf(nodes[n].right); }
+
+    // left gets every node ranked before key, right gets the rest
+    void split(int n, int key, int& left, int& right) {
+        if (n < 0) {
+            left = right = -1;
+        } else if (before(n, key)) {
+            split(nodes[n].right, key, nodes[n].right, right);
+            left = n;
+            pull(n);
+        } else {
+            split(nodes[n].left, key, left, nodes[n].left);
+            right = n;
+            pull(n);
+        }
+    }
+
+    int merge(int a, int b) {
+        if (a < 0) return b;
+        if (b < 0) return a;
+        if (nodes[a].priority > nodes[b].priority) {
+            nodes[a].right = merge(nodes[a].right, b);
+            pull(a);
+            return a;
+        }
+        nodes[b].left = merge(a, nodes[b].left);
+        pull(b);
+        return b;
+    }
+
+    int eraseNode(int n, int key) {
+        if (n == key) return merge(nodes[n].left, nodes[n].right);
+        if (before(key, n)) {
+            nodes[n].left = eraseNode(nodes[n].left, key);
+        } else {
+            nodes[n].right = eraseNode(nodes[n].right, key);
+        }
+        pull(n);
+        return n;
+    }
+
+    // In-order walk that skips whole subtrees until the first wanted rank
+    void collect(int n, int& skip, int& remaining, vector<int>& out) const {
+        if (n < 0 || remaining == 0) return;
+        if (skip >= nodes[n].size) {
+            skip -= nodes[n].size;
+            return;
+        }
+        collect(nodes[n].left, skip, remaining, out);
+        if (remaining == 0) return;
+        if (skip > 0) {
+            skip--;
+        } else {
+            out.push_back(n);
+            remaining--;
+        }
+        collect(nodes[n].right, skip, remaining, out);
+    }
+
+public:
+    void rebuild(const vector<User>& users) {
+        nodes.clear();
+        root = -1;
+        for (size_t i = 0; i < users.size(); i++) {
+            update((int)i, users[i].getTotalScore());
+        }
+    }
+
+    // Add user_index, or move it after its score changed
+    void update(int user_index, int score) {
+        if (user_index >= (int)nodes.size()) nodes.resize(user_index + 1);
+        Node& node = nodes[user_index];
+        if (node.present) {
+            if (node.score == score) return;
+            root = eraseNode(root, user_index);
+        }
+        node.score = score;
+        node.priority = nextPriority();
+        node.left = node.right = -1;
+        node.size = 1;
+        node.present = true;
+        int left, right;
+        split(root, user_index, left, right);
+        root = merge(merge(left, user_index), right);
+    }
+
+    int size() const { return sizeOf(root); }
+
+    // 0-based rank, or -1 if the user is not indexed
+    int rankOf(int user_index) const {
+        if (user_index < 0 || user_index >= (int)nodes.size() || !nodes[user_index].present) return -1;
+        int rank = 0;
+        int n = root;
+        while (n >= 0) {
+            if (n == user_index) return rank + sizeOf(nodes[n].left);
+            if (before(user_index, n)) {
+                n = nodes[n].left;
+            } else {
+                rank += sizeOf(nodes[n].left) + 1;
+                n = nodes[n].right;
+            }
+        }
+        return -1;
+    }
+
+    // User indices ranked first_rank .. first_rank + count - 1
+    void page(int first_rank, int count, vector<int>& out) const {
+        out.clear();
+        int skip = max(first_rank, 0);
+        int remaining = max(count, 0);
+        collect(root, skip, remaining, out);
+    }
+
+    // First rank of a page of count entries centred on the user
+    int pageStartAround(int user_index, int count) const {
+        int rank = rankOf(user_index);
+        if (rank < 0) return 0;
+        return max(0, min(rank - count / 2, size() - count));
+    }
+};
+
+// Ranks for all_users, kept in step by registerUser and updateUserStats
+LeaderboardIndex leaderboard_index;
+
+// ============================================================================
+// USER DATA MANAGEMENT FUNCTIONS
+// ============================================================================
+
+// Force a file's buffered data onto disk
+bool flushToDisk(FILE* file) {
+    if (fflush(file) != 0) return false;
+#ifdef _WIN32
+    return _commit(_fileno(file)) == 0;
+#else
+    return fsync(fileno(file)) == 0;
+#endif
+}
+
+// Make a rename in the file's directory durable (no-op where unsupported)
+void syncParentDirectory(const string& path) {
+#ifndef _WIN32
+    string directory = filesystem::path(path).parent_path().string();
+    int fd = ::open(directory.empty() ? "." : directory.c_str(), O_RDONLY);
+    if (fd >= 0) {
+        fsync(fd);
+        ::close(fd);
+    }
+#else
+    (void)path;
+#endif
+}
+
+// FNV-1a, used to spot torn or corrupt log records
+uint32_t recordChecksum(const string& data) {
+    uint32_t hash = 2166136261u;
+    for (unsigned char c : data) {
+        hash = (hash ^ c) * 16777619u;
+    }
+    return hash;
+}
+
+// Log records are "<8 hex digit checksum> <serialized user>"
+string makeLogRecord(const User& user) {
+    string data = user.serialize();
+    char prefix[10];
+    snprintf(prefix, sizeof(prefix), "%08x ", (unsigned)recordChecksum(data));
+    return prefix + data + "\n";
+}
+
+bool parseLogRecord(const string& line, string& data) {
+    if (line.size() < 10 || line[8] != ' ') return false;
+    data = line.substr(9);
+    return strtoul(line.substr(0, 8).c_str(), nullptr, 16) == recordChecksum(data);
+}
+
+// userdata.txt plus any updates logged after it was last written. The log
+// only ever grows by whole records, so anything that fails its checksum is
+// the tail of a write cut short by a crash and is dropped.
+vector<User> loadAllUsers(const string& path = USER_DATA_FILE) {
+    AllocationScope allocation_scope(ALLOC_PERSISTENCE);
+    vector<User> users;
+    ifstream file(path);
+
+    if (file.is_open()) {
+        string line;
+        while (getline(file, line)) {
+            if (!line.empty()) {
+                users.push_back(User::deserialize(line));
+            }
+        }
+        file.close();
+    }
+
+    ifstream log(path + USER_LOG_SUFFIX);
+    if (!log.is_open()) {
+        return users;
+    }
+
+    unordered_map<string, size_t> index;
+    for (size_t i = 0; i < users.size(); i++) {
+        index[users[i].getUsername()] = i;
+    }
+    string line, data;
+    while (getline(log, line)) {
+        if (!parseLogRecord(line, data)) break;
+        User user = User::deserialize(data);
+        auto found = index.find(user.getUsername());
+        if (found != index.end()) {
+            users[found->second] = user;
+        } else {
+            index[user.getUsername()] = users.size();
+            users.push_back(user);
+        }
+    }
+    return users;
+}
+
+// Write every user to a temp file, flush it to disk, then rename it over the
+// real file. A crash at any point leaves either the old or the new file whole.
+bool saveAllUsers(const vector<User>& users, const string& path = USER_DATA_FILE) {
+    AllocationScope allocation_scope(ALLOC_PERSISTENCE);
+    string temp_path = path + ".tmp";
+    FILE* file = fopen(temp_path.c_str(), "wb");
+
+    if (file == nullptr) {
+        write_line("Error: Could not save user data!");
+        return false;
+    }
+
+    bool written = true;
+    for (const User& user : users) {
+        string line = user.serialize() + "\n";
+        written = written && fwrite(line.data(), 1, line.size(), file) == line.size();
+    }
+    written = flushToDisk(file) && written;
+    written = fclose(file) == 0 && written;
+
+    error_code error;
+    if (written) {
+        filesystem::rename(temp_path, path, error);
+    }
+    if (!written || error) {
+        write_line("Error: Could not save user data!");
+        remove(temp_path.c_str());
+        return false;
+    }
+    syncParentDirectory(path);
+    return true;
+}
+
+// Appends each stat change to userdata.txt.log instead of rewriting every
+// account. Records are flushed to the OS straight away, so a crash of the game
+// loses nothing. fsync is a group commit: the first record after a sync opens
+// a GROUP_COMMIT_INTERVAL_MS window and the owner calls sync() by
+// syncDeadline(), so a power cut loses at most that window. PersistenceWriter
+// keeps the deadline; callers without it sync after each append. The log is
+// folded back into userdata.txt every LOG_CHECKPOINT_RECORDS records and at
+// startup.
+class UserJournal {
+private:
+    string data_path;
+    FILE* log = nullptr;
+    int records = 0;
+    bool unsynced = false;
+    chrono::steady_clock::time_point first_unsynced; // Oldest record not yet fsynced
+
+    void openLog(const char* mode) {
+        log = fopen((data_path + USER_LOG_SUFFIX).c_str(), mode);
+        if (log == nullptr) {
+            write_line("Warning: Could not open the user data log; saving whole files instead");
+        }
+        records = 0;
+        unsynced = false;
+    }
+
+public:
+    // users must already include anything replayed from the log
+    void open(const vector<User>& users, const string& path = USER_DATA_FILE) {
+        data_path = path;
+        ifstream existing(path + USER_LOG_SUFFIX, ios::ate);
+        if (existing.is_open() && existing.tellg() > 0) {
+            existing.close();
+            checkpoint(users);
+        } else {
+            openLog("ab");
+        }
+    }
+
+    // Rewrite userdata.txt from memory and start an empty log. Replaying a
+    // record twice is harmless, so a crash between the two steps is safe.
+    void checkpoint(const vector<User>& users) {
+        if (log != nullptr) fclose(log);
+        log = nullptr;
+        if (saveAllUsers(users, data_path)) {
+            openLog("wb");
+        } else {
+            openLog("ab");
+        }
+    }
+
+    // Record the latest state of one user
+    void append(const User& user, const vector<User>& users) {
+        AllocationScope allocation_scope(ALLOC_PERSISTENCE);
+        if (log == nullptr) {
+            saveAllUsers(users, data_path.empty() ? USER_DATA_FILE : data_path);
+            return;
+        }
+        string record = makeLogRecord(user);
+        if (fwrite(record.data(), 1, record.size(), log) != record.size() || fflush(log) != 0) {
+            checkpoint(users); // Fall back to a full, atomic save
+            return;
+        }
+        records++;
+        if (!unsynced) {
+            unsynced = true;
+            first_unsynced = chrono::steady_clock::now();
+        }
+
+        if (records >= LOG_CHECKPOINT_RECORDS) {
+            checkpoint(users); // Written and synced whole, so nothing is left pending
+        }
+    }
+
+    bool hasUnsynced() const { return log != nullptr && unsynced; }
+
+    // When the window opened by the oldest unsynced record closes
+    chrono::steady_clock::time_point syncDeadline() const {
+        return first_unsynced + chrono::milliseconds(GROUP_COMMIT_INTERVAL_MS);
+    }
+
+    // fsync everything appended so far
+    void sync() {
+        if (!hasUnsynced()) return;
+        flushToDisk(log);
+        unsynced = false;
+    }
+
+    void close() {
+        sync();
+        if (log != nullptr) fclose(log);
+        log = nullptr;
+    }
+};
+
+UserJournal user_journal;
+
+User* findUser(vector<User>& users, const string& username) {
+    for (User& user : users) {
+        if (user.getUsername() == username) {
+            return &user;
+        }
+    }
+    return nullptr;
+}
+
+// Queues the user's new state for the persistence thread (defined below)
+void saveUser(const User& user, const vector<User>& users);
+
+// Blocking check for headless callers; the login screen runs the same check
+// on password_workers instead
+User* authenticateUser(vector<User>& users, const string& username, const string& password) {
+    User* user = findUser(users, username);
+    PasswordCheck check = verifyPassword(password, user ? user->getPassword() : decoyPasswordRecord());
+    if (user == nullptr || !check.matches) {
+        return nullptr;
+    }
+    if (!check.upgraded_record.empty()) {
+        user->setPassword(check.upgraded_record);
+        saveUser(*user, users);
+    }
+    return user;
+}
+
+bool usernameExists(const vector<User>& users, const string& username) {
+    for (const User& user : users) {
+        if (user.getUsername() == username) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// password_record comes from hashPassword
+bool registerUser(vector<User>& users, const string& username, const string& password_record) {
+    if (username.empty() || password_record.empty()) {
+        return false;
+    }
+
+    if (usernameExists(users, username)) {
+        return false;
+    }
+
+    users.push_back(User(username, password_record));
+    leaderboard_index.update((int)users.size() - 1, users.back().getTotalScore());
+    saveUser(users.back(), users);
+    return true;
+}
+
+void updateUserStats(vector<User>& users, User* current_user) {
+    AllocationScope allocation_scope(ALLOC_PERSISTENCE);
+    // Find and update the user in the vector
+    for (size_t i = 0; i < users.size(); i++) {
+        if (users[i].getUsername() == current_user->getUsername()) {
+            users[i] = *current_user;
+            leaderboard_index.update((int)i, current_user->getTotalScore());
+            break;
+        }
+    }
+    saveUser(*current_user, users);
+}
+
+// ============================================================================
+// TEXT CACHE - Rendered text is kept as bitmaps so repeat frames are just blits
+// ============================================================================
+
+const size_t TEXT_CACHE_CAPACITY = 256;        // Rendered strings kept before evicting
+const size_t TEXT_WIDTH_CACHE_CAPACITY = 1024; // Measured strings kept before evicting
+const string ATLAS_GLYPHS = "0123456789/%.-+ ";
+
+// One rendered string. The key fields are kept to confirm a hash match.
+struct CachedText {
+    string text;
+    string font_name;
+    int size;
+    uint32_t rgba;
+    bitmap bmp;
+    int width;
+    int height;
+    list<uint64_t>::iterator lru_position;
+};
+
+struct CachedWidth {
+    string text;
+    string font_name;
+    int size;
+    int width;
+    list<uint64_t>::iterator lru_position;
+};
+
+// Pre-rendered digits and number punctuation for one font, size and colour
+struct GlyphAtlas {
+    string font_name;
+    int size;
+    uint32_t rgba;
+    bitmap bmp;
+    bool rendered;      // False if the bitmap could not be created; not retried
+    int height;
+    int offsets[16];
+    int widths[16];
+};
+
+unordered_map<uint64_t, CachedText> text_cache;
+list<uint64_t> text_cache_lru;               // Most recently used at the front
+unordered_map<uint64_t, CachedWidth> text_width_cache;
+list<uint64_t> text_width_lru;               // Most recently used at the front
+vector<GlyphAtlas> glyph_atlases;
+int text_bitmap_counter = 0;
+
+uint32_t packColor(color clr) {
+    return (uint32_t)(clr.r * 255) << 24 | (uint32_t)(clr.g * 255) << 16 |
+           (uint32_t)(clr.b * 255) << 8 | (uint32_t)(clr.a * 255);
+}
+
+// FNV-1a over the text, font and style so lookups never build a key string
+uint64_t hashText(const char* text, size_t length, const string& font_name, int size, uint32_t rgba) {
+    uint64_t hash = 14695981039346656037ULL;
+    auto mix = [&hash](uint64_t value) {
+        hash ^= value;
+        hash *= 1099511628211ULL;
+    };
+    for (size_t i = 0; i < length; i++) mix((unsigned char)text[i]);
+    mix(0xFF);
+    for (char c : font_name) mix((unsigned char)c);
+    mix((uint64_t)size);
+    mix(rgba);
+    return hash;
+}
+
+void evictOldestText() {
+    uint64_t oldest = text_cache_lru.back();
+    text_cache_lru.pop_back();
+    auto it = text_cache.find(oldest);
+    if (it != text_cache.end()) {
+        free_bitmap(it->second.bmp);
+        text_cache.erase(it);
+    }
+}
+
+int cachedTextWidth(const string& text, const string& font_name, int size) {
+    uint64_t hash = hashText(text.data(), text.size(), font_name, size, 0);
+    auto it = text_width_cache.find(hash);
+    if (it != text_width_cache.end()) {
+        CachedWidth& entry = it->second;
+        if (entry.size == size && entry.text == text && entry.font_name == font_name) {
+            text_width_lru.splice(text_width_lru.begin(), text_width_lru, entry.lru_position);
+            return entry.width;
+        }
+        // Hash collision - measure the new text in its place
+        text_width_lru.erase(entry.lru_position);
+        text_width_cache.erase(it);
+    }
+
+    if (text_width_cache.size() >= TEXT_WIDTH_CACHE_CAPACITY) {
+        text_width_cache.erase(text_width_lru.back());
+        text_width_lru.pop_back();
+    }
+    int width = text_width(text, font_name, size);
+    text_width_lru.push_front(hash);
+    text_width_cache[hash] = {text, font_name, size, width, text_width_lru.begin()};
+    return width;
+}
+
+// Find (or render and insert) the bitmap for a piece of text
+const CachedText* getCachedText(const string& text, color clr, const string& font_name, int size) {
+    uint32_t rgba = packColor(clr);
+    uint64_t hash = hashText(text.data(), text.size(), font_name, size, rgba);
+
+    auto it = text_cache.find(hash);
+    if (it != text_cache.end()) {
+        CachedText& entry = it->second;
+        if (entry.size == size && entry.rgba == rgba && entry.text == text && entry.font_name == font_name) {
+            text_cache_lru.splice(text_cache_lru.begin(), text_cache_lru, entry.lru_position);
+            return &entry;
+        }
+        // Hash collision - drop the old entry and render the new text
+        free_bitmap(entry.bmp);
+        text_cache_lru.erase(entry.lru_position);
+        text_cache.erase(it);
+    }
+
+    if (text_cache.size() >= TEXT_CACHE_CAPACITY) {
+        evictOldestText();
+    }
+
+    int width = max(1, cachedTextWidth(text, font_name, size));
+    int height = max(1, text_height(text, font_name, size));
+    bitmap bmp = create_bitmap("text_cache_" + to_string(text_bitmap_counter++), width, height);
+    if (!bitmap_valid(bmp)) return nullptr;
+    draw_text_on_bitmap(bmp, text, clr, font_name, size, 0, 0);
+
+    text_cache_lru.push_front(hash);
+    CachedText& entry = text_cache[hash];
+    entry = {text, font_name, size, rgba, bmp, width, height, text_cache_lru.begin()};
+    return &entry;
+}
+
+// Drop-in replacement for draw_text that reuses previously rendered text
+void drawCachedText(const string& text, color clr, const string& font_name, int size, double x, double y) {
+    if (text.empty()) return;
+    const CachedText* cached = getCachedText(text, clr, font_name, size);
+    if (cached == nullptr) {
+        draw_text(text, clr, font_name, size, x, y);
+        return;
+    }
+    draw_bitmap(cached->bmp, x, y);
+}
+
+GlyphAtlas* getGlyphAtlas(color clr, const string& font_name, int size) {
+    uint32_t rgba = packColor(clr);
+    for (GlyphAtlas& atlas : glyph_atlases) {
+        if (atlas.size == size && atlas.rgba == rgba && atlas.font_name == font_name) {
+            return atlas.rendered ? &atlas : nullptr;
+        }
+    }
+
+    GlyphAtlas atlas;
+    atlas.font_name = font_name;
+    atlas.size = size;
+    atlas.rgba = rgba;
+    atlas.height = max(1, text_height(ATLAS_GLYPHS, font_name, size));
+    int total_width = 0;
+    for (size_t i = 0; i < ATLAS_GLYPHS.size(); i++) {
+        atlas.offsets[i] = total_width;
+        atlas.widths[i] = text_width(string(1, ATLAS_GLYPHS[i]), font_name, size);
+        total_width += atlas.widths[i] + 1; // 1px gap so glyphs never bleed
+    }
+    atlas.bmp = create_bitmap("glyph_atlas_" + to_string(text_bitmap_counter++), max(1, total_width), atlas.height);
+    atlas.rendered = bitmap_valid(atlas.bmp);
+    if (!atlas.rendered) {
+        // Remembered so callers fall back to plain text without measuring again
+        glyph_atlases.push_back(atlas);
+        return nullptr;
+    }
+    for (size_t i = 0; i < ATLAS_GLYPHS.size(); i++) {
+        draw_text_on_bitmap(atlas.bmp, string(1, ATLAS_GLYPHS[i]), clr, font_name, size, atlas.offsets[i], 0);
+    }
+    glyph_atlases.push_back(atlas);
+    return &glyph_atlases.back();
+}
+
+// Width of a number string drawn with drawNumberText
+int numberTextWidth(const char* text, const string& font_name, int size) {
+    GlyphAtlas* atlas = getGlyphAtlas(COLOR_BLACK, font_name, size);
+    if (atlas == nullptr) return text_width(text, font_name, size);
+    int width = 0;
+    for (const char* c = text; *c; c++) {
+        size_t glyph = ATLAS_GLYPHS.find(*c);
+        if (glyph == string::npos) return text_width(text, font_name, size);
+        width += atlas->widths[glyph];
+    }
+    return width;
+}
+
+// Draw frequently changing numbers (HP, scores, percentages) glyph by glyph
+// from an atlas so new values never need a fresh text render.
+void drawNumberText(const char* text, color clr, const string& font_name, int size, double x, double y) {
+    GlyphAtlas* atlas = getGlyphAtlas(clr, font_name, size);
+    if (atlas == nullptr || strspn(text, ATLAS_GLYPHS.c_str()) != strlen(text)) {
+        drawCachedText(text, clr, font_name, size, x, y);
+        return;
+    }
+    for (const char* c = text; *c; c++) {
+        size_t glyph = ATLAS_GLYPHS.find(*c);
+        draw_bitmap(atlas->bmp, x, y,
+                    option_part_bmp(atlas->offsets[glyph], 0, atlas->widths[glyph], atlas->height));
+        x += atlas->widths[glyph];
+    }
+}
+
+// ============================================================================
+// HIT TESTING - Which button is under the mouse, resolved once per frame
+// ============================================================================
+
+const int MAX_MOVE_BUTTONS = 4;
+const int MAX_SWITCH_BUTTONS = 4;
+
+enum UiButton {
+    BUTTON_NONE = -1,
+    BUTTON_LOGIN_USERNAME,
+    BUTTON_LOGIN_PASSWORD,
+    BUTTON_LOGIN_PRIMARY,    // Login / Register
+    BUTTON_LOGIN_SECONDARY,  // Register / Back
+    BUTTON_MENU_PLAY,
+    BUTTON_MENU_LEADERBOARD,
+    BUTTON_MENU_LOGOUT,
+    BUTTON_LEADERBOARD_BACK,
+    BUTTON_MOVE_FIRST,
+    BUTTON_SWITCH_FIRST = BUTTON_MOVE_FIRST + MAX_MOVE_BUTTONS,
+    NUM_UI_BUTTONS = BUTTON_SWITCH_FIRST + MAX_SWITCH_BUTTONS
+};
+
+const int HIT_GRID_CELL_SIZE = 50;
+const int HIT_GRID_COLUMNS = (WINDOW_WIDTH + HIT_GRID_CELL_SIZE - 1) / HIT_GRID_CELL_SIZE;
+const int HIT_GRID_ROWS = (WINDOW_HEIGHT + HIT_GRID_CELL_SIZE - 1) / HIT_GRID_CELL_SIZE;
+
+// Uniform grid over the window. Each cell lists the buttons overlapping it,
+// so a lookup only checks the handful of rectangles in one cell.
+struct HitGrid {
+    vector<UiButton> buttons;
+    vector<rectangle> bounds;
+    vector<int> cells[HIT_GRID_COLUMNS * HIT_GRID_ROWS];
+};
+
+HitGrid login_hit_grid;
+HitGrid menu_hit_grid;
+HitGrid leaderboard_hit_grid;
+HitGrid battle_hit_grid;
+UiButton hovered_button = BUTTON_NONE;
+
+void addHitButton(HitGrid& grid, UiButton button, int x, int y, int width, int height) {
+    int index = static_cast<int>(grid.buttons.size());
+    grid.buttons.push_back(button);
+    grid.bounds.push_back(rectangle_from(x, y, width, height));
+
+    int first_col = max(0, x / HIT_GRID_CELL_SIZE);
+    int last_col = min(HIT_GRID_COLUMNS - 1, (x + width) / HIT_GRID_CELL_SIZE);
+    int first_row = max(0, y / HIT_GRID_CELL_SIZE);
+    int last_row = min(HIT_GRID_ROWS - 1, (y + height) / HIT_GRID_CELL_SIZE);
+    for (int row = first_row; row <= last_row; row++) {
+        for (int col = first_col; col <= last_col; col++) {
+            grid.cells[row * HIT_GRID_COLUMNS + col].push_back(index);
+        }
+    }
+}
+
+UiButton hitTest(const HitGrid& grid, double x, double y) {
+    if (x < 0 || y < 0 || x >= WINDOW_WIDTH || y >= WINDOW_HEIGHT) return BUTTON_NONE;
+    int cell = (int)y / HIT_GRID_CELL_SIZE * HIT_GRID_COLUMNS + (int)x / HIT_GRID_CELL_SIZE;
+    for (int index : grid.cells[cell]) {
+        const rectangle& r = grid.bounds[index];
+        // Edges are inclusive, matching the original bounds checks
+        if (x >= r.x && x <= r.x + r.width && y >= r.y && y <= r.y + r.height) {
+            return grid.buttons[index];
+        }
+    }
+    return BUTTON_NONE;
+}
+
+int moveButtonX(int index) {
+    return MOVE_BUTTON_START_X + index * MOVE_BUTTON_SPACING;
+}
+
+// Build every screen's grid once from the layout constants
+void buildHitGrids() {
+    addHitButton(login_hit_grid, BUTTON_LOGIN_USERNAME, LOGIN_FIELD_X, LOGIN_USERNAME_FIELD_Y,
+                 INPUT_FIELD_WIDTH, INPUT_FIELD_HEIGHT);
+    addHitButton(login_hit_grid, BUTTON_LOGIN_PASSWORD, LOGIN_FIELD_X, LOGIN_PASSWORD_FIELD_Y,
+                 INPUT_FIELD_WIDTH, INPUT_FIELD_HEIGHT);
+    addHitButton(login_hit_grid, BUTTON_LOGIN_PRIMARY, LOGIN_PRIMARY_BUTTON_X, LOGIN_BUTTON_Y,
+                 BUTTON_WIDTH, BUTTON_HEIGHT);
+    addHitButton(login_hit_grid, BUTTON_LOGIN_SECONDARY, LOGIN_SECONDARY_BUTTON_X, LOGIN_BUTTON_Y,
+                 BUTTON_WIDTH, BUTTON_HEIGHT);
+
+    addHitButton(menu_hit_grid, BUTTON_MENU_PLAY, MENU_BUTTON_X, MENU_FIRST_BUTTON_Y,
+                 MENU_BUTTON_WIDTH, MENU_BUTTON_HEIGHT);
+    addHitButton(menu_hit_grid, BUTTON_MENU_LEADERBOARD, MENU_BUTTON_X, MENU_FIRST_BUTTON_Y + MENU_BUTTON_SPACING,
+                 MENU_BUTTON_WIDTH, MENU_BUTTON_HEIGHT);
+    addHitButton(menu_hit_grid, BUTTON_MENU_LOGOUT, MENU_BUTTON_X, MENU_FIRST_BUTTON_Y + 2 * MENU_BUTTON_SPACING,
+                 MENU_BUTTON_WIDTH, MENU_BUTTON_HEIGHT);
+
+    addHitButton(leaderboard_hit_grid, BUTTON_LEADERBOARD_BACK, BACK_BUTTON_X, BACK_BUTTON_Y,
+                 BACK_BUTTON_WIDTH, BACK_BUTTON_HEIGHT);
+
+    for (int i = 0; i < MAX_MOVE_BUTTONS; i++) {
+        addHitButton(battle_hit_grid, static_cast<UiButton>(BUTTON_MOVE_FIRST + i), moveButtonX(i), MOVE_BUTTON_Y,
+                     MOVE_BUTTON_WIDTH, MOVE_BUTTON_HEIGHT);
+    }
+    for (int i = 0; i < MAX_SWITCH_BUTTONS; i++) {
+        addHitButton(battle_hit_grid, static_cast<UiButton>(BUTTON_SWITCH_FIRST + i), moveButtonX(i), SWITCH_BUTTON_Y,
+                     MOVE_BUTTON_WIDTH, SWITCH_BUTTON_HEIGHT);
+    }
+}
+
+bool isMoveButton(UiButton button) {
+    return button >= BUTTON_MOVE_FIRST && button < BUTTON_MOVE_FIRST + MAX_MOVE_BUTTONS;
+}
+
+bool isSwitchButton(UiButton button) {
+    return button >= BUTTON_SWITCH_FIRST && button < BUTTON_SWITCH_FIRST + MAX_SWITCH_BUTTONS;
+}
+
+// ============================================================================
+// DRAWING FUNCTIONS - All graphics rendering
+// ============================================================================
+
+color getHPBarColor(double hp_percentage) {
+    if (hp_percentage > HP_YELLOW_THRESHOLD) return COLOR_GREEN;
+    if (hp_percentage > HP_RED_THRESHOLD) return COLOR_YELLOW;
+    return COLOR_RED;
+}
+
 color getFighterColor(string fighter_type) {
     if (fighter_type == "Fire") return COLOR_ORANGE;
     if (fighter_type == "Water") return COLOR_BLUE;
@@ -701,12 +2316,13 @@ void drawHPBar(const Fighter& fighter, int x, int y, int width, int height) {
     draw_rectangle(COLOR_BLACK, x, y, width, height);
     
     // Display HP text with shadow
-    string hp_text = to_string(fighter.getHP()) + "/" + to_string(fighter.getMaxHP());
-    int text_w = text_width(hp_text, DEFAULT_FONT, 16);
+    char hp_text[24];
+    snprintf(hp_text, sizeof(hp_text), "%d/%d", fighter.getHP(), fighter.getMaxHP());
+    int text_w = numberTextWidth(hp_text, DEFAULT_FONT, 16);
     int text_x = x + (width - text_w) / 2;
     int text_y = y + (height - 16) / 2;
-    draw_text(hp_text, COLOR_BLACK, DEFAULT_FONT, 16, text_x + 1, text_y + 1);
-    draw_text(hp_text, COLOR_WHITE, DEFAULT_FONT, 16, text_x, text_y);
+    drawNumberText(hp_text, COLOR_BLACK, DEFAULT_FONT, 16, text_x + 1, text_y + 1);
+    drawNumberText(hp_text, COLOR_WHITE, DEFAULT_FONT, 16, text_x, text_y);
 }
 
 void drawMoveButton(const Move& move, int x, int y, int width, int height, bool is_hovered) {
@@ -726,20 +2342,27 @@ void drawMoveButton(const Move& move, int x, int y, int width, int height, bool
     }
     
     // Move name - top center, large and bold
-    draw_text(move.getName(), COLOR_BLACK, DEFAULT_FONT, 18, x + 8, y + 8);
+    drawCachedText(move.getName(), COLOR_BLACK, DEFAULT_FONT, 18, x + 8, y + 8);
     
     // Divider line
     draw_line(COLOR_LIGHT_GRAY, x + 5, y + 32, x + width - 5, y + 32);
     
     // Type - bottom left
-    draw_text(move.getType(), rgb_color(100, 100, 100), DEFAULT_FONT, 13, x + 8, y + 40);
+    drawCachedText(move.getType(), rgb_color(100, 100, 100), DEFAULT_FONT, 13, x + 8, y + 40);
     
     // Power - bottom right
-    string power_text = "PWR " + to_string(move.getDamage());
-    draw_text(power_text, rgb_color(100, 100, 100), DEFAULT_FONT, 13, x + width - 70, y + 40);
+    color detail_color = rgb_color(100, 100, 100);
+    char number_text[16];
+    snprintf(number_text, sizeof(number_text), "%d", move.getDamage());
+    drawCachedText("PWR ", detail_color, DEFAULT_FONT, 13, x + width - 70, y + 40);
+    drawNumberText(number_text, detail_color, DEFAULT_FONT, 13,
+                   x + width - 70 + cachedTextWidth("PWR ", DEFAULT_FONT, 13), y + 40);
 
     // Accuracy - bottom left below type
-    draw_text("ACC " + to_string(move.getAccuracy()) + "%", rgb_color(100, 100, 100), DEFAULT_FONT, 13, x + 8, y + 58);
+    snprintf(number_text, sizeof(number_text), "%d%%", move.getAccuracy());
+    drawCachedText("ACC ", detail_color, DEFAULT_FONT, 13, x + 8, y + 58);
+    drawNumberText(number_text, detail_color, DEFAULT_FONT, 13,
+                   x + 8 + cachedTextWidth("ACC ", DEFAULT_FONT, 13), y + 58);
 }
 
 void drawSwitchButton(const Fighter& fighter, int x, int y, int width, int height, bool is_active, bool is_disabled, bool is_hovered) {
@@ -755,14 +2378,15 @@ void drawSwitchButton(const Fighter& fighter, int x, int y, int width, int heigh
     fill_rectangle(base_color, x, y, width, height);
     draw_rectangle(COLOR_BLACK, x, y, width, height);
 
-    draw_text(fighter.getName(), COLOR_BLACK, DEFAULT_FONT, 14, x + 8, y + 8);
-    string hp_text = to_string(fighter.getHP()) + "/" + to_string(fighter.getMaxHP());
+    drawCachedText(fighter.getName(), COLOR_BLACK, DEFAULT_FONT, 14, x + 8, y + 8);
+    char hp_text[24];
+    snprintf(hp_text, sizeof(hp_text), "%d/%d", fighter.getHP(), fighter.getMaxHP());
     color hp_color = fighter.isAlive() ? COLOR_BLACK : COLOR_GRAY;
-    int hp_w = text_width(hp_text, DEFAULT_FONT, 12);
-    draw_text(hp_text, hp_color, DEFAULT_FONT, 12, x + width - hp_w - 8, y + height - 18);
+    int hp_w = numberTextWidth(hp_text, DEFAULT_FONT, 12);
+    drawNumberText(hp_text, hp_color, DEFAULT_FONT, 12, x + width - hp_w - 8, y + height - 18);
 }
 
-void drawTeamStatus(const vector<Fighter>& team, int active_index, int start_x, int y) {
+void drawTeamStatus(const Team& team, int active_index, int start_x, int y) {
     const int box_width = 130;
     const int box_height = 46;
     const int spacing = 14;
@@ -777,9 +2401,10 @@ void drawTeamStatus(const vector<Fighter>& team, int active_index, int start_x,
         fill_rectangle(bg, x, y, box_width, box_height);
         draw_rectangle(COLOR_BLACK, x, y, box_width, box_height);
 
-        draw_text(team[i].getName(), COLOR_BLACK, DEFAULT_FONT, 12, x + 6, y + 6);
-        string hp_text = to_string(team[i].getHP()) + "/" + to_string(team[i].getMaxHP());
-        draw_text(hp_text, COLOR_BLACK, DEFAULT_FONT, 12, x + 6, y + 22);
+        drawCachedText(team[i].getName(), COLOR_BLACK, DEFAULT_FONT, 12, x + 6, y + 6);
+        char hp_text[24];
+        snprintf(hp_text, sizeof(hp_text), "%d/%d", team[i].getHP(), team[i].getMaxHP());
+        drawNumberText(hp_text, COLOR_BLACK, DEFAULT_FONT, 12, x + 6, y + 22);
     }
 }
 
@@ -788,10 +2413,13 @@ void drawTurnInfo(int turn_number) {
     int box_height = 44;
     int box_x = (WINDOW_WIDTH - box_width) / 2;
     fill_rectangle(rgba_color(0, 0, 0, 180), box_x, 20, box_width, box_height);
-    string turn_text = "Turn " + to_string(turn_number);
-    int text_w = text_width(turn_text, DEFAULT_FONT, 24);
+    char turn_digits[16];
+    snprintf(turn_digits, sizeof(turn_digits), "%d", turn_number);
+    int label_w = cachedTextWidth("Turn ", DEFAULT_FONT, 24);
+    int text_w = label_w + numberTextWidth(turn_digits, DEFAULT_FONT, 24);
     int text_x = box_x + (box_width - text_w) / 2;
-    draw_text(turn_text, COLOR_WHITE, DEFAULT_FONT, 24, text_x, 28);
+    drawCachedText("Turn ", COLOR_WHITE, DEFAULT_FONT, 24, text_x, 28);
+    drawNumberText(turn_digits, COLOR_WHITE, DEFAULT_FONT, 24, text_x + label_w, 28);
 }
 
 vector<string> wrapBattleText(const string& text, size_t max_len, size_t max_lines = 2) {
@@ -823,7 +2451,7 @@ void drawBattleLog(const string& log_text) {
     size_t max_chars = 100;
     vector<string> lines = wrapBattleText(log_text, max_chars);
     for (size_t i = 0; i < lines.size(); i++) {
-        draw_text(lines[i], COLOR_WHITE, DEFAULT_FONT, 18, log_x + 15, log_y + 18 + (int)i * 26);
+        drawCachedText(lines[i], COLOR_WHITE, DEFAULT_FONT, 18, log_x + 15, log_y + 18 + (int)i * 26);
     }
 }
 
@@ -835,8 +2463,8 @@ void drawBackground() {
         draw_bitmap(current_background, 0, 0,
                     option_scale_bmp(scale_x, scale_y));
     } else {
-        // Fallback gradient
-        clear_screen(rgb_color(135, 206, 235));
+        // Fallback gradient (filled rather than cleared so region clipping applies)
+        fill_rectangle(rgb_color(135, 206, 235), 0, 0, WINDOW_WIDTH, WINDOW_HEIGHT);
         fill_rectangle(rgb_color(34, 139, 34), 0, GROUND_Y, WINDOW_WIDTH, GROUND_HEIGHT);
     }
 }
@@ -865,14 +2493,14 @@ void drawInputField(int x, int y, int width, int height, const string& text,
     }
 
     if (display_text.empty()) {
-        draw_text(placeholder, rgb_color(150, 150, 150), DEFAULT_FONT, 16, x + 10, y + 12);
+        drawCachedText(placeholder, rgb_color(150, 150, 150), DEFAULT_FONT, 16, x + 10, y + 12);
     } else {
-        draw_text(display_text, COLOR_BLACK, DEFAULT_FONT, 16, x + 10, y + 12);
+        drawCachedText(display_text, COLOR_BLACK, DEFAULT_FONT, 16, x + 10, y + 12);
     }
 
     // Draw cursor if active
     if (is_active) {
-        int cursor_x = x + 10 + text_width(display_text, DEFAULT_FONT, 16);
+        int cursor_x = x + 10 + cachedTextWidth(display_text, DEFAULT_FONT, 16);
         draw_line(COLOR_BLACK, cursor_x, y + 8, cursor_x, y + height - 8);
     }
 }
@@ -887,10 +2515,10 @@ void drawButton(int x, int y, int width, int height, const string& text, bool is
     draw_rectangle(COLOR_BLACK, x, y, width, height);
 
     // Center text
-    int text_w = text_width(text, DEFAULT_FONT, 20);
+    int text_w = cachedTextWidth(text, DEFAULT_FONT, 20);
     int text_x = x + (width - text_w) / 2;
     int text_y = y + (height - 20) / 2;
-    draw_text(text, COLOR_WHITE, DEFAULT_FONT, 20, text_x, text_y);
+    drawCachedText(text, COLOR_WHITE, DEFAULT_FONT, 20, text_x, text_y);
 }
 
 void drawLoginScreen(const string& username_input, const string& password_input,
@@ -905,52 +2533,43 @@ void drawLoginScreen(const string& username_input, const string& password_input,
 
     // Title
     string title = is_register_mode ? "REGISTER" : "LOGIN";
-    int title_w = text_width(title, DEFAULT_FONT, 36);
-    draw_text(title, rgb_color(0, 100, 200), DEFAULT_FONT, 36,
+    int title_w = cachedTextWidth(title, DEFAULT_FONT, 36);
+    drawCachedText(title, rgb_color(0, 100, 200), DEFAULT_FONT, 36,
               LOGIN_BOX_X + (LOGIN_BOX_WIDTH - title_w) / 2.0, LOGIN_BOX_Y + 30);
 
     // Game title
     string subtitle = "Pokemon Battle Simulator";
-    int subtitle_w = text_width(subtitle, DEFAULT_FONT, 22);
-    draw_text(subtitle, COLOR_BLACK, DEFAULT_FONT, 22,
+    int subtitle_w = cachedTextWidth(subtitle, DEFAULT_FONT, 22);
+    drawCachedText(subtitle, COLOR_BLACK, DEFAULT_FONT, 22,
               LOGIN_BOX_X + (LOGIN_BOX_WIDTH - subtitle_w) / 2.0, LOGIN_BOX_Y + 90);
 
     // Username field
-    draw_text("Username:", COLOR_BLACK, DEFAULT_FONT, 18, LOGIN_BOX_X + 50, LOGIN_BOX_Y + 150);
-    drawInputField(LOGIN_BOX_X + 50, LOGIN_BOX_Y + 180, INPUT_FIELD_WIDTH,
+    drawCachedText("Username:", COLOR_BLACK, DEFAULT_FONT, 18, LOGIN_FIELD_X, LOGIN_USERNAME_FIELD_Y - 30);
+    drawInputField(LOGIN_FIELD_X, LOGIN_USERNAME_FIELD_Y, INPUT_FIELD_WIDTH,
                    INPUT_FIELD_HEIGHT, username_input, "Enter username", active_field == 0);
 
     // Password field
-    draw_text("Password:", COLOR_BLACK, DEFAULT_FONT, 18, LOGIN_BOX_X + 50, LOGIN_BOX_Y + 260);
-    drawInputField(LOGIN_BOX_X + 50, LOGIN_BOX_Y + 290, INPUT_FIELD_WIDTH,
+    drawCachedText("Password:", COLOR_BLACK, DEFAULT_FONT, 18, LOGIN_FIELD_X, LOGIN_PASSWORD_FIELD_Y - 30);
+    drawInputField(LOGIN_FIELD_X, LOGIN_PASSWORD_FIELD_Y, INPUT_FIELD_WIDTH,
                    INPUT_FIELD_HEIGHT, password_input, "Enter password", active_field == 1, true);
 
     // Error message
     if (!error_message.empty()) {
-        draw_text(error_message, COLOR_RED, DEFAULT_FONT, 16,
+        drawCachedText(error_message, COLOR_RED, DEFAULT_FONT, 16,
                   LOGIN_BOX_X + 50, LOGIN_BOX_Y + 360);
     }
 
     // Buttons
-    int btn1_x = LOGIN_BOX_X + 60;
-    int btn2_x = LOGIN_BOX_X + LOGIN_BOX_WIDTH - BUTTON_WIDTH - 60;
-    int btn_y = LOGIN_BOX_Y + LOGIN_BOX_HEIGHT - 120;
-
-    bool btn1_hover = mouse_x() >= btn1_x && mouse_x() <= btn1_x + BUTTON_WIDTH &&
-                      mouse_y() >= btn_y && mouse_y() <= btn_y + BUTTON_HEIGHT;
-    bool btn2_hover = mouse_x() >= btn2_x && mouse_x() <= btn2_x + BUTTON_WIDTH &&
-                      mouse_y() >= btn_y && mouse_y() <= btn_y + BUTTON_HEIGHT;
-
-    if (is_register_mode) {
-        drawButton(btn1_x, btn_y, BUTTON_WIDTH, BUTTON_HEIGHT, "Register", btn1_hover);
-        drawButton(btn2_x, btn_y, BUTTON_WIDTH, BUTTON_HEIGHT, "Back", btn2_hover);
-    } else {
-        drawButton(btn1_x, btn_y, BUTTON_WIDTH, BUTTON_HEIGHT, "Login", btn1_hover);
-        drawButton(btn2_x, btn_y, BUTTON_WIDTH, BUTTON_HEIGHT, "Register", btn2_hover);
-    }
+    bool btn1_hover = hovered_button == BUTTON_LOGIN_PRIMARY;
+    bool btn2_hover = hovered_button == BUTTON_LOGIN_SECONDARY;
+
+    drawButton(LOGIN_PRIMARY_BUTTON_X, LOGIN_BUTTON_Y, BUTTON_WIDTH, BUTTON_HEIGHT,
+               is_register_mode ? "Register" : "Login", btn1_hover);
+    drawButton(LOGIN_SECONDARY_BUTTON_X, LOGIN_BUTTON_Y, BUTTON_WIDTH, BUTTON_HEIGHT,
+               is_register_mode ? "Back" : "Register", btn2_hover);
 
     // Instructions
-    draw_text("Press TAB to switch fields", rgb_color(100, 100, 100), DEFAULT_FONT, 14,
+    drawCachedText("Press TAB to switch fields", rgb_color(100, 100, 100), DEFAULT_FONT, 14,
               LOGIN_BOX_X + 50, LOGIN_BOX_Y + LOGIN_BOX_HEIGHT - 50);
 }
 
@@ -960,42 +2579,39 @@ void drawMainMenu(const string& username) {
 
     // Title
     string header = "POKEMON BATTLE SIMULATOR";
-    int header_w = text_width(header, DEFAULT_FONT, 44);
-    draw_text(header, rgb_color(255, 200, 0), DEFAULT_FONT, 44,
+    int header_w = cachedTextWidth(header, DEFAULT_FONT, 44);
+    drawCachedText(header, rgb_color(255, 200, 0), DEFAULT_FONT, 44,
               (WINDOW_WIDTH - header_w) / 2.0, 90);
 
     // Welcome message
     string welcome = "Welcome, " + username + "!";
-    int welcome_w = text_width(welcome, DEFAULT_FONT, 26);
-    draw_text(welcome, COLOR_WHITE, DEFAULT_FONT, 26,
+    int welcome_w = cachedTextWidth(welcome, DEFAULT_FONT, 26);
+    drawCachedText(welcome, COLOR_WHITE, DEFAULT_FONT, 26,
               (WINDOW_WIDTH - welcome_w) / 2.0, 160);
 
     // Menu buttons
-    int btn_x = (WINDOW_WIDTH / 2) - (MENU_BUTTON_WIDTH / 2);
-    int btn1_y = 250;
+    int btn1_y = MENU_FIRST_BUTTON_Y;
     int btn2_y = btn1_y + MENU_BUTTON_SPACING;
     int btn3_y = btn2_y + MENU_BUTTON_SPACING;
 
-    bool btn1_hover = mouse_x() >= btn_x && mouse_x() <= btn_x + MENU_BUTTON_WIDTH &&
-                      mouse_y() >= btn1_y && mouse_y() <= btn1_y + MENU_BUTTON_HEIGHT;
-    bool btn2_hover = mouse_x() >= btn_x && mouse_x() <= btn_x + MENU_BUTTON_WIDTH &&
-                      mouse_y() >= btn2_y && mouse_y() <= btn2_y + MENU_BUTTON_HEIGHT;
-    bool btn3_hover = mouse_x() >= btn_x && mouse_x() <= btn_x + MENU_BUTTON_WIDTH &&
-                      mouse_y() >= btn3_y && mouse_y() <= btn3_y + MENU_BUTTON_HEIGHT;
-
-    drawButton(btn_x, btn1_y, MENU_BUTTON_WIDTH, MENU_BUTTON_HEIGHT, "PLAY BATTLE", btn1_hover);
-    drawButton(btn_x, btn2_y, MENU_BUTTON_WIDTH, MENU_BUTTON_HEIGHT, "LEADERBOARD", btn2_hover);
-    drawButton(btn_x, btn3_y, MENU_BUTTON_WIDTH, MENU_BUTTON_HEIGHT, "LOGOUT", btn3_hover);
+    drawButton(MENU_BUTTON_X, btn1_y, MENU_BUTTON_WIDTH, MENU_BUTTON_HEIGHT, "PLAY BATTLE",
+               hovered_button == BUTTON_MENU_PLAY);
+    drawButton(MENU_BUTTON_X, btn2_y, MENU_BUTTON_WIDTH, MENU_BUTTON_HEIGHT, "LEADERBOARD",
+               hovered_button == BUTTON_MENU_LEADERBOARD);
+    drawButton(MENU_BUTTON_X, btn3_y, MENU_BUTTON_WIDTH, MENU_BUTTON_HEIGHT, "LOGOUT",
+               hovered_button == BUTTON_MENU_LOGOUT);
 }
 
-void drawLeaderboard(const vector<User>& leaderboard, const string& current_username) {
+// page_users holds the indices in users of the rows ranked first_rank onwards
+void drawLeaderboard(const vector<User>& users, const vector<int>& page_users, int first_rank,
+                     int total_users, const string& current_username, int current_rank) {
     // Background
     clear_screen(rgb_color(50, 50, 80));
 
     // Title
     string title = "LEADERBOARD";
-    int title_w = text_width(title, DEFAULT_FONT, 44);
-    draw_text(title, rgb_color(255, 200, 0), DEFAULT_FONT, 44,
+    int title_w = cachedTextWidth(title, DEFAULT_FONT, 44);
+    drawCachedText(title, rgb_color(255, 200, 0), DEFAULT_FONT, 44,
               (WINDOW_WIDTH - title_w) / 2.0, 40);
 
     // Draw leaderboard box
@@ -1012,22 +2628,21 @@ void drawLeaderboard(const vector<User>& leaderboard, const string& current_user
     int col_wl = LEADERBOARD_X + 520;
     int col_win = LEADERBOARD_X + 640;
     int col_streak = LEADERBOARD_X + 780;
-    draw_text("Rank", COLOR_BLACK, DEFAULT_FONT, 18, col_rank, header_y);
-    draw_text("Username", COLOR_BLACK, DEFAULT_FONT, 18, col_name, header_y);
-    draw_text("Score", COLOR_BLACK, DEFAULT_FONT, 18, col_score, header_y);
-    draw_text("W/L", COLOR_BLACK, DEFAULT_FONT, 18, col_wl, header_y);
-    draw_text("Win%", COLOR_BLACK, DEFAULT_FONT, 18, col_win, header_y);
-    draw_text("Streak", COLOR_BLACK, DEFAULT_FONT, 18, col_streak, header_y);
+    drawCachedText("Rank", COLOR_BLACK, DEFAULT_FONT, 18, col_rank, header_y);
+    drawCachedText("Username", COLOR_BLACK, DEFAULT_FONT, 18, col_name, header_y);
+    drawCachedText("Score", COLOR_BLACK, DEFAULT_FONT, 18, col_score, header_y);
+    drawCachedText("W/L", COLOR_BLACK, DEFAULT_FONT, 18, col_wl, header_y);
+    drawCachedText("Win%", COLOR_BLACK, DEFAULT_FONT, 18, col_win, header_y);
+    drawCachedText("Streak", COLOR_BLACK, DEFAULT_FONT, 18, col_streak, header_y);
 
     // Divider line
     draw_line(COLOR_GRAY, LEADERBOARD_X + 10, header_y + 25,
               LEADERBOARD_X + LEADERBOARD_WIDTH - 10, header_y + 25);
 
-    // Display top 10 users
-    int max_display = min(10, (int)leaderboard.size());
-    for (int i = 0; i < max_display; i++) {
-        int row_y = header_y + 45 + (i * 35);
-        const User& user = leaderboard[i];
+    // Display one page of ranks
+    for (size_t i = 0; i < page_users.size(); i++) {
+        int row_y = header_y + 45 + ((int)i * LEADERBOARD_ROW_HEIGHT);
+        const User& user = users[page_users[i]];
 
         // Highlight current user
         bool is_current = (user.getUsername() == current_username);
@@ -1038,41 +2653,56 @@ void drawLeaderboard(const vector<User>& leaderboard, const string& current_user
 
         color text_color = is_current ? rgb_color(200, 0, 0) : COLOR_BLACK;
 
+        char number_text[24];
+
         // Rank
-        draw_text(to_string(i + 1), text_color, DEFAULT_FONT, 16, col_rank, row_y);
+        snprintf(number_text, sizeof(number_text), "%d", first_rank + (int)i + 1);
+        drawNumberText(number_text, text_color, DEFAULT_FONT, 16, col_rank, row_y);
 
         // Username
         string display_name = user.getUsername();
         if (display_name.length() > 15) {
             display_name = display_name.substr(0, 12) + "...";
         }
-        draw_text(display_name, text_color, DEFAULT_FONT, 16, col_name, row_y);
+        drawCachedText(display_name, text_color, DEFAULT_FONT, 16, col_name, row_y);
 
         // Score
-        draw_text(to_string(user.getTotalScore()), text_color, DEFAULT_FONT, 16,
-                  col_score, row_y);
+        snprintf(number_text, sizeof(number_text), "%d", user.getTotalScore());
+        drawNumberText(number_text, text_color, DEFAULT_FONT, 16, col_score, row_y);
 
         // W/L
-        string wl = to_string(user.getWins()) + "/" + to_string(user.getLosses());
-        draw_text(wl, text_color, DEFAULT_FONT, 16, col_wl, row_y);
+        snprintf(number_text, sizeof(number_text), "%d/%d", user.getWins(), user.getLosses());
+        drawNumberText(number_text, text_color, DEFAULT_FONT, 16, col_wl, row_y);
 
         // Win%
-        char win_rate[10];
-        snprintf(win_rate, sizeof(win_rate), "%.1f%%", user.getWinRate());
-        draw_text(string(win_rate), text_color, DEFAULT_FONT, 16, col_win, row_y);
+        snprintf(number_text, sizeof(number_text), "%.1f%%", user.getWinRate());
+        drawNumberText(number_text, text_color, DEFAULT_FONT, 16, col_win, row_y);
 
         // Best Streak
-        draw_text(to_string(user.getBestStreak()), text_color, DEFAULT_FONT, 16,
-                  col_streak, row_y);
+        snprintf(number_text, sizeof(number_text), "%d", user.getBestStreak());
+        drawNumberText(number_text, text_color, DEFAULT_FONT, 16, col_streak, row_y);
     }
 
-    // Back button
-    int back_btn_x = WINDOW_WIDTH / 2 - 75;
-    int back_btn_y = LEADERBOARD_Y + LEADERBOARD_HEIGHT + 20;
-    bool back_hover = mouse_x() >= back_btn_x && mouse_x() <= back_btn_x + 150 &&
-                      mouse_y() >= back_btn_y && mouse_y() <= back_btn_y + 45;
+    // Position in the list, the player's own rank and how to move around
+    int footer_y = LEADERBOARD_Y + LEADERBOARD_HEIGHT - 32;
+    char footer_text[48];
+    color footer_color = rgb_color(90, 90, 90);
+    drawCachedText("Ranks", footer_color, DEFAULT_FONT, 14, col_rank, footer_y);
+    int shown_last = first_rank + (int)page_users.size();
+    snprintf(footer_text, sizeof(footer_text), "%d-%d / %d", page_users.empty() ? 0 : first_rank + 1,
+             shown_last, total_users);
+    drawNumberText(footer_text, footer_color, DEFAULT_FONT, 14, col_rank + 50, footer_y);
+    if (current_rank >= 0) {
+        drawCachedText("Your rank", footer_color, DEFAULT_FONT, 14, col_name + 100, footer_y);
+        snprintf(footer_text, sizeof(footer_text), "%d", current_rank + 1);
+        drawNumberText(footer_text, footer_color, DEFAULT_FONT, 14, col_name + 180, footer_y);
+    }
+    drawCachedText("Scroll, Up/Down, PgUp/PgDn, Home/End, M = me", footer_color, DEFAULT_FONT, 14,
+                   col_wl, footer_y);
 
-    drawButton(back_btn_x, back_btn_y, 150, 45, "BACK", back_hover);
+    // Back button
+    drawButton(BACK_BUTTON_X, BACK_BUTTON_Y, BACK_BUTTON_WIDTH, BACK_BUTTON_HEIGHT, "BACK",
+               hovered_button == BUTTON_LEADERBOARD_BACK);
 }
 
 void drawVictoryScreen() {
@@ -1089,14 +2719,14 @@ void drawVictoryScreen() {
 
     // Draw text
     string title = "YOU WON!";
-    int title_w = text_width(title, DEFAULT_FONT, 64);
-    draw_text(title, COLOR_GREEN, DEFAULT_FONT, 64, box_x + (box_width - title_w) / 2.0, box_y + 40);
+    int title_w = cachedTextWidth(title, DEFAULT_FONT, 64);
+    drawCachedText(title, COLOR_GREEN, DEFAULT_FONT, 64, box_x + (box_width - title_w) / 2.0, box_y + 40);
     string subtitle = "Congratulations!";
-    int sub_w = text_width(subtitle, DEFAULT_FONT, 28);
-    draw_text(subtitle, COLOR_WHITE, DEFAULT_FONT, 28, box_x + (box_width - sub_w) / 2.0, box_y + 120);
+    int sub_w = cachedTextWidth(subtitle, DEFAULT_FONT, 28);
+    drawCachedText(subtitle, COLOR_WHITE, DEFAULT_FONT, 28, box_x + (box_width - sub_w) / 2.0, box_y + 120);
     string prompt = "Press SPACE to continue";
-    int prompt_w = text_width(prompt, DEFAULT_FONT, 26);
-    draw_text(prompt, COLOR_YELLOW, DEFAULT_FONT, 26, box_x + (box_width - prompt_w) / 2.0, box_y + 180);
+    int prompt_w = cachedTextWidth(prompt, DEFAULT_FONT, 26);
+    drawCachedText(prompt, COLOR_YELLOW, DEFAULT_FONT, 26, box_x + (box_width - prompt_w) / 2.0, box_y + 180);
 }
 
 void drawDefeatScreen() {
@@ -1113,16 +2743,2581 @@ void drawDefeatScreen() {
 
     // Draw text
     string title = "YOU LOST!";
-    int title_w = text_width(title, DEFAULT_FONT, 64);
-    draw_text(title, COLOR_RED, DEFAULT_FONT, 64, box_x + (box_width - title_w) / 2.0, box_y + 40);
+    int title_w = cachedTextWidth(title, DEFAULT_FONT, 64);
+    drawCachedText(title, COLOR_RED, DEFAULT_FONT, 64, box_x + (box_width - title_w) / 2.0, box_y + 40);
     string subtitle = "Better luck next time!";
-    int sub_w = text_width(subtitle, DEFAULT_FONT, 28);
-    draw_text(subtitle, COLOR_WHITE, DEFAULT_FONT, 28, box_x + (box_width - sub_w) / 2.0, box_y + 120);
+    int sub_w = cachedTextWidth(subtitle, DEFAULT_FONT, 28);
+    drawCachedText(subtitle, COLOR_WHITE, DEFAULT_FONT, 28, box_x + (box_width - sub_w) / 2.0, box_y + 120);
     string prompt = "Press SPACE to continue";
-    int prompt_w = text_width(prompt, DEFAULT_FONT, 26);
-    draw_text(prompt, COLOR_YELLOW, DEFAULT_FONT, 26, box_x + (box_width - prompt_w) / 2.0, box_y + 180);
+    int prompt_w = cachedTextWidth(prompt, DEFAULT_FONT, 26);
+    drawCachedText(prompt, COLOR_YELLOW, DEFAULT_FONT, 26, box_x + (box_width - prompt_w) / 2.0, box_y + 180);
 }
 
+// ============================================================================
+// LOCK-FREE BUFFERS - Hand data between the simulation and render threads
+// ============================================================================
+
+// Triple buffer: one writer publishes whole values, one reader always sees the
+// latest complete one. Neither side ever blocks or sees a half-written value.
+template <typename T>
+class TripleBuffer {
+private:
+    static const int INDEX_MASK = 3;
+    static const int FRESH_BIT = 4;
+    T buffers[3];
+    atomic<int> middle{1};
+    int back = 0;   // Owned by the writer
+    int front = 2;  // Owned by the reader
+
+public:
+    // Writer: fill this in, then publish()
+    T& writeBuffer() { return buffers[back]; }
+
+    void publish() {
+        back = middle.exchange(back | FRESH_BIT, memory_order_acq_rel) & INDEX_MASK;
+    }
+
+    // Reader: the most recently published value
+    const T& read() {
+        if (middle.load(memory_order_acquire) & FRESH_BIT) {
+            front = middle.exchange(front, memory_order_acq_rel) & INDEX_MASK;
+        }
+        return buffers[front];
+    }
+};
+
+// Fixed-size single-producer single-consumer ring queue
+template <typename T, size_t CAPACITY>
+class SpscQueue {
+private:
+    T items[CAPACITY];
+    atomic<size_t> head{0}; // Next slot to read (consumer)
+    atomic<size_t> tail{0}; // Next slot to write (producer)
+
+public:
+    bool push(const T& item) {
+        size_t t = tail.load(memory_order_relaxed);
+        if (t - head.load(memory_order_acquire) == CAPACITY) return false; // Full
+        items[t % CAPACITY] = item;
+        tail.store(t + 1, memory_order_release);
+        return true;
+    }
+
+    bool pop(T& item) {
+        size_t h = head.load(memory_order_relaxed);
+        if (h == tail.load(memory_order_acquire)) return false; // Empty
+        item = items[h % CAPACITY];
+        head.store(h + 1, memory_order_release);
+        return true;
+    }
+
+    void clear() {
+        T discarded;
+        while (pop(discarded)) {}
+    }
+};
+
+// Unbounded multi-producer single-consumer queue (Vyukov's intrusive list).
+// push never blocks or fails and may be called from any thread; only one
+// thread may pop.
+template <typename T>
+class MpscQueue {
+private:
+    struct Node {
+        atomic<Node*> next{nullptr};
+        T value;
+    };
+    atomic<Node*> head; // Most recently pushed node (producers)
+    Node* tail;         // Already-consumed node; its next is the oldest item (consumer)
+    atomic<size_t> depth{0};
+
+public:
+    MpscQueue() {
+        Node* stub = new Node();
+        head.store(stub, memory_order_relaxed);
+        tail = stub;
+    }
+
+    ~MpscQueue() {
+        T discarded;
+        while (pop(discarded)) {}
+        delete tail;
+    }
+
+    MpscQueue(const MpscQueue&) = delete;
+    MpscQueue& operator=(const MpscQueue&) = delete;
+
+    void push(T value) {
+        Node* node = new Node();
+        node->value = std::move(value);
+        depth.fetch_add(1, memory_order_relaxed);
+        Node* previous = head.exchange(node, memory_order_acq_rel);
+        previous->next.store(node, memory_order_release);
+    }
+
+    bool pop(T& value) {
+        Node* next = tail->next.load(memory_order_acquire);
+        if (next == nullptr) return false; // Empty, or a push is half done
+        value = std::move(next->value);
+        delete tail;
+        tail = next;
+        depth.fetch_sub(1, memory_order_relaxed);
+        return true;
+    }
+
+    // Approximate while producers are active
+    size_t size() const { return depth.load(memory_order_relaxed); }
+};
+
+// ============================================================================
+// BACKGROUND PERSISTENCE - Stat changes are written to disk off the game loop
+// ============================================================================
+
+// One user's state after a change, with when it was queued for latency stats
+struct StatsUpdate {
+    User user;
+    chrono::steady_clock::time_point queued;
+};
+
+struct PersistenceMetrics {
+    long long updates = 0;     // Updates queued
+    long long coalesced = 0;   // Updates superseded by a newer one for the same user
+    long long batches = 0;     // Group commits (one fsync each)
+    size_t queue_depth = 0;    // Updates waiting right now
+    size_t max_queue_depth = 0;
+    double average_latency_ms = 0.0; // Queued to on disk
+    double max_latency_ms = 0.0;
+};
+
+// Owns the user journal while running. It keeps its own copy of every user
+// so checkpoints never read the game's all_users from another thread.
+class PersistenceWriter {
+private:
+    MpscQueue<StatsUpdate> queue;
+    vector<User> stored_users;
+    unordered_map<string, size_t> stored_index;
+    mutex wake_mutex;
+    condition_variable wake;
+    atomic<bool> running{false};
+    thread writer;
+    vector<chrono::steady_clock::time_point> pending_queued; // Queue times of records awaiting fsync
+
+    atomic<long long> updates{0};
+    atomic<long long> coalesced{0};
+    atomic<long long> batches{0};
+    atomic<size_t> max_queue_depth{0};
+    atomic<long long> total_latency_us{0};
+    atomic<long long> written{0};
+    atomic<long long> max_latency_us{0};
+
+    void store(const User& user) {
+        auto found = stored_index.find(user.getUsername());
+        if (found != stored_index.end()) {
+            stored_users[found->second] = user;
+        } else {
+            stored_index[user.getUsername()] = stored_users.size();
+            stored_users.push_back(user);
+        }
+    }
+
+    // Append everything queued so far to the log; commit() makes it durable
+    void drain() {
+        AllocationScope allocation_scope(ALLOC_PERSISTENCE);
+        vector<StatsUpdate> batch;
+        unordered_map<string, size_t> latest; // Newest update per user in this batch
+        StatsUpdate update;
+        while (queue.pop(update)) {
+            auto found = latest.find(update.user.getUsername());
+            if (found != latest.end()) {
+                // Keep the oldest queue time so latency covers the whole wait
+                update.queued = batch[found->second].queued;
+                batch[found->second] = std::move(update);
+                coalesced.fetch_add(1, memory_order_relaxed);
+            } else {
+                latest[update.user.getUsername()] = batch.size();
+                batch.push_back(std::move(update));
+            }
+        }
+        if (batch.empty()) return;
+
+        for (const StatsUpdate& pending : batch) {
+            store(pending.user);
+            user_journal.append(pending.user, stored_users);
+            pending_queued.push_back(pending.queued);
+        }
+    }
+
+    // One fsync for every record appended since the last commit
+    void commit() {
+        if (pending_queued.empty()) return;
+        user_journal.sync();
+        batches.fetch_add(1, memory_order_relaxed);
+
+        chrono::steady_clock::time_point now = chrono::steady_clock::now();
+        for (chrono::steady_clock::time_point queued : pending_queued) {
+            long long latency = chrono::duration_cast<chrono::microseconds>(now - queued).count();
+            total_latency_us.fetch_add(latency, memory_order_relaxed);
+            written.fetch_add(1, memory_order_relaxed);
+            long long previous_max = max_latency_us.load(memory_order_relaxed);
+            while (latency > previous_max &&
+                   !max_latency_us.compare_exchange_weak(previous_max, latency, memory_order_relaxed)) {}
+        }
+        pending_queued.clear();
+    }
+
+    // Appends as updates arrive and commits when the oldest unsynced record's
+    // window closes, so there is at most one fsync per GROUP_COMMIT_INTERVAL_MS
+    // and no change waits longer than that for one
+    void run() {
+        while (running.load(memory_order_acquire)) {
+            {
+                unique_lock<mutex> lock(wake_mutex);
+                auto wake_up = [this] { return !running.load(memory_order_acquire) || queue.size() > 0; };
+                if (user_journal.hasUnsynced()) {
+                    wake.wait_until(lock, user_journal.syncDeadline(), wake_up);
+                } else {
+                    wake.wait(lock, wake_up);
+                }
+            }
+            drain();
+            if (!user_journal.hasUnsynced() || chrono::steady_clock::now() >= user_journal.syncDeadline()) {
+                commit(); // Also counts records a checkpoint already made durable
+            }
+        }
+        drain(); // Anything queued before stop()
+        commit();
+    }
+
+public:
+    bool isRunning() const { return running.load(memory_order_acquire); }
+
+    void start(const vector<User>& users) {
+        if (isRunning()) return;
+        stored_users = users;
+        stored_index.clear();
+        for (size_t i = 0; i < stored_users.size(); i++) {
+            stored_index[stored_users[i].getUsername()] = i;
+        }
+        running.store(true, memory_order_release);
+        writer = thread(&PersistenceWriter::run, this);
+    }
+
+    // Writes out everything already queued before returning
+    void stop() {
+        {
+            lock_guard<mutex> lock(wake_mutex);
+            running.store(false, memory_order_release);
+        }
+        wake.notify_one();
+        if (writer.joinable()) writer.join();
+    }
+
+    // Safe from any thread; never touches the disk
+    void enqueue(const User& user) {
+        queue.push(StatsUpdate{ user, chrono::steady_clock::now() });
+        updates.fetch_add(1, memory_order_relaxed);
+        size_t depth = queue.size();
+        size_t previous_max = max_queue_depth.load(memory_order_relaxed);
+        while (depth > previous_max &&
+               !max_queue_depth.compare_exchange_weak(previous_max, depth, memory_order_relaxed)) {}
+        { lock_guard<mutex> lock(wake_mutex); } // Writer is either waiting or will see the item
+        wake.notify_one();
+    }
+
+    PersistenceMetrics metrics() const {
+        PersistenceMetrics result;
+        result.updates = updates.load(memory_order_relaxed);
+        result.coalesced = coalesced.load(memory_order_relaxed);
+        result.batches = batches.load(memory_order_relaxed);
+        result.queue_depth = queue.size();
+        result.max_queue_depth = max_queue_depth.load(memory_order_relaxed);
+        long long count = written.load(memory_order_relaxed);
+        if (count > 0) {
+            result.average_latency_ms = total_latency_us.load(memory_order_relaxed) / 1000.0 / count;
+        }
+        result.max_latency_ms = max_latency_us.load(memory_order_relaxed) / 1000.0;
+        return result;
+    }
+};
+
+PersistenceWriter persistence_writer;
+
+void saveUser(const User& user, const vector<User>& users) {
+    if (persistence_writer.isRunning()) {
+        persistence_writer.enqueue(user);
+    } else {
+        user_journal.append(user, users); // Tools and benchmarks write directly,
+        user_journal.sync();              // with no thread to sync later
+    }
+}
+
+void printPersistenceMetrics() {
+    PersistenceMetrics m = persistence_writer.metrics();
+    char line[200];
+    snprintf(line, sizeof(line),
+             "[persistence] %lld updates, %lld coalesced, %lld commits, max queue depth %zu, "
+             "write latency avg %.2f ms max %.2f ms",
+             m.updates, m.coalesced, m.batches, m.max_queue_depth, m.average_latency_ms, m.max_latency_ms);
+    write_line(line);
+}
+
+// ============================================================================
+// BATTLE EVENT LOG - What happened, recorded as small structs; text on demand
+// ============================================================================
+
+enum BattleEventType : uint8_t {
+    EVENT_BATTLE_START,
+    EVENT_MOVE_HIT,     // fighter used move for damage
+    EVENT_MOVE_MISSED,  // fighter used move and missed
+    EVENT_FAINTED,      // fighter fainted
+    EVENT_SENT_OUT,     // fighter sent out to replace a fainted one
+    EVENT_SWITCHED      // fighter switched in; move holds the slot switched out
+};
+
+// Event flags
+const uint8_t EVENT_ENEMY = 1;              // fighter is on the enemy team
+const uint8_t EVENT_CRITICAL = 2;
+const uint8_t EVENT_SUPER_EFFECTIVE = 4;
+const uint8_t EVENT_NOT_VERY_EFFECTIVE = 8;
+
+// Fighters and moves are identified by their slot in the team and move list
+struct BattleEvent {
+    BattleEventType type;
+    uint8_t flags;
+    uint8_t fighter;
+    uint8_t move;
+    int16_t damage;
+};
+
+const uint32_t BATTLE_EVENT_CAPACITY = 256; // Longer than any real battle
+const int MAX_ACTION_EVENTS = 4;            // Hit, faint and replacement fit easily
+const size_t BATTLE_LOG_TEXT_SIZE = 256;
+
+// Every event of the current battle, grouped into actions (one move or switch).
+// Old events are overwritten once the ring is full.
+struct BattleEventLog {
+    BattleEvent events[BATTLE_EVENT_CAPACITY];
+    uint32_t total = 0;        // Events recorded this battle
+    uint32_t action_start = 0; // First event of the latest action
+
+    void clear() { total = 0; action_start = 0; }
+
+    void beginAction() { action_start = total; }
+
+    void record(BattleEventType type, uint8_t flags, int fighter, int move = 0, int damage = 0) {
+        BattleEvent& event = events[total % BATTLE_EVENT_CAPACITY];
+        event.type = type;
+        event.flags = flags;
+        event.fighter = (uint8_t)fighter;
+        event.move = (uint8_t)move;
+        event.damage = (int16_t)damage;
+        total++;
+    }
+
+    // Copy the latest action's events out; returns how many were copied
+    int copyLatestAction(BattleEvent* out, int max_events) const {
+        uint32_t first = action_start;
+        if (total - first > BATTLE_EVENT_CAPACITY) first = total - BATTLE_EVENT_CAPACITY;
+        int count = 0;
+        for (uint32_t i = first; i < total && count < max_events; i++) {
+            out[count++] = events[i % BATTLE_EVENT_CAPACITY];
+        }
+        return count;
+    }
+};
+
+// Appends printf-style text to a caller-owned buffer, truncating when full
+class TextFormatter {
+private:
+    char* buffer;
+    size_t capacity;
+    size_t length = 0;
+
+public:
+    TextFormatter(char* buf, size_t cap) : buffer(buf), capacity(cap) {
+        if (capacity > 0) buffer[0] = '\0';
+    }
+
+    void append(const char* format, ...) {
+        if (length + 1 >= capacity) return;
+        va_list args;
+        va_start(args, format);
+        int written = vsnprintf(buffer + length, capacity - length, format, args);
+        va_end(args);
+        if (written > 0) length = min(length + (size_t)written, capacity - 1);
+    }
+
+    size_t size() const { return length; }
+};
+
+// Turn one action's events into the line shown in the battle log.
+// Teams are needed to name the fighters and moves the events refer to.
+size_t formatBattleEvents(const BattleEvent* events, int count,
+                          const Team& player_team, const Team& enemy_team,
+                          char* buffer, size_t capacity) {
+    TextFormatter text(buffer, capacity);
+    for (int i = 0; i < count; i++) {
+        const BattleEvent& event = events[i];
+        const Team& team = (event.flags & EVENT_ENEMY) ? enemy_team : player_team;
+        if (event.type != EVENT_BATTLE_START && event.fighter >= team.size()) continue;
+        if (i > 0) text.append(" ");
+
+        switch (event.type) {
+        case EVENT_BATTLE_START:
+            text.append("Battle Start! Use your moves or switch between your %d Pokemon!",
+                        (int)player_team.size());
+            break;
+        case EVENT_MOVE_HIT:
+        case EVENT_MOVE_MISSED: {
+            const Fighter& attacker = team[event.fighter];
+            const MoveList& moves = attacker.getMoves();
+            const char* move_name = event.move < moves.size() ? moves[event.move].getName().c_str() : "?";
+            if (event.type == EVENT_MOVE_MISSED) {
+                text.append("%s used %s but it missed!", attacker.getName().c_str(), move_name);
+                break;
+            }
+            text.append("%s used %s! %d damage!", attacker.getName().c_str(), move_name, (int)event.damage);
+            if (event.flags & EVENT_CRITICAL) text.append(" A critical hit!");
+            if (event.flags & EVENT_SUPER_EFFECTIVE) text.append(" It's super effective!");
+            else if (event.flags & EVENT_NOT_VERY_EFFECTIVE) text.append(" It's not very effective...");
+            break;
+        }
+        case EVENT_FAINTED:
+            text.append("%s fainted!", team[event.fighter].getName().c_str());
+            break;
+        case EVENT_SENT_OUT:
+            text.append((event.flags & EVENT_ENEMY) ? "Enemy sent out %s!" : "You sent out %s!",
+                        team[event.fighter].getName().c_str());
+            break;
+        case EVENT_SWITCHED: {
+            const char* previous = event.move < team.size() ? team[event.move].getName().c_str() : "?";
+            text.append("You switched from %s to %s!", previous, team[event.fighter].getName().c_str());
+            break;
+        }
+        }
+    }
+    return text.size();
+}
+
+// ============================================================================
+// BATTLE TELEMETRY - Per-battle outcomes for balance work, written in batches
+// ============================================================================
+
+// battle_telemetry.pkt is "PKTL" + u16 version, followed by batches. Each batch:
+//   "PKTB", u32 rows
+//   species dictionary, move dictionary: u16 count, then u8 length + bytes each
+//   won u8[rows], turns u16[rows]
+//   player_misses, player_crits, enemy_misses, enemy_crits: u16[rows] each
+//   player_species, enemy_species, player_moves, enemy_moves: list columns of
+//     u32 offsets[rows + 1] then u16 dictionary codes[offsets[rows]]
+// Integers are little-endian. Dictionaries are per batch. Version 1 files used
+// u8 codes, which wrapped once a batch named more than 256 species or moves.
+const string TELEMETRY_FILE = "battle_telemetry.pkt";
+const uint16_t TELEMETRY_VERSION = 2;
+const size_t TELEMETRY_BATCH_SIZE = 64;            // Records per flush
+const unsigned int TELEMETRY_FLUSH_INTERVAL_MS = 5000; // Flush partial batches this often
+
+struct BattleRecord {
+    bool won;
+    int turns;
+    int player_misses = 0;
+    int player_crits = 0;
+    int enemy_misses = 0;
+    int enemy_crits = 0;
+    vector<string> player_species;
+    vector<string> enemy_species;
+    vector<string> player_moves; // In the order they were used
+    vector<string> enemy_moves;
+};
+
+// Summarise a finished battle from its event log
+BattleRecord buildBattleRecord(const BattleEventLog& log, const Team& player_team,
+                               const Team& enemy_team, bool won, int turns) {
+    BattleRecord record;
+    record.won = won;
+    record.turns = turns;
+    for (const Fighter& fighter : player_team) record.player_species.push_back(fighter.getName());
+    for (const Fighter& fighter : enemy_team) record.enemy_species.push_back(fighter.getName());
+
+    uint32_t first = log.total > BATTLE_EVENT_CAPACITY ? log.total - BATTLE_EVENT_CAPACITY : 0;
+    for (uint32_t i = first; i < log.total; i++) {
+        const BattleEvent& event = log.events[i % BATTLE_EVENT_CAPACITY];
+        if (event.type != EVENT_MOVE_HIT && event.type != EVENT_MOVE_MISSED) continue;
+        bool enemy = event.flags & EVENT_ENEMY;
+        const Team& team = enemy ? enemy_team : player_team;
+        if (event.fighter >= team.size() || event.move >= team[event.fighter].getMoves().size()) continue;
+
+        (enemy ? record.enemy_moves : record.player_moves).push_back(
+            team[event.fighter].getMoves()[event.move].getName());
+        if (event.type == EVENT_MOVE_MISSED) (enemy ? record.enemy_misses : record.player_misses)++;
+        if (event.flags & EVENT_CRITICAL) (enemy ? record.enemy_crits : record.player_crits)++;
+    }
+    return record;
+}
+
+class TelemetryWriter {
+private:
+    string path;
+    vector<BattleRecord> pending;
+    mutex pending_mutex;
+    condition_variable wake;
+    bool running = false;
+    thread writer;
+
+    static void putU16(vector<uint8_t>& out, uint16_t value) {
+        out.push_back(value & 0xFF);
+        out.push_back(value >> 8);
+    }
+
+    static void putU32(vector<uint8_t>& out, uint32_t value) {
+        for (int shift = 0; shift < 32; shift += 8) out.push_back((value >> shift) & 0xFF);
+    }
+
+    static void putDictionary(vector<uint8_t>& out, const vector<string>& entries) {
+        putU16(out, (uint16_t)entries.size());
+        for (const string& entry : entries) {
+            size_t length = min(entry.size(), (size_t)255);
+            out.push_back((uint8_t)length);
+            out.insert(out.end(), entry.begin(), entry.begin() + length);
+        }
+    }
+
+    // Dictionary code for a value, adding it on first sight
+    static uint16_t encode(const string& value, unordered_map<string, uint16_t>& codes, vector<string>& entries) {
+        auto found = codes.find(value);
+        if (found != codes.end()) return found->second;
+        uint16_t code = (uint16_t)entries.size();
+        codes[value] = code;
+        entries.push_back(value);
+        return code;
+    }
+
+    template <typename Field>
+    static void putU16Column(vector<uint8_t>& out, const vector<BattleRecord>& rows, Field field) {
+        for (const BattleRecord& row : rows) putU16(out, (uint16_t)min(field(row), 0xFFFF));
+    }
+
+    static size_t dictionarySize(const vector<string>& entries) {
+        size_t size = 2;
+        for (const string& entry : entries) size += 1 + min(entry.size(), (size_t)255);
+        return size;
+    }
+
+    static size_t listColumnSize(const vector<vector<uint16_t>>& lists) {
+        size_t size = 4 * (lists.size() + 1);
+        for (const vector<uint16_t>& list : lists) size += 2 * list.size();
+        return size;
+    }
+
+    static void putListColumn(vector<uint8_t>& out, const vector<vector<uint16_t>>& lists) {
+        uint32_t offset = 0;
+        putU32(out, offset);
+        for (const vector<uint16_t>& list : lists) {
+            offset += list.size();
+            putU32(out, offset);
+        }
+        for (const vector<uint16_t>& list : lists) {
+            for (uint16_t code : list) putU16(out, code);
+        }
+    }
+
+    static vector<uint8_t> encodeBatch(const vector<BattleRecord>& rows) {
+        unordered_map<string, uint16_t> species_codes, move_codes;
+        vector<string> species, moves;
+        vector<vector<uint16_t>> player_species(rows.size()), enemy_species(rows.size());
+        vector<vector<uint16_t>> player_moves(rows.size()), enemy_moves(rows.size());
+        for (size_t r = 0; r < rows.size(); r++) {
+            for (const string& name : rows[r].player_species) player_species[r].push_back(encode(name, species_codes, species));
+            for (const string& name : rows[r].enemy_species) enemy_species[r].push_back(encode(name, species_codes, species));
+            for (const string& name : rows[r].player_moves) player_moves[r].push_back(encode(name, move_codes, moves));
+            for (const string& name : rows[r].enemy_moves) enemy_moves[r].push_back(encode(name, move_codes, moves));
+        }
+
+        // Sized up front: one allocation per batch
+        vector<uint8_t> out;
+        out.reserve(8 + dictionarySize(species) + dictionarySize(moves) + 11 * rows.size() +
+                    listColumnSize(player_species) + listColumnSize(enemy_species) +
+                    listColumnSize(player_moves) + listColumnSize(enemy_moves));
+        for (char c : string_view("PKTB")) out.push_back((uint8_t)c);
+        putU32(out, (uint32_t)rows.size());
+        putDictionary(out, species);
+        putDictionary(out, moves);
+        for (const BattleRecord& row : rows) out.push_back(row.won ? 1 : 0);
+        putU16Column(out, rows, [](const BattleRecord& row) { return row.turns; });
+        putU16Column(out, rows, [](const BattleRecord& row) { return row.player_misses; });
+        putU16Column(out, rows, [](const BattleRecord& row) { return row.player_crits; });
+        putU16Column(out, rows, [](const BattleRecord& row) { return row.enemy_misses; });
+        putU16Column(out, rows, [](const BattleRecord& row) { return row.enemy_crits; });
+        putListColumn(out, player_species);
+        putListColumn(out, enemy_species);
+        putListColumn(out, player_moves);
+        putListColumn(out, enemy_moves);
+        return out;
+    }
+
+    void appendBatch(const vector<BattleRecord>& rows) {
+        AllocationScope allocation_scope(ALLOC_PERSISTENCE);
+        vector<uint8_t> bytes = encodeBatch(rows);
+        ofstream file(path, ios::binary | ios::app);
+        if (!file) {
+            write_line("Warning: Could not write telemetry to " + path);
+            return;
+        }
+        if (file.tellp() == 0) {
+            file.write("PKTL", 4);
+            uint8_t version[2] = { (uint8_t)(TELEMETRY_VERSION & 0xFF), (uint8_t)(TELEMETRY_VERSION >> 8) };
+            file.write((const char*)version, 2);
+        }
+        file.write((const char*)bytes.data(), bytes.size());
+    }
+
+    void run() {
+        unique_lock<mutex> lock(pending_mutex);
+        while (true) {
+            wake.wait_for(lock, chrono::milliseconds(TELEMETRY_FLUSH_INTERVAL_MS), [this] {
+                return !running || pending.size() >= TELEMETRY_BATCH_SIZE;
+            });
+            if (!pending.empty()) {
+                vector<BattleRecord> batch;
+                batch.swap(pending);
+                lock.unlock(); // Battles keep submitting while the batch is written
+                appendBatch(batch);
+                lock.lock();
+            }
+            if (!running && pending.empty()) return;
+        }
+    }
+
+public:
+    explicit TelemetryWriter(const string& file_path) : path(file_path) {}
+
+    void start() {
+        lock_guard<mutex> lock(pending_mutex);
+        if (running) return;
+        running = true;
+        writer = thread(&TelemetryWriter::run, this);
+    }
+
+    // Flushes whatever is still buffered before returning
+    void stop() {
+        {
+            lock_guard<mutex> lock(pending_mutex);
+            running = false;
+        }
+        wake.notify_one();
+        if (writer.joinable()) writer.join();
+    }
+
+    // Benchmarks and tools never start the writer and skip building records
+    bool isRunning() {
+        lock_guard<mutex> lock(pending_mutex);
+        return running;
+    }
+
+    // Cheap for the caller: the record is moved into memory and written later.
+    // Ignored when the writer is not running.
+    void submit(BattleRecord&& record) {
+        bool batch_full;
+        {
+            lock_guard<mutex> lock(pending_mutex);
+            if (!running) return;
+            pending.push_back(std::move(record));
+            batch_full = pending.size() >= TELEMETRY_BATCH_SIZE;
+        }
+        if (batch_full) wake.notify_one();
+    }
+};
+
+TelemetryWriter battle_telemetry(TELEMETRY_FILE);
+
+// ============================================================================
+// LINEUP EQUILIBRIUM - Which team order to field against an adapting opponent
+// ============================================================================
+
+// Cached payoff matrix, one row per player order:
+//   line 1: data hash (hex) and the number of orders
+//   then one line per player order with its win chance against each enemy order
+const string LINEUP_CACHE_FILE = "lineup_payoffs.txt";
+const int LINEUP_CACHE_VERSION = 1;
+const int LINEUP_REGRET_ITERATIONS = 20000;
+
+// Every order STARTER_POOL can be fielded in, always listed the same way
+vector<vector<string>> allTeamOrders() {
+    vector<vector<string>> orders;
+    vector<string> order = STARTER_POOL;
+    sort(order.begin(), order.end());
+    do {
+        orders.push_back(order);
+    } while (next_permutation(order.begin(), order.end()));
+    return orders;
+}
+
+// Hash of everything the payoffs depend on: starter stats and moves, the type
+// chart between them and the damage constants. A cache with another hash is stale.
+uint32_t lineupDataHash() {
+    ostringstream data;
+    data << LINEUP_CACHE_VERSION << ' ' << RANDOM_FACTOR_MIN << ' ' << RANDOM_FACTOR_STEPS << ' '
+         << CRIT_ROLL_RANGE << ' ' << MIN_DAMAGE << '\n';
+    Team starters = createTeamInOrder(STARTER_POOL, true);
+    for (const Fighter& fighter : starters) {
+        data << fighter.getName() << ',' << fighter.getMaxHP() << ',' << fighter.getAttack() << ','
+             << fighter.getDefense() << ',' << fighter.getType() << '\n';
+        for (const Move& move : fighter.getMoves()) {
+            data << move.getName() << ',' << move.getDamage() << ',' << move.getType() << ','
+                 << move.getAccuracy() << ',' << move.getCritChance();
+            for (const Fighter& defender : starters) {
+                data << ',' << getTypeMultiplier(move.getType(), defender.getType());
+            }
+            data << '\n';
+        }
+    }
+    return recordChecksum(data.str());
+}
+
+// payoffs[p][e] is the player's win chance with orders[p] against orders[e].
+// Cells are handed out to the threads one at a time, each solved exactly.
+// Stops early, leaving cells at 0, once *stop is set
+vector<vector<double>> buildLineupPayoffs(const vector<vector<string>>& orders, unsigned int threads,
+                                          const atomic<bool>* stop = nullptr) {
+    size_t count = orders.size();
+    vector<vector<double>> payoffs(count, vector<double>(count, 0.0));
+    atomic<size_t> next_cell(0);
+    auto solveCells = [&] {
+        for (size_t cell = next_cell++; cell < count * count && !(stop != nullptr && stop->load());
+             cell = next_cell++) {
+            payoffs[cell / count][cell % count] =
+                solveWinProbability(orders[cell / count], orders[cell % count], 1);
+        }
+    };
+
+    vector<thread> workers;
+    for (unsigned int t = 1; t < max(1u, threads); t++) {
+        workers.emplace_back(solveCells);
+    }
+    solveCells();
+    for (thread& worker : workers) worker.join();
+    return payoffs;
+}
+
+bool loadLineupPayoffs(const string& path, uint32_t hash, size_t count, vector<vector<double>>& payoffs) {
+    ifstream file(path);
+    if (!file.is_open()) return false;
+
+    string hash_text;
+    size_t file_count = 0;
+    if (!(file >> hash_text >> file_count)) return false;
+    if (strtoul(hash_text.c_str(), nullptr, 16) != hash || file_count != count) return false;
+
+    vector<vector<double>> loaded(count, vector<double>(count, 0.0));
+    for (vector<double>& row : loaded) {
+        for (double& value : row) {
+            if (!(file >> value)) return false;
+        }
+    }
+    payoffs = loaded;
+    return true;
+}
+
+// Written to a temporary file first, so a half-written cache is never read
+bool saveLineupPayoffs(const string& path, uint32_t hash, const vector<vector<double>>& payoffs) {
+    string temp_path = path + ".tmp";
+    FILE* file = fopen(temp_path.c_str(), "w");
+    if (file == nullptr) return false;
+
+    fprintf(file, "%08x %zu\n", (unsigned)hash, payoffs.size());
+    for (const vector<double>& row : payoffs) {
+        for (size_t e = 0; e < row.size(); e++) {
+            fprintf(file, e == 0 ? "%.17g" : " %.17g", row[e]);
+        }
+        fputc('\n', file);
+    }
+    bool written = fclose(file) == 0;
+    error_code error;
+    if (written) filesystem::rename(temp_path, path, error);
+    return written && !error;
+}
+
+// Loads the matrix for orders from the cache, or builds and caches it. A
+// build stopped through *stop returns an empty matrix and is not cached.
+vector<vector<double>> lineupPayoffs(const vector<vector<string>>& orders, unsigned int threads,
+                                     bool* from_cache = nullptr, const atomic<bool>* stop = nullptr) {
+    uint32_t hash = lineupDataHash();
+    vector<vector<double>> payoffs;
+    bool cached = loadLineupPayoffs(LINEUP_CACHE_FILE, hash, orders.size(), payoffs);
+    if (!cached) {
+        payoffs = buildLineupPayoffs(orders, threads, stop);
+        if (stop != nullptr && stop->load()) return {};
+        if (!saveLineupPayoffs(LINEUP_CACHE_FILE, hash, payoffs)) {
+            write_line("Warning: Unable to write " + LINEUP_CACHE_FILE);
+        }
+    }
+    if (from_cache != nullptr) *from_cache = cached;
+    return payoffs;
+}
+
+// Mixed strategies for the zero-sum game of picking a team order. value is
+// the player's win chance when both sides play them; exploitability is how
+// much a best response on either side could still gain (0 at equilibrium).
+struct LineupEquilibrium {
+    vector<double> player_strategy;
+    vector<double> enemy_strategy;
+    double value = 0.0;
+    double exploitability = 0.0;
+};
+
+// Play each positive regret in proportion; no positive regret means uniform
+void strategyFromRegrets(const vector<double>& regrets, vector<double>& strategy) {
+    double total = 0.0;
+    for (double regret : regrets) total += max(0.0, regret);
+    for (size_t i = 0; i < regrets.size(); i++) {
+        strategy[i] = total > 0.0 ? max(0.0, regrets[i]) / total : 1.0 / regrets.size();
+    }
+}
+
+// Regret matching+ with the sides taking turns to update; the weighted
+// average strategies converge to an equilibrium of the matrix game
+LineupEquilibrium solveLineupEquilibrium(const vector<vector<double>>& payoffs, int iterations) {
+    size_t player_count = payoffs.size();
+    size_t enemy_count = player_count == 0 ? 0 : payoffs[0].size();
+    LineupEquilibrium equilibrium;
+    if (player_count == 0 || enemy_count == 0) return equilibrium;
+
+    vector<double> player_regrets(player_count, 0.0), enemy_regrets(enemy_count, 0.0);
+    vector<double> player_strategy(player_count), enemy_strategy(enemy_count);
+    vector<double> values(max(player_count, enemy_count));
+    equilibrium.player_strategy.assign(player_count, 0.0);
+    equilibrium.enemy_strategy.assign(enemy_count, 0.0);
+    strategyFromRegrets(enemy_regrets, enemy_strategy);
+
+    for (int iteration = 1; iteration <= iterations; iteration++) {
+        // Player wants a high win chance...
+        strategyFromRegrets(player_regrets, player_strategy);
+        double expected = 0.0;
+        for (size_t p = 0; p < player_count; p++) {
+            values[p] = 0.0;
+            for (size_t e = 0; e < enemy_count; e++) values[p] += payoffs[p][e] * enemy_strategy[e];
+            expected += values[p] * player_strategy[p];
+        }
+        for (size_t p = 0; p < player_count; p++) {
+            player_regrets[p] = max(0.0, player_regrets[p] + values[p] - expected);
+            equilibrium.player_strategy[p] += iteration * player_strategy[p];
+        }
+
+        // ...and the enemy a low one, answering the player's updated mix
+        strategyFromRegrets(player_regrets, player_strategy);
+        expected = 0.0;
+        for (size_t e = 0; e < enemy_count; e++) {
+            values[e] = 0.0;
+            for (size_t p = 0; p < player_count; p++) values[e] += payoffs[p][e] * player_strategy[p];
+            expected += values[e] * enemy_strategy[e];
+        }
+        for (size_t e = 0; e < enemy_count; e++) {
+            enemy_regrets[e] = max(0.0, enemy_regrets[e] + expected - values[e]);
+            equilibrium.enemy_strategy[e] += iteration * enemy_strategy[e];
+        }
+        strategyFromRegrets(enemy_regrets, enemy_strategy);
+    }
+
+    double weight = iterations * (iterations + 1) / 2.0;
+    for (double& chance : equilibrium.player_strategy) chance /= weight;
+    for (double& chance : equilibrium.enemy_strategy) chance /= weight;
+
+    double best_player = 0.0, best_enemy = 1.0;
+    for (size_t p = 0; p < player_count; p++) {
+        double value = 0.0;
+        for (size_t e = 0; e < enemy_count; e++) value += payoffs[p][e] * equilibrium.enemy_strategy[e];
+        best_player = max(best_player, value);
+        equilibrium.value += value * equilibrium.player_strategy[p];
+    }
+    for (size_t e = 0; e < enemy_count; e++) {
+        double value = 0.0;
+        for (size_t p = 0; p < player_count; p++) value += payoffs[p][e] * equilibrium.player_strategy[p];
+        best_enemy = min(best_enemy, value);
+    }
+    equilibrium.exploitability = best_player - best_enemy;
+    return equilibrium;
+}
+
+// Team orders the enemy picks from, weighted by its equilibrium strategy.
+// Worked out on a background thread so the window opens straight away even
+// when the payoffs have to be solved; until then the enemy shuffles its team.
+mutex enemy_lineup_mutex;
+vector<vector<string>> enemy_lineup_orders;     // Empty until the solve finishes
+discrete_distribution<int> enemy_lineup_choice;
+thread enemy_lineup_thread;
+atomic<bool> enemy_lineup_stop{false};
+
+void prepareEnemyLineups() {
+    vector<vector<string>> orders = allTeamOrders();
+    // Leave a core for the game while the window is up
+    unsigned int threads = max(1, (int)thread::hardware_concurrency() - 1);
+    vector<vector<double>> payoffs = lineupPayoffs(orders, threads, nullptr, &enemy_lineup_stop);
+    if (payoffs.empty()) return;
+    LineupEquilibrium equilibrium = solveLineupEquilibrium(payoffs, LINEUP_REGRET_ITERATIONS);
+
+    lock_guard<mutex> lock(enemy_lineup_mutex);
+    enemy_lineup_orders = orders;
+    enemy_lineup_choice = discrete_distribution<int>(equilibrium.enemy_strategy.begin(),
+                                                     equilibrium.enemy_strategy.end());
+}
+
+void startEnemyLineups() {
+    enemy_lineup_thread = thread(prepareEnemyLineups);
+}
+
+// Abandons a solve still running; it is redone on the next launch
+void stopEnemyLineups() {
+    enemy_lineup_stop.store(true);
+    if (enemy_lineup_thread.joinable()) enemy_lineup_thread.join();
+}
+
+// An order from the equilibrium, or an empty one while it is still being solved
+vector<string> sampleEnemyLineup() {
+    static mt19937 rng(random_device{}());
+    lock_guard<mutex> lock(enemy_lineup_mutex);
+    if (enemy_lineup_orders.empty()) return {};
+    return enemy_lineup_orders[enemy_lineup_choice(rng)];
+}
+
+// ============================================================================
+// HEADLESS BATTLE - Allocation-free battle engine for training and search
+// ============================================================================
+
+// Plays by the same rules as executePlayerMove and executeEnemyMove, with
+// fighters reduced to indices into STARTER_POOL and every damage roll looked
+// up in a table built once from createStarterByName and damageForRolls. The
+// state is plain data, so battles can be copied, stored and stepped by the
+// million without touching the heap.
+
+const int HEADLESS_SPECIES = 3;   // Fighters in STARTER_POOL
+const int HEADLESS_TEAM_SIZE = 3;
+const int HEADLESS_MOVES = 4;     // Moves per fighter
+const int SIDE_PLAYER = 0;
+const int SIDE_ENEMY = 1;
+
+struct HeadlessRules {
+    bool valid = false;
+    int16_t max_hp[HEADLESS_SPECIES] = {};
+    uint8_t accuracy[HEADLESS_SPECIES][HEADLESS_MOVES] = {};
+    uint16_t crit_rolls[HEADLESS_SPECIES][HEADLESS_MOVES] = {}; // Crit when the roll is below this
+    // [attacker][move][defender][critical][random step]
+    int16_t damage[HEADLESS_SPECIES][HEADLESS_MOVES][HEADLESS_SPECIES][2][RANDOM_FACTOR_STEPS] = {};
+    float expected_damage[HEADLESS_SPECIES][HEADLESS_SPECIES] = {}; // Of a random move, misses included
+};
+
+HeadlessRules buildHeadlessRules() {
+    HeadlessRules rules;
+    Team starters = createTeamInOrder(STARTER_POOL, false);
+    if ((int)starters.size() != HEADLESS_SPECIES) return rules;
+    for (const Fighter& fighter : starters) {
+        if ((int)fighter.getMoves().size() != HEADLESS_MOVES) return rules;
+    }
+
+    for (int attacker = 0; attacker < HEADLESS_SPECIES; attacker++) {
+        rules.max_hp[attacker] = (int16_t)starters[attacker].getMaxHP();
+        for (int m = 0; m < HEADLESS_MOVES; m++) {
+            const Move& move = starters[attacker].getMoves()[m];
+            rules.accuracy[attacker][m] = (uint8_t)max(0, min(100, move.getAccuracy()));
+            for (int roll = 0; roll < CRIT_ROLL_RANGE; roll++) {
+                if ((roll / (double)CRIT_ROLL_RANGE) < move.getCritChance()) rules.crit_rolls[attacker][m]++;
+            }
+            for (int defender = 0; defender < HEADLESS_SPECIES; defender++) {
+                double type_multiplier = getTypeMultiplier(move.getType(), starters[defender].getType());
+                double crit_chance = rules.crit_rolls[attacker][m] / (double)CRIT_ROLL_RANGE;
+                for (int critical = 0; critical <= 1; critical++) {
+                    for (int step = 0; step < RANDOM_FACTOR_STEPS; step++) {
+                        rules.damage[attacker][m][defender][critical][step] = (int16_t)damageForRolls(
+                            starters[attacker], starters[defender], move, type_multiplier, critical == 1, step);
+                        rules.expected_damage[attacker][defender] += (float)(
+                            rules.damage[attacker][m][defender][critical][step] * rules.accuracy[attacker][m] / 100.0 *
+                            (critical ? crit_chance : 1.0 - crit_chance) / RANDOM_FACTOR_STEPS / HEADLESS_MOVES);
+                    }
+                }
+            }
+        }
+    }
+    rules.valid = true;
+    return rules;
+}
+
+const HeadlessRules& headlessRules() {
+    static const HeadlessRules rules = buildHeadlessRules();
+    return rules;
+}
+
+// Index of a fighter in STARTER_POOL, or -1
+int starterIndex(const string& name) {
+    for (size_t i = 0; i < STARTER_POOL.size(); i++) {
+        if (STARTER_POOL[i] == name) return (int)i;
+    }
+    return -1;
+}
+
+// Small, fast generator for simulations (xorshift64*). Each thread or
+// environment owns one; the seed is mixed so consecutive seeds differ.
+struct FastRng {
+    uint64_t state = 1;
+
+    explicit FastRng(uint64_t seed_value = 1) { seed(seed_value); }
+
+    void seed(uint64_t seed_value) {
+        uint64_t mixed = seed_value + 0x9E3779B97F4A7C15ULL;
+        mixed = (mixed ^ (mixed >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        mixed = (mixed ^ (mixed >> 27)) * 0x94D049BB133111EBULL;
+        state = (mixed ^ (mixed >> 31)) | 1;
+    }
+
+    uint32_t next() {
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        return (uint32_t)((state * 0x2545F4914F6CDD1DULL) >> 32);
+    }
+
+    // Uniform in [0, bound)
+    uint32_t below(uint32_t bound) {
+        return (uint32_t)(((uint64_t)next() * bound) >> 32);
+    }
+};
+
+struct HeadlessSide {
+    uint8_t species[HEADLESS_TEAM_SIZE];
+    int16_t hp[HEADLESS_TEAM_SIZE];
+    uint8_t active;
+    uint8_t alive; // Fighters with HP left
+};
+
+struct HeadlessBattle {
+    HeadlessSide sides[2]; // SIDE_PLAYER, SIDE_ENEMY
+    uint8_t to_move;
+    int8_t winner;         // -1 until one side has no fighters left
+    uint16_t turns;        // Counted like turn_number: after each enemy move
+};
+
+// Searches copy and hash whole positions, so keep one within half a cache line
+static_assert(sizeof(HeadlessBattle) <= 32, "HeadlessBattle should stay packed");
+
+enum HeadlessOutcome : uint8_t { HEADLESS_MISSED, HEADLESS_HIT, HEADLESS_FAINTED, HEADLESS_WON };
+
+// Fresh battle, player to move, with each side's team given as species indices
+void resetHeadlessBattle(HeadlessBattle& battle, const uint8_t player_order[], const uint8_t enemy_order[]) {
+    const HeadlessRules& rules = headlessRules();
+    const uint8_t* orders[2] = { player_order, enemy_order };
+    for (int side = 0; side < 2; side++) {
+        HeadlessSide& team = battle.sides[side];
+        for (int i = 0; i < HEADLESS_TEAM_SIZE; i++) {
+            team.species[i] = orders[side][i];
+            team.hp[i] = rules.max_hp[orders[side][i]];
+        }
+        team.active = 0;
+        team.alive = HEADLESS_TEAM_SIZE;
+    }
+    battle.to_move = SIDE_PLAYER;
+    battle.winner = -1;
+    battle.turns = 0;
+}
+
+// Fresh battle with both teams in random order, as createRandomTeam deals them
+void resetHeadlessBattle(HeadlessBattle& battle, FastRng& rng) {
+    uint8_t orders[2][HEADLESS_TEAM_SIZE];
+    for (int side = 0; side < 2; side++) {
+        for (int i = 0; i < HEADLESS_TEAM_SIZE; i++) orders[side][i] = (uint8_t)i;
+        for (int i = HEADLESS_TEAM_SIZE - 1; i > 0; i--) {
+            swap(orders[side][i], orders[side][rng.below(i + 1)]);
+        }
+    }
+    resetHeadlessBattle(battle, orders[SIDE_PLAYER], orders[SIDE_ENEMY]);
+}
+
+// Finishes the side to move's attack once its damage is known (0 for a
+// miss): a fainted fighter is replaced like forceSwitchToNext, and the turn
+// passes. Searches use this to play out each possible roll.
+HeadlessOutcome applyHeadlessDamage(HeadlessBattle& battle, int damage) {
+    int side = battle.to_move;
+    HeadlessSide& defender = battle.sides[1 - side];
+
+    HeadlessOutcome outcome = HEADLESS_MISSED;
+    if (damage > 0) {
+        int16_t& hp = defender.hp[defender.active];
+        hp = (int16_t)max(0, hp - damage);
+        outcome = HEADLESS_HIT;
+        if (hp == 0) {
+            outcome = --defender.alive == 0 ? HEADLESS_WON : HEADLESS_FAINTED;
+            for (int i = 0; i < HEADLESS_TEAM_SIZE && outcome == HEADLESS_FAINTED; i++) {
+                if (defender.hp[i] > 0) {
+                    defender.active = (uint8_t)i;
+                    break;
+                }
+            }
+        }
+    }
+
+    if (outcome == HEADLESS_WON) {
+        battle.winner = (int8_t)side;
+    } else if (side == SIDE_ENEMY) {
+        battle.turns++; // Like endBattle, a winning enemy move doesn't start a new turn
+    }
+    battle.to_move = (uint8_t)(1 - side);
+    return outcome;
+}
+
+// The side to move uses its active fighter's move. Rolls are drawn like
+// calculateDamage's. Out-of-range moves wrap around rather than being skipped.
+HeadlessOutcome stepHeadlessBattle(HeadlessBattle& battle, int move, FastRng& rng) {
+    const HeadlessRules& rules = headlessRules();
+    const HeadlessSide& attacker = battle.sides[battle.to_move];
+    const HeadlessSide& defender = battle.sides[1 - battle.to_move];
+    int attacker_species = attacker.species[attacker.active];
+    int defender_species = defender.species[defender.active];
+    move = (int)((unsigned int)move % HEADLESS_MOVES);
+
+    int damage = 0;
+    if ((int)rng.below(100) + 1 <= rules.accuracy[attacker_species][move]) {
+        int critical = rng.below(CRIT_ROLL_RANGE) < rules.crit_rolls[attacker_species][move] ? 1 : 0;
+        int step = (int)rng.below(RANDOM_FACTOR_STEPS);
+        damage = rules.damage[attacker_species][move][defender_species][critical][step];
+    }
+    return applyHeadlessDamage(battle, damage);
+}
+
+// Headless copy of the battle on screen. False for teams it can't hold:
+// other fighters than STARTER_POOL's, or a team that isn't full size.
+bool headlessFromTeams(const Team& player, int player_active, const Team& enemy, int enemy_active,
+                       int to_move, HeadlessBattle& battle) {
+    if (!headlessRules().valid) return false;
+    const Team* teams[2] = { &player, &enemy };
+    int actives[2] = { player_active, enemy_active };
+    for (int side = 0; side < 2; side++) {
+        const Team& team = *teams[side];
+        if ((int)team.size() != HEADLESS_TEAM_SIZE || actives[side] < 0 || actives[side] >= HEADLESS_TEAM_SIZE) {
+            return false;
+        }
+        HeadlessSide& headless = battle.sides[side];
+        headless.alive = 0;
+        for (int slot = 0; slot < HEADLESS_TEAM_SIZE; slot++) {
+            int species = starterIndex(team[slot].getName());
+            if (species < 0 || (int)team[slot].getMoves().size() != HEADLESS_MOVES) return false;
+            headless.species[slot] = (uint8_t)species;
+            headless.hp[slot] = (int16_t)team[slot].getHP();
+            headless.alive += team[slot].isAlive() ? 1 : 0;
+        }
+        headless.active = (uint8_t)actives[side];
+    }
+    battle.to_move = (uint8_t)to_move;
+    battle.winner = -1;
+    battle.turns = 0;
+    return true;
+}
+
+// Voluntary switch by the side to move. Like performPlayerSwitch it uses up
+// the turn; a fighter that can't come in leaves the battle unchanged.
+bool switchHeadlessBattle(HeadlessBattle& battle, int target) {
+    int side = battle.to_move;
+    HeadlessSide& team = battle.sides[side];
+    if (target < 0 || target >= HEADLESS_TEAM_SIZE || target == team.active || team.hp[target] <= 0) {
+        return false;
+    }
+    team.active = (uint8_t)target;
+    if (side == SIDE_ENEMY) battle.turns++;
+    battle.to_move = (uint8_t)(1 - side);
+    return true;
+}
+
+// Writes a headless battle back into the GUI's teams, e.g. after searching
+// or simulating from the position on screen. The teams must hold the same
+// fighters headlessFromTeams read from them.
+bool headlessToTeams(const HeadlessBattle& battle, Team& player, int& player_active, Team& enemy, int& enemy_active) {
+    Team* teams[2] = { &player, &enemy };
+    for (int side = 0; side < 2; side++) {
+        const Team& team = *teams[side];
+        if ((int)team.size() != HEADLESS_TEAM_SIZE) return false;
+        for (int slot = 0; slot < HEADLESS_TEAM_SIZE; slot++) {
+            if (starterIndex(team[slot].getName()) != battle.sides[side].species[slot]) return false;
+        }
+    }
+    for (int side = 0; side < 2; side++) {
+        for (int slot = 0; slot < HEADLESS_TEAM_SIZE; slot++) {
+            Team& team = *teams[side];
+            int change = battle.sides[side].hp[slot] - team[slot].getHP();
+            if (change < 0) team.takeDamage(slot, -change);
+            if (change > 0) team.heal(slot, change);
+        }
+    }
+    player_active = battle.sides[SIDE_PLAYER].active;
+    enemy_active = battle.sides[SIDE_ENEMY].active;
+    return true;
+}
+
+// Everything applyHeadlessAction can change, so undoHeadlessAction restores
+// a battle in O(1) without the caller keeping a copy
+struct HeadlessUndo {
+    int16_t defender_hp;   // Defender's active fighter, before the action
+    uint8_t actives[2];
+    uint8_t defender_alive;
+    uint8_t to_move;
+    int8_t winner;
+    uint16_t turns;
+};
+
+// Plays an action (moves 0-3, then switches to slots 0-2, as in
+// pokemon_env.h) for the side to move. damage is the move's outcome, 0 for a
+// miss; switches ignore it. An illegal switch leaves the battle unchanged.
+HeadlessUndo applyHeadlessAction(HeadlessBattle& battle, int action, int damage) {
+    const HeadlessSide& defender = battle.sides[1 - battle.to_move];
+    HeadlessUndo undo = { defender.hp[defender.active],
+                          { battle.sides[0].active, battle.sides[1].active },
+                          defender.alive, battle.to_move, battle.winner, battle.turns };
+    if (action >= HEADLESS_MOVES) {
+        switchHeadlessBattle(battle, action - HEADLESS_MOVES);
+    } else {
+        applyHeadlessDamage(battle, damage);
+    }
+    return undo;
+}
+
+void undoHeadlessAction(HeadlessBattle& battle, const HeadlessUndo& undo) {
+    HeadlessSide& defender = battle.sides[1 - undo.to_move];
+    defender.hp[undo.actives[1 - undo.to_move]] = undo.defender_hp;
+    defender.alive = undo.defender_alive;
+    battle.sides[0].active = undo.actives[0];
+    battle.sides[1].active = undo.actives[1];
+    battle.to_move = undo.to_move;
+    battle.winner = undo.winner;
+    battle.turns = undo.turns;
+}
+
+// ============================================================================
+// SELF-PLAY TRAINER - Learns the enemy's move choice; -DRUN_TRAINER to train
+// ============================================================================
+
+// The policy sees each battle from the side about to move: both active
+// fighters, their HP in POLICY_HP_BUCKETS steps and how many fighters each
+// side has left. It is learned by tabular Q-learning with both sides
+// sharing one table, so every battle trains it twice. Values are win (+1)
+// or loss (-1), and a move is worth minus the opponent's best reply.
+const int POLICY_HP_BUCKETS = 8;
+const int POLICY_STATE_COUNT = HEADLESS_SPECIES * HEADLESS_SPECIES * POLICY_HP_BUCKETS *
+                               POLICY_HP_BUCKETS * HEADLESS_TEAM_SIZE * HEADLESS_TEAM_SIZE;
+const uint8_t POLICY_RANDOM_MOVE = 255; // States training never reached
+
+// Exported policy, one best move per state:
+//   "PKPO", u16 version, u32 lineupDataHash, u32 state count, u8 moves[count]
+// Integers are little-endian. A file with another hash or size is ignored.
+const string ENEMY_POLICY_FILE = "enemy_policy.bin";
+const uint16_t ENEMY_POLICY_VERSION = 1;
+
+const int TRAINER_EPOCHS = 40;
+const long long TRAINER_EPISODES_PER_EPOCH = 250000; // Per thread
+const float TRAINER_LEARNING_RATE = 0.05f;             // Divided by sqrt(epoch) as training settles
+const float TRAINER_EXPLORATION = 0.1f;              // Chance of a random move while training
+const long long TRAINER_EVAL_EPISODES = 200000;
+
+int hpBucket(int hp, int max_hp) {
+    return max(0, min(POLICY_HP_BUCKETS - 1, (hp * POLICY_HP_BUCKETS - 1) / max_hp));
+}
+
+int policyState(int my_species, int my_bucket, int my_alive,
+                int their_species, int their_bucket, int their_alive) {
+    return ((((my_species * HEADLESS_SPECIES + their_species) * POLICY_HP_BUCKETS + my_bucket) *
+             POLICY_HP_BUCKETS + their_bucket) * HEADLESS_TEAM_SIZE + (my_alive - 1)) *
+           HEADLESS_TEAM_SIZE + (their_alive - 1);
+}
+
+int policyStateFor(const HeadlessBattle& battle, int side) {
+    const HeadlessRules& rules = headlessRules();
+    const HeadlessSide& mine = battle.sides[side];
+    const HeadlessSide& theirs = battle.sides[1 - side];
+    int my_species = mine.species[mine.active];
+    int their_species = theirs.species[theirs.active];
+    return policyState(my_species, hpBucket(mine.hp[mine.active], rules.max_hp[my_species]), mine.alive,
+                       their_species, hpBucket(theirs.hp[theirs.active], rules.max_hp[their_species]),
+                       theirs.alive);
+}
+
+// Same state for the battle on screen, or -1 for teams the policy doesn't know
+int policyStateFor(const Team& mine, int my_active, const Team& theirs, int their_active) {
+    int my_species = starterIndex(mine[my_active].getName());
+    int their_species = starterIndex(theirs[their_active].getName());
+    if (my_species < 0 || their_species < 0 || mine.size() > HEADLESS_TEAM_SIZE ||
+        theirs.size() > HEADLESS_TEAM_SIZE) {
+        return -1;
+    }
+    int my_alive = 0, their_alive = 0;
+    for (const Fighter& fighter : mine) my_alive += fighter.isAlive() ? 1 : 0;
+    for (const Fighter& fighter : theirs) their_alive += fighter.isAlive() ? 1 : 0;
+    if (my_alive == 0 || their_alive == 0) return -1;
+    return policyState(my_species, hpBucket(mine[my_active].getHP(), mine[my_active].getMaxHP()), my_alive,
+                       their_species, hpBucket(theirs[their_active].getHP(), theirs[their_active].getMaxHP()),
+                       their_alive);
+}
+
+// Q-values, POLICY_STATE_COUNT rows of HEADLESS_MOVES
+using QTable = vector<float>;
+
+int bestMove(const QTable& q, int state) {
+    const float* values = &q[(size_t)state * HEADLESS_MOVES];
+    int best = 0;
+    for (int m = 1; m < HEADLESS_MOVES; m++) {
+        if (values[m] > values[best]) best = m;
+    }
+    return best;
+}
+
+float bestValue(const QTable& q, int state) {
+    return q[(size_t)state * HEADLESS_MOVES + bestMove(q, state)];
+}
+
+// Self-play episodes on one thread's table; no allocation once q exists
+void trainSelfPlay(QTable& q, long long episodes, uint64_t seed, float learning_rate, float exploration) {
+    FastRng rng(seed);
+    uint32_t explore_below = (uint32_t)(exploration * 65536.0f);
+    HeadlessBattle battle;
+    for (long long episode = 0; episode < episodes; episode++) {
+        resetHeadlessBattle(battle, rng);
+        while (battle.winner < 0) {
+            int side = battle.to_move;
+            int state = policyStateFor(battle, side);
+            int move = rng.below(65536) < explore_below ? (int)rng.below(HEADLESS_MOVES) : bestMove(q, state);
+
+            float target = stepHeadlessBattle(battle, move, rng) == HEADLESS_WON
+                ? 1.0f
+                : -bestValue(q, policyStateFor(battle, 1 - side));
+            float& value = q[(size_t)state * HEADLESS_MOVES + move];
+            value += learning_rate * (target - value);
+        }
+    }
+}
+
+// The policy's move for the side to move; random if the policy is empty or
+// never reached this state
+int policyMove(const vector<uint8_t>& policy, const HeadlessBattle& battle, FastRng& rng) {
+    if (!policy.empty()) {
+        uint8_t chosen = policy[policyStateFor(battle, battle.to_move)];
+        if (chosen != POLICY_RANDOM_MOVE) return chosen;
+    }
+    return (int)rng.below(HEADLESS_MOVES);
+}
+
+// Enemy's win rate with the policy against a player picking random moves,
+// the player moving first as in the game
+double evaluatePolicy(const vector<uint8_t>& policy, long long episodes, uint64_t seed) {
+    FastRng rng(seed);
+    HeadlessBattle battle;
+    long long enemy_wins = 0;
+    for (long long episode = 0; episode < episodes; episode++) {
+        resetHeadlessBattle(battle, rng);
+        while (battle.winner < 0) {
+            int move = battle.to_move == SIDE_ENEMY ? policyMove(policy, battle, rng)
+                                                    : (int)rng.below(HEADLESS_MOVES);
+            stepHeadlessBattle(battle, move, rng);
+        }
+        enemy_wins += battle.winner == SIDE_ENEMY ? 1 : 0;
+    }
+    return (double)enemy_wins / episodes;
+}
+
+vector<uint8_t> greedyPolicy(const QTable& q) {
+    vector<uint8_t> policy(POLICY_STATE_COUNT, POLICY_RANDOM_MOVE);
+    for (int state = 0; state < POLICY_STATE_COUNT; state++) {
+        const float* values = &q[(size_t)state * HEADLESS_MOVES];
+        if (any_of(values, values + HEADLESS_MOVES, [](float value) { return value != 0.0f; })) {
+            policy[state] = (uint8_t)bestMove(q, state);
+        }
+    }
+    return policy;
+}
+
+bool saveEnemyPolicy(const vector<uint8_t>& policy, const string& path = ENEMY_POLICY_FILE) {
+    string temp_path = path + ".tmp";
+    {
+        ofstream file(temp_path, ios::binary | ios::trunc);
+        if (!file) return false;
+        uint32_t hash = lineupDataHash();
+        uint32_t count = (uint32_t)policy.size();
+        uint8_t header[14] = { 'P', 'K', 'P', 'O',
+                               (uint8_t)(ENEMY_POLICY_VERSION & 0xFF), (uint8_t)(ENEMY_POLICY_VERSION >> 8) };
+        for (int i = 0; i < 4; i++) {
+            header[6 + i] = (uint8_t)(hash >> (8 * i));
+            header[10 + i] = (uint8_t)(count >> (8 * i));
+        }
+        file.write((const char*)header, sizeof(header));
+        file.write((const char*)policy.data(), policy.size());
+        if (!file) return false;
+    }
+    error_code error;
+    filesystem::rename(temp_path, path, error);
+    return !error;
+}
+
+// Loaded once in main before the simulation thread starts, then only read.
+// Empty means the enemy picks its moves at random.
+vector<uint8_t> enemy_policy;
+
+bool loadEnemyPolicy(const string& path = ENEMY_POLICY_FILE) {
+    ifstream file(path, ios::binary);
+    uint8_t header[14];
+    if (!file || !file.read((char*)header, sizeof(header))) return false;
+
+    uint32_t hash = 0, count = 0;
+    for (int i = 0; i < 4; i++) {
+        hash |= (uint32_t)header[6 + i] << (8 * i);
+        count |= (uint32_t)header[10 + i] << (8 * i);
+    }
+    uint16_t version = (uint16_t)(header[4] | (header[5] << 8));
+    if (memcmp(header, "PKPO", 4) != 0 || version != ENEMY_POLICY_VERSION ||
+        hash != lineupDataHash() || count != (uint32_t)POLICY_STATE_COUNT || !headlessRules().valid) {
+        return false;
+    }
+
+    vector<uint8_t> policy(count);
+    if (!file.read((char*)policy.data(), count)) return false;
+    enemy_policy = policy;
+    return true;
+}
+
+// ============================================================================
+// NEURAL EVALUATOR - Quantized position scores for the AI search
+// ============================================================================
+
+// A small NNUE-style network scoring a headless battle for the side to move.
+// Its inputs are sparse one-hot features (each slot's species and HP bucket,
+// and which fighter is active), so the int16 first layer is kept as a running
+// sum, the accumulator, and a move only adds or removes the columns of the
+// features it changed. The int8 layers after it use AVX2 when built with
+// -mavx2 and plain loops otherwise; both give identical results. Weights are
+// fitted by a -DRUN_TRAINER build to the exact solver's win chances.
+
+// Weights file: "PKEV", u16 version, u32 lineupDataHash, then the quantized
+// network in declaration order (w1, b1, w2, b2, w3, b3), little-endian
+const string EVALUATOR_FILE = "evaluator.bin";
+const uint16_t EVALUATOR_VERSION = 1;
+
+const int EVAL_HP_BUCKETS = 16;                // HP buckets of a living fighter; bucket 0 is fainted
+const int EVAL_SLOT_FEATURES = HEADLESS_SPECIES * (EVAL_HP_BUCKETS + 1);
+const int EVAL_SIDE_FEATURES = HEADLESS_TEAM_SIZE * EVAL_SLOT_FEATURES + HEADLESS_TEAM_SIZE * HEADLESS_SPECIES;
+const int EVAL_FEATURES = 2 * EVAL_SIDE_FEATURES; // Own side, then the other side
+const int EVAL_MAX_ACTIVE = 2 * (HEADLESS_TEAM_SIZE + 1); // Features set in one perspective
+const int EVAL_HIDDEN = 32;                    // Accumulator width per perspective
+const int EVAL_HIDDEN2 = 32;
+const int EVAL_ACTIVATION_MAX = 127;           // Clipped ReLU range of the quantized layers
+const int EVAL_WEIGHT_SCALE = 64;              // Quantized value = round(float * 64)
+
+const int EVAL_TRAIN_SAMPLES_PER_SIDE = 25000; // Per lineup pair and side to move
+const int EVAL_TRAIN_EPOCHS = 6;
+const int EVAL_TRAIN_BATCH = 256;
+const float EVAL_TRAIN_LEARNING_RATE = 0.002f;
+
+int evalHpBucket(int hp, int max_hp) {
+    return hp <= 0 ? 0 : 1 + min(EVAL_HP_BUCKETS - 1, (hp * EVAL_HP_BUCKETS - 1) / max_hp);
+}
+
+int evalSlotFeature(int perspective, int side, int slot, int species, int bucket) {
+    return (side == perspective ? 0 : EVAL_SIDE_FEATURES) + slot * EVAL_SLOT_FEATURES +
+           species * (EVAL_HP_BUCKETS + 1) + bucket;
+}
+
+int evalActiveFeature(int perspective, int side, int slot, int species) {
+    return (side == perspective ? 0 : EVAL_SIDE_FEATURES) + HEADLESS_TEAM_SIZE * EVAL_SLOT_FEATURES +
+           slot * HEADLESS_SPECIES + species;
+}
+
+// Features set for the battle seen from perspective; returns how many
+int evalFeatures(const HeadlessBattle& battle, int perspective, int features[EVAL_MAX_ACTIVE]) {
+    const HeadlessRules& rules = headlessRules();
+    int count = 0;
+    for (int side = 0; side < 2; side++) {
+        const HeadlessSide& team = battle.sides[side];
+        for (int slot = 0; slot < HEADLESS_TEAM_SIZE; slot++) {
+            int species = team.species[slot];
+            features[count++] = evalSlotFeature(perspective, side, slot, species,
+                                                evalHpBucket(team.hp[slot], rules.max_hp[species]));
+        }
+        features[count++] = evalActiveFeature(perspective, side, team.active, team.species[team.active]);
+    }
+    return count;
+}
+
+// Hand-written estimate to compare against: how many turns each side needs
+// to knock out everything left on the other, at the current matchup's
+// expected damage per turn
+float heuristicEvaluate(const HeadlessBattle& battle) {
+    const HeadlessRules& rules = headlessRules();
+    const HeadlessSide& mine = battle.sides[battle.to_move];
+    const HeadlessSide& theirs = battle.sides[1 - battle.to_move];
+    int my_hp = 0, their_hp = 0;
+    for (int slot = 0; slot < HEADLESS_TEAM_SIZE; slot++) {
+        my_hp += mine.hp[slot];
+        their_hp += theirs.hp[slot];
+    }
+    if (their_hp == 0) return 1.0f;
+    if (my_hp == 0) return 0.0f;
+    int my_species = mine.species[mine.active];
+    int their_species = theirs.species[theirs.active];
+    float my_turns = their_hp / max(1.0f, rules.expected_damage[my_species][their_species]);
+    float their_turns = my_hp / max(1.0f, rules.expected_damage[their_species][my_species]);
+    return their_turns / (my_turns + their_turns);
+}
+
+struct QuantizedNetwork {
+    alignas(32) int16_t w1[EVAL_FEATURES][EVAL_HIDDEN];
+    alignas(32) int16_t b1[EVAL_HIDDEN];
+    alignas(32) int8_t w2[EVAL_HIDDEN2][2 * EVAL_HIDDEN];
+    int32_t b2[EVAL_HIDDEN2];
+    alignas(32) int8_t w3[EVAL_HIDDEN2];
+    int32_t b3;
+};
+
+// First layer sums for both perspectives, indexed by side
+struct EvalAccumulator {
+    alignas(32) int16_t values[2][EVAL_HIDDEN];
+};
+
+#ifdef __AVX2__
+int32_t horizontalSum(__m256i values) {
+    __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(values), _mm256_extracti128_si256(values, 1));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(sum);
+}
+
+// Sum of 32 activations (0-127) times 32 int8 weights. The pairwise int16
+// sums can't saturate: 2 * 127 * 127 < 32767.
+int32_t dotActivations32(const uint8_t* activations, const int8_t* weights) {
+    __m256i products = _mm256_maddubs_epi16(_mm256_load_si256((const __m256i*)activations),
+                                            _mm256_load_si256((const __m256i*)weights));
+    return horizontalSum(_mm256_madd_epi16(products, _mm256_set1_epi16(1)));
+}
+#else
+int32_t dotActivations32(const uint8_t* activations, const int8_t* weights) {
+    int32_t sum = 0;
+    for (int i = 0; i < 32; i++) sum += activations[i] * weights[i];
+    return sum;
+}
+#endif
+
+class NeuralEvaluator {
+private:
+    QuantizedNetwork net = {};
+    bool loaded = false;
+
+    void addFeature(int16_t* values, int feature) const {
+        for (int i = 0; i < EVAL_HIDDEN; i++) values[i] += net.w1[feature][i];
+    }
+
+    void removeFeature(int16_t* values, int feature) const {
+        for (int i = 0; i < EVAL_HIDDEN; i++) values[i] -= net.w1[feature][i];
+    }
+
+    static uint8_t clippedActivation(int32_t value) {
+        return (uint8_t)max(0, min(EVAL_ACTIVATION_MAX, value));
+    }
+
+    // Second layer before its activation: b2 + w2 * input
+    void secondLayer(const uint8_t* input, int32_t* sums) const {
+#ifdef __AVX2__
+        static_assert(2 * EVAL_HIDDEN == 64 && EVAL_HIDDEN2 % 8 == 0, "AVX2 kernel expects 64 inputs");
+        const __m256i ones = _mm256_set1_epi16(1);
+        __m256i low_inputs = _mm256_load_si256((const __m256i*)input);
+        __m256i high_inputs = _mm256_load_si256((const __m256i*)(input + 32));
+        for (int first = 0; first < EVAL_HIDDEN2; first += 8) {
+            __m256i rows[8];
+            for (int k = 0; k < 8; k++) {
+                const int8_t* weights = net.w2[first + k];
+                __m256i low = _mm256_maddubs_epi16(low_inputs, _mm256_load_si256((const __m256i*)weights));
+                __m256i high = _mm256_maddubs_epi16(high_inputs, _mm256_load_si256((const __m256i*)(weights + 32)));
+                rows[k] = _mm256_add_epi32(_mm256_madd_epi16(low, ones), _mm256_madd_epi16(high, ones));
+            }
+            // Fold eight rows of eight partial sums into one sum per row
+            __m256i sum0123 = _mm256_hadd_epi32(_mm256_hadd_epi32(rows[0], rows[1]), _mm256_hadd_epi32(rows[2], rows[3]));
+            __m256i sum4567 = _mm256_hadd_epi32(_mm256_hadd_epi32(rows[4], rows[5]), _mm256_hadd_epi32(rows[6], rows[7]));
+            __m256i folded = _mm256_add_epi32(_mm256_permute2x128_si256(sum0123, sum4567, 0x20),
+                                              _mm256_permute2x128_si256(sum0123, sum4567, 0x31));
+            folded = _mm256_add_epi32(folded, _mm256_loadu_si256((const __m256i*)(net.b2 + first)));
+            _mm256_storeu_si256((__m256i*)(sums + first), folded);
+        }
+#else
+        for (int j = 0; j < EVAL_HIDDEN2; j++) {
+            sums[j] = net.b2[j] + dotActivations32(input, net.w2[j]) + dotActivations32(input + 32, net.w2[j] + 32);
+        }
+#endif
+    }
+
+    template <typename T>
+    static void putValues(vector<uint8_t>& out, const T* values, size_t count) {
+        for (size_t i = 0; i < count; i++) {
+            for (size_t byte = 0; byte < sizeof(T); byte++) {
+                out.push_back((uint8_t)(((uint64_t)(int64_t)values[i] >> (8 * byte)) & 0xFF));
+            }
+        }
+    }
+
+    template <typename T>
+    static bool getValues(const vector<uint8_t>& in, size_t& offset, T* values, size_t count) {
+        if (offset + count * sizeof(T) > in.size()) return false;
+        for (size_t i = 0; i < count; i++) {
+            uint64_t value = 0;
+            for (size_t byte = 0; byte < sizeof(T); byte++) value |= (uint64_t)in[offset++] << (8 * byte);
+            values[i] = (T)value;
+        }
+        return true;
+    }
+
+public:
+    bool isLoaded() const { return loaded; }
+    const QuantizedNetwork& network() const { return net; }
+
+    void setNetwork(const QuantizedNetwork& network) {
+        net = network;
+        loaded = true;
+    }
+
+    // Rebuilds both perspectives from scratch
+    void refresh(const HeadlessBattle& battle, EvalAccumulator& accumulator) const {
+        int features[EVAL_MAX_ACTIVE];
+        for (int perspective = 0; perspective < 2; perspective++) {
+            int16_t* values = accumulator.values[perspective];
+            memcpy(values, net.b1, sizeof(net.b1));
+            int count = evalFeatures(battle, perspective, features);
+            for (int i = 0; i < count; i++) addFeature(values, features[i]);
+        }
+    }
+
+    // Brings an accumulator for before up to date with after, the same battle
+    // some moves later, touching only the HP buckets and active fighters
+    // that changed
+    void update(const HeadlessBattle& before, const HeadlessBattle& after, EvalAccumulator& accumulator) const {
+        const HeadlessRules& rules = headlessRules();
+        for (int side = 0; side < 2; side++) {
+            const HeadlessSide& old_team = before.sides[side];
+            const HeadlessSide& new_team = after.sides[side];
+            for (int slot = 0; slot < HEADLESS_TEAM_SIZE; slot++) {
+                if (old_team.hp[slot] == new_team.hp[slot]) continue;
+                int species = new_team.species[slot];
+                int old_bucket = evalHpBucket(old_team.hp[slot], rules.max_hp[species]);
+                int new_bucket = evalHpBucket(new_team.hp[slot], rules.max_hp[species]);
+                if (old_bucket == new_bucket) continue;
+                for (int perspective = 0; perspective < 2; perspective++) {
+                    removeFeature(accumulator.values[perspective],
+                                  evalSlotFeature(perspective, side, slot, species, old_bucket));
+                    addFeature(accumulator.values[perspective],
+                               evalSlotFeature(perspective, side, slot, species, new_bucket));
+                }
+            }
+            if (old_team.active != new_team.active) {
+                for (int perspective = 0; perspective < 2; perspective++) {
+                    removeFeature(accumulator.values[perspective],
+                                  evalActiveFeature(perspective, side, old_team.active,
+                                                    old_team.species[old_team.active]));
+                    addFeature(accumulator.values[perspective],
+                               evalActiveFeature(perspective, side, new_team.active,
+                                                 new_team.species[new_team.active]));
+                }
+            }
+        }
+    }
+
+    // The same, from applyHeadlessAction's record: one action changes at most
+    // the defender's HP and the active fighters
+    void update(const HeadlessBattle& after, const HeadlessUndo& undo, EvalAccumulator& accumulator) const {
+        const HeadlessRules& rules = headlessRules();
+        int defender_side = 1 - undo.to_move;
+        const HeadlessSide& defender = after.sides[defender_side];
+        int slot = undo.actives[defender_side];
+        int species = defender.species[slot];
+        int old_bucket = evalHpBucket(undo.defender_hp, rules.max_hp[species]);
+        int new_bucket = evalHpBucket(defender.hp[slot], rules.max_hp[species]);
+        if (old_bucket != new_bucket) {
+            for (int perspective = 0; perspective < 2; perspective++) {
+                removeFeature(accumulator.values[perspective],
+                              evalSlotFeature(perspective, defender_side, slot, species, old_bucket));
+                addFeature(accumulator.values[perspective],
+                           evalSlotFeature(perspective, defender_side, slot, species, new_bucket));
+            }
+        }
+        for (int side = 0; side < 2; side++) {
+            const HeadlessSide& team = after.sides[side];
+            int old_active = undo.actives[side];
+            if (old_active == team.active) continue;
+            for (int perspective = 0; perspective < 2; perspective++) {
+                removeFeature(accumulator.values[perspective],
+                              evalActiveFeature(perspective, side, old_active, team.species[old_active]));
+                addFeature(accumulator.values[perspective],
+                           evalActiveFeature(perspective, side, team.active, team.species[team.active]));
+            }
+        }
+    }
+
+    // Win chance for the side to move, from an up-to-date accumulator
+    float evaluate(const HeadlessBattle& battle, const EvalAccumulator& accumulator) const {
+        alignas(32) uint8_t input[2 * EVAL_HIDDEN];
+        const int16_t* mine = accumulator.values[battle.to_move];
+        const int16_t* theirs = accumulator.values[1 - battle.to_move];
+        for (int i = 0; i < EVAL_HIDDEN; i++) {
+            input[i] = clippedActivation(mine[i]);
+            input[EVAL_HIDDEN + i] = clippedActivation(theirs[i]);
+        }
+
+        int32_t sums[EVAL_HIDDEN2];
+        secondLayer(input, sums);
+        alignas(32) uint8_t hidden[EVAL_HIDDEN2];
+        for (int j = 0; j < EVAL_HIDDEN2; j++) hidden[j] = clippedActivation(sums[j] / EVAL_WEIGHT_SCALE);
+        int32_t output = net.b3 + dotActivations32(hidden, net.w3);
+        return 1.0f / (1.0f + exp(-output / (float)(EVAL_WEIGHT_SCALE * EVAL_WEIGHT_SCALE)));
+    }
+
+    float evaluate(const HeadlessBattle& battle) const {
+        EvalAccumulator accumulator;
+        refresh(battle, accumulator);
+        return evaluate(battle, accumulator);
+    }
+
+    bool save(const string& path = EVALUATOR_FILE) const {
+        vector<uint8_t> bytes = { 'P', 'K', 'E', 'V' };
+        uint16_t version = EVALUATOR_VERSION;
+        uint32_t hash = lineupDataHash();
+        putValues(bytes, &version, 1);
+        putValues(bytes, &hash, 1);
+        putValues(bytes, &net.w1[0][0], sizeof(net.w1) / sizeof(int16_t));
+        putValues(bytes, net.b1, EVAL_HIDDEN);
+        putValues(bytes, &net.w2[0][0], sizeof(net.w2));
+        putValues(bytes, net.b2, EVAL_HIDDEN2);
+        putValues(bytes, net.w3, EVAL_HIDDEN2);
+        putValues(bytes, &net.b3, 1);
+
+        string temp_path = path + ".tmp";
+        {
+            ofstream file(temp_path, ios::binary | ios::trunc);
+            if (!file || !file.write((const char*)bytes.data(), bytes.size())) return false;
+        }
+        error_code error;
+        filesystem::rename(temp_path, path, error);
+        return !error;
+    }
+
+    // A file for other fighter data (different hash) is ignored
+    bool load(const string& path = EVALUATOR_FILE) {
+        ifstream file(path, ios::binary);
+        if (!file) return false;
+        vector<uint8_t> bytes((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+
+        size_t offset = 4;
+        uint16_t version = 0;
+        uint32_t hash = 0;
+        QuantizedNetwork loaded_net = {};
+        if (bytes.size() < 4 || memcmp(bytes.data(), "PKEV", 4) != 0 ||
+            !getValues(bytes, offset, &version, 1) || !getValues(bytes, offset, &hash, 1) ||
+            version != EVALUATOR_VERSION || hash != lineupDataHash() || !headlessRules().valid ||
+            !getValues(bytes, offset, &loaded_net.w1[0][0], sizeof(loaded_net.w1) / sizeof(int16_t)) ||
+            !getValues(bytes, offset, loaded_net.b1, EVAL_HIDDEN) ||
+            !getValues(bytes, offset, &loaded_net.w2[0][0], sizeof(loaded_net.w2)) ||
+            !getValues(bytes, offset, loaded_net.b2, EVAL_HIDDEN2) ||
+            !getValues(bytes, offset, loaded_net.w3, EVAL_HIDDEN2) ||
+            !getValues(bytes, offset, &loaded_net.b3, 1) || offset != bytes.size()) {
+            return false;
+        }
+        setNetwork(loaded_net);
+        return true;
+    }
+};
+
+// Loaded once in main before the simulation thread starts, then only read
+NeuralEvaluator neural_evaluator;
+
+// Positions labelled with the exact win chance for the side to move
+struct EvalSample {
+    HeadlessBattle battle;
+    float win_chance;
+};
+
+// Samples states of every lineup pair from the exact solver, with either
+// side to move. These are the states of battles without voluntary switches.
+vector<EvalSample> buildEvaluatorSamples(int samples_per_side, uint64_t seed) {
+    FastRng rng(seed);
+    vector<EvalSample> samples;
+    vector<vector<string>> orders = allTeamOrders();
+    for (const vector<string>& player_order : orders) {
+        for (const vector<string>& enemy_order : orders) {
+            Team player = createTeamInOrder(player_order, true);
+            Team enemy = createTeamInOrder(enemy_order, false);
+            WinProbabilitySolver solver(player, 0, enemy, 0);
+            solver.solve(thread::hardware_concurrency());
+
+            uint8_t species[2][HEADLESS_TEAM_SIZE];
+            for (int slot = 0; slot < HEADLESS_TEAM_SIZE; slot++) {
+                species[SIDE_PLAYER][slot] = (uint8_t)starterIndex(player_order[slot]);
+                species[SIDE_ENEMY][slot] = (uint8_t)starterIndex(enemy_order[slot]);
+            }
+            uint32_t keep_below = (uint32_t)min<uint64_t>(
+                0xFFFFFFFFu, (uint64_t)samples_per_side * 0x100000000ULL / max<size_t>(1, solver.stateCount()));
+
+            solver.forEachState([&](int player_place, int player_hp, int enemy_place, int enemy_hp,
+                                    double player_to_move, double enemy_to_move) {
+                for (int to_move = 0; to_move < 2; to_move++) {
+                    if (rng.next() >= keep_below) continue;
+                    EvalSample sample;
+                    resetHeadlessBattle(sample.battle, species[SIDE_PLAYER], species[SIDE_ENEMY]);
+                    int places[2] = { player_place, enemy_place };
+                    int hps[2] = { player_hp, enemy_hp };
+                    for (int side = 0; side < 2; side++) {
+                        HeadlessSide& team = sample.battle.sides[side];
+                        for (int slot = 0; slot < places[side]; slot++) team.hp[slot] = 0;
+                        team.hp[places[side]] = (int16_t)hps[side];
+                        team.active = (uint8_t)places[side];
+                        team.alive = (uint8_t)(HEADLESS_TEAM_SIZE - places[side]);
+                    }
+                    sample.battle.to_move = (uint8_t)to_move;
+                    sample.win_chance = (float)(to_move == SIDE_PLAYER ? player_to_move : 1.0 - enemy_to_move);
+                    samples.push_back(sample);
+                }
+            });
+        }
+    }
+    return samples;
+}
+
+// Float twin of QuantizedNetwork used for training: the same layers with the
+// clipped ReLUs at the quantized range, and layer 2 and 3 weights kept
+// within what int8 can hold. Parameters sit in one array in the order
+// w1, b1, w2, b2, w3, b3.
+class EvaluatorTrainer {
+private:
+    static const int W1 = 0;
+    static const int B1 = W1 + EVAL_FEATURES * EVAL_HIDDEN;
+    static const int W2 = B1 + EVAL_HIDDEN;
+    static const int B2 = W2 + EVAL_HIDDEN2 * 2 * EVAL_HIDDEN;
+    static const int W3 = B2 + EVAL_HIDDEN2;
+    static const int B3 = W3 + EVAL_HIDDEN2;
+    static const int PARAMETERS = B3 + 1;
+
+    vector<float> params, gradients, first_moment, second_moment;
+    int steps = 0;
+
+    static constexpr float ACTIVATION_MAX = EVAL_ACTIVATION_MAX / (float)EVAL_WEIGHT_SCALE;
+    static constexpr float INT8_WEIGHT_MAX = 127.0f / EVAL_WEIGHT_SCALE;
+
+    static float clipped(float value) { return max(0.0f, min(ACTIVATION_MAX, value)); }
+    static bool passesGradient(float value) { return value > 0.0f && value < ACTIVATION_MAX; }
+
+    // Logit for the side to move; fills the activations backward() needs
+    float forward(const HeadlessBattle& battle, int features[2][EVAL_MAX_ACTIVE], int counts[2],
+                  float accumulators[2][EVAL_HIDDEN], float input[2 * EVAL_HIDDEN],
+                  float hidden[EVAL_HIDDEN2]) const {
+        int order[2] = { battle.to_move, 1 - battle.to_move };
+        for (int half = 0; half < 2; half++) {
+            counts[half] = evalFeatures(battle, order[half], features[half]);
+            for (int i = 0; i < EVAL_HIDDEN; i++) {
+                float sum = params[B1 + i];
+                for (int f = 0; f < counts[half]; f++) sum += params[W1 + features[half][f] * EVAL_HIDDEN + i];
+                accumulators[half][i] = sum;
+                input[half * EVAL_HIDDEN + i] = clipped(sum);
+            }
+        }
+        float output = params[B3];
+        for (int j = 0; j < EVAL_HIDDEN2; j++) {
+            float sum = params[B2 + j];
+            const float* weights = &params[W2 + j * 2 * EVAL_HIDDEN];
+            for (int i = 0; i < 2 * EVAL_HIDDEN; i++) sum += weights[i] * input[i];
+            hidden[j] = sum;
+            output += params[W3 + j] * clipped(sum);
+        }
+        return output;
+    }
+
+public:
+    explicit EvaluatorTrainer(uint64_t seed)
+        : params(PARAMETERS, 0.0f), gradients(PARAMETERS, 0.0f),
+          first_moment(PARAMETERS, 0.0f), second_moment(PARAMETERS, 0.0f) {
+        FastRng rng(seed);
+        auto uniform = [&](float limit) { return (rng.next() / 4294967296.0f * 2.0f - 1.0f) * limit; };
+        for (int i = W1; i < B1; i++) params[i] = uniform(0.2f);
+        for (int i = B1; i < W2; i++) params[i] = 0.5f;
+        for (int i = W2; i < B2; i++) params[i] = uniform(1.0f / sqrt(2.0f * EVAL_HIDDEN));
+        for (int i = W3; i < B3; i++) params[i] = uniform(1.0f / sqrt((float)EVAL_HIDDEN2));
+    }
+
+    float predict(const HeadlessBattle& battle) const {
+        int features[2][EVAL_MAX_ACTIVE], counts[2];
+        float accumulators[2][EVAL_HIDDEN], input[2 * EVAL_HIDDEN], hidden[EVAL_HIDDEN2];
+        return 1.0f / (1.0f + exp(-forward(battle, features, counts, accumulators, input, hidden)));
+    }
+
+    // One Adam step on a batch under cross-entropy loss; returns the mean loss
+    float trainBatch(const EvalSample* samples, int count, float learning_rate) {
+        fill(gradients.begin(), gradients.end(), 0.0f);
+        float loss = 0.0f;
+        for (int s = 0; s < count; s++) {
+            int features[2][EVAL_MAX_ACTIVE], counts[2];
+            float accumulators[2][EVAL_HIDDEN], input[2 * EVAL_HIDDEN], hidden[EVAL_HIDDEN2];
+            float output = forward(samples[s].battle, features, counts, accumulators, input, hidden);
+            float predicted = 1.0f / (1.0f + exp(-output));
+            float target = samples[s].win_chance;
+            loss -= target * log(max(predicted, 1e-7f)) + (1.0f - target) * log(max(1.0f - predicted, 1e-7f));
+
+            float output_gradient = predicted - target;
+            float input_gradient[2 * EVAL_HIDDEN] = {};
+            gradients[B3] += output_gradient;
+            for (int j = 0; j < EVAL_HIDDEN2; j++) {
+                gradients[W3 + j] += output_gradient * clipped(hidden[j]);
+                if (!passesGradient(hidden[j])) continue;
+                float hidden_gradient = output_gradient * params[W3 + j];
+                gradients[B2 + j] += hidden_gradient;
+                const float* weights = &params[W2 + j * 2 * EVAL_HIDDEN];
+                float* weight_gradients = &gradients[W2 + j * 2 * EVAL_HIDDEN];
+                for (int i = 0; i < 2 * EVAL_HIDDEN; i++) {
+                    weight_gradients[i] += hidden_gradient * input[i];
+                    input_gradient[i] += hidden_gradient * weights[i];
+                }
+            }
+            for (int half = 0; half < 2; half++) {
+                for (int i = 0; i < EVAL_HIDDEN; i++) {
+                    if (!passesGradient(accumulators[half][i])) continue;
+                    float gradient = input_gradient[half * EVAL_HIDDEN + i];
+                    gradients[B1 + i] += gradient;
+                    for (int f = 0; f < counts[half]; f++) {
+                        gradients[W1 + features[half][f] * EVAL_HIDDEN + i] += gradient;
+                    }
+                }
+            }
+        }
+
+        steps++;
+        const float beta1 = 0.9f, beta2 = 0.999f;
+        float step_size = learning_rate * sqrt(1.0f - pow(beta2, (float)steps)) / (1.0f - pow(beta1, (float)steps));
+        for (int i = 0; i < PARAMETERS; i++) {
+            float gradient = gradients[i] / count;
+            first_moment[i] = beta1 * first_moment[i] + (1.0f - beta1) * gradient;
+            second_moment[i] = beta2 * second_moment[i] + (1.0f - beta2) * gradient * gradient;
+            params[i] -= step_size * first_moment[i] / (sqrt(second_moment[i]) + 1e-8f);
+        }
+        for (int i = W2; i < B2; i++) params[i] = max(-INT8_WEIGHT_MAX, min(INT8_WEIGHT_MAX, params[i]));
+        for (int i = W3; i < B3; i++) params[i] = max(-INT8_WEIGHT_MAX, min(INT8_WEIGHT_MAX, params[i]));
+        return loss / count;
+    }
+
+    QuantizedNetwork quantize() const {
+        QuantizedNetwork net = {};
+        auto scaled = [](float value, float scale, float limit) {
+            return (int32_t)max(-limit, min(limit, round(value * scale)));
+        };
+        const float scale = EVAL_WEIGHT_SCALE, scale2 = (float)EVAL_WEIGHT_SCALE * EVAL_WEIGHT_SCALE;
+        for (int f = 0; f < EVAL_FEATURES; f++) {
+            for (int i = 0; i < EVAL_HIDDEN; i++) net.w1[f][i] = (int16_t)scaled(params[W1 + f * EVAL_HIDDEN + i], scale, 32767);
+        }
+        for (int i = 0; i < EVAL_HIDDEN; i++) net.b1[i] = (int16_t)scaled(params[B1 + i], scale, 32767);
+        for (int j = 0; j < EVAL_HIDDEN2; j++) {
+            for (int i = 0; i < 2 * EVAL_HIDDEN; i++) net.w2[j][i] = (int8_t)scaled(params[W2 + j * 2 * EVAL_HIDDEN + i], scale, 127);
+            net.b2[j] = scaled(params[B2 + j], scale2, 2e9f);
+            net.w3[j] = (int8_t)scaled(params[W3 + j], scale, 127);
+        }
+        net.b3 = scaled(params[B3], scale2, 2e9f);
+        return net;
+    }
+};
+
+// ============================================================================
+// ENEMY SEARCH - Anytime expectimax, thinking while the player watches
+// ============================================================================
+
+// The enemy looks ahead over its moves, the player's moves and switches, and
+// every roll in between: a miss, then each distinct damage value with its
+// exact chance. Positions at the horizon are scored by the neural evaluator
+// (or heuristicEvaluate without weights). Searching one ply deeper at a time
+// on a worker thread means a good answer is always ready: thinking starts as
+// soon as the player acts and the best move of the deepest finished search
+// is played when AI_DELAY_MS runs out.
+
+const int SEARCH_MAX_DEPTH = 12;       // Plies; deeper searches never finish in AI_DELAY_MS
+const int SEARCH_MAX_ACTIONS = HEADLESS_MOVES + HEADLESS_TEAM_SIZE;
+const int SEARCH_TABLE_BITS = 20;      // 2^20 entries of 16 bytes
+const int PONDER_THREADS = 1;          // Pondering is speculative; the other workers stay idle
+const int PONDER_START_DEPTH = 4;      // Reply depth assumed before the first reply is searched
+const unsigned int PONDER_BUDGET_MS = AI_DELAY_MS;  // Longest pondering runs per player turn
+
+// Workers for the enemy search. Build with -DSEARCH_THREADS=<n> to fix the
+// count; by default there is one per core, less one for the game itself.
+#ifndef SEARCH_THREADS
+#define SEARCH_THREADS 0
+#endif
+
+int searchThreadCount() {
+    if (SEARCH_THREADS > 0) return SEARCH_THREADS;
+    return max(1, (int)thread::hardware_concurrency() - 1);
+}
+
+// Every distinct result of one move, with its chance
+struct HitOutcomes {
+    float miss_chance = 0.0f;
+    int count = 0;
+    int16_t damage[2 * RANDOM_FACTOR_STEPS];   // Ascending
+    float chance[2 * RANDOM_FACTOR_STEPS];
+};
+
+struct SearchTables {
+    HitOutcomes outcomes[HEADLESS_SPECIES][HEADLESS_MOVES][HEADLESS_SPECIES]; // [attacker][move][defender]
+};
+
+SearchTables buildSearchTables() {
+    const HeadlessRules& rules = headlessRules();
+    SearchTables tables;
+    for (int attacker = 0; attacker < HEADLESS_SPECIES; attacker++) {
+        for (int move = 0; move < HEADLESS_MOVES; move++) {
+            float hit_chance = rules.accuracy[attacker][move] / 100.0f;
+            float crit_chance = rules.crit_rolls[attacker][move] / (float)CRIT_ROLL_RANGE;
+            for (int defender = 0; defender < HEADLESS_SPECIES; defender++) {
+                HitOutcomes& outcomes = tables.outcomes[attacker][move][defender];
+                outcomes.miss_chance = 1.0f - hit_chance;
+                pair<int, float> rolls[2 * RANDOM_FACTOR_STEPS];
+                int roll_count = 0;
+                for (int critical = 0; critical <= 1; critical++) {
+                    for (int step = 0; step < RANDOM_FACTOR_STEPS; step++) {
+                        rolls[roll_count++] = { rules.damage[attacker][move][defender][critical][step],
+                                                hit_chance * (critical ? crit_chance : 1.0f - crit_chance) /
+                                                    RANDOM_FACTOR_STEPS };
+                    }
+                }
+                sort(rolls, rolls + roll_count);
+                for (int i = 0; i < roll_count; i++) {
+                    if (rolls[i].second <= 0.0f) continue;
+                    if (outcomes.count > 0 && outcomes.damage[outcomes.count - 1] == rolls[i].first) {
+                        outcomes.chance[outcomes.count - 1] += rolls[i].second;
+                    } else {
+                        outcomes.damage[outcomes.count] = (int16_t)rolls[i].first;
+                        outcomes.chance[outcomes.count++] = rolls[i].second;
+                    }
+                }
+            }
+        }
+    }
+    return tables;
+}
+
+const SearchTables& searchTables() {
+    static const SearchTables tables = buildSearchTables();
+    return tables;
+}
+
+// The actions open to the side to move, numbered like pokemon_env.h: moves,
+// then switches. Only the player switches by choice, as in the game.
+int searchActions(const HeadlessBattle& battle, int actions[SEARCH_MAX_ACTIONS]) {
+    int count = 0;
+    for (int move = 0; move < HEADLESS_MOVES; move++) actions[count++] = move;
+    if (battle.to_move == SIDE_PLAYER) {
+        const HeadlessSide& team = battle.sides[SIDE_PLAYER];
+        for (int slot = 0; slot < HEADLESS_TEAM_SIZE; slot++) {
+            if (slot != team.active && team.hp[slot] > 0) actions[count++] = HEADLESS_MOVES + slot;
+        }
+    }
+    return count;
+}
+
+// Hash of everything a position's value depends on. Species are included
+// so the table stays valid from one battle to the next.
+uint64_t searchKey(const HeadlessBattle& battle) {
+    uint64_t hps = 0;
+    uint64_t rest = battle.to_move;
+    for (int side = 0; side < 2; side++) {
+        const HeadlessSide& team = battle.sides[side];
+        rest = (rest << 2) | team.active;
+        for (int slot = 0; slot < HEADLESS_TEAM_SIZE; slot++) {
+            hps = hps * 0x10001ULL + (uint16_t)team.hp[slot];
+            rest = (rest << 2) | team.species[slot];
+        }
+    }
+    uint64_t key = hps ^ (rest * 0x9E3779B97F4A7C15ULL);
+    key = (key ^ (key >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    key = (key ^ (key >> 27)) * 0x94D049BB133111EBULL;
+    return key ^ (key >> 31);
+}
+
+// Positions already searched, with their value and the depth behind it, so
+// a search can reuse work from an earlier one: the enemy's reply starts from
+// what pondering found during the player's turn. Each slot is two words with
+// the key stored XORed with the data; a slot torn by two threads writing at
+// once no longer matches its key and reads as a miss.
+class TranspositionTable {
+private:
+    struct Entry {
+        atomic<uint64_t> check{0};  // key ^ data
+        atomic<uint64_t> data{0};   // value bits | depth << 32 | generation << 40
+    };
+    vector<Entry> entries;
+    uint64_t mask = 0;
+    atomic<uint8_t> generation{0};
+
+public:
+    void resize(int bits) {
+        entries = vector<Entry>((size_t)1 << bits);
+        mask = ((uint64_t)1 << bits) - 1;
+    }
+
+    void clear() {
+        for (Entry& entry : entries) {
+            entry.check.store(0, memory_order_relaxed);
+            entry.data.store(0, memory_order_relaxed);
+        }
+    }
+
+    bool isAllocated() const { return !entries.empty(); }
+
+    // Entries from earlier generations are the first to be replaced
+    void newGeneration() { generation.fetch_add(1, memory_order_relaxed); }
+
+    // Value of key if it was searched at least depth plies deep
+    bool probe(uint64_t key, int depth, float& value) const {
+        const Entry& entry = entries[key & mask];
+        uint64_t data = entry.data.load(memory_order_relaxed);
+        if ((entry.check.load(memory_order_relaxed) ^ data) != key) return false;
+        if ((int)((data >> 32) & 0xFF) < depth) return false;
+        uint32_t bits = (uint32_t)data;
+        memcpy(&value, &bits, sizeof(value));
+        return true;
+    }
+
+    // Keeps the deeper of two results for the same slot within a generation,
+    // whether or not they are for the same position: a worker that probed
+    // before another stored may finish a shallower search of the same key
+    void store(uint64_t key, int depth, float value) {
+        Entry& entry = entries[key & mask];
+        uint8_t current = generation.load(memory_order_relaxed);
+        uint64_t old_data = entry.data.load(memory_order_relaxed);
+        bool old_current = (uint8_t)(old_data >> 40) == current;
+        if (old_current && (int)((old_data >> 32) & 0xFF) > depth) return;
+        uint32_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        uint64_t data = bits | ((uint64_t)depth << 32) | ((uint64_t)current << 40);
+        entry.check.store(key ^ data, memory_order_relaxed);
+        entry.data.store(data, memory_order_relaxed);
+    }
+};
+
+// One fixed-depth expectimax search. Values are win chances for the side to
+// move; a search can be abandoned part-way through by setting *stop, and is
+// abandoned by itself once the deadline passes. With a
+// table, positions it already holds deeply enough are not searched again.
+// Searches differing only in rotation visit actions in different orders but
+// return the same values.
+class ExpectimaxSearch {
+private:
+    const atomic<bool>* stop;
+    TranspositionTable* table;
+    int rotation;
+    chrono::steady_clock::time_point deadline;
+    HeadlessBattle position = {};   // Where the search is; restored after every action
+    bool aborted = false;
+    long long nodes = 0;
+    bool use_network = false;
+
+    float evaluate(const HeadlessBattle& battle, const EvalAccumulator& accumulator) const {
+        return use_network ? neural_evaluator.evaluate(battle, accumulator) : heuristicEvaluate(battle);
+    }
+
+    // Value for the side that just moved of the position it moved into. The
+    // search plays actions on one battle and undoes them, never copying it.
+    float childValue(const HeadlessUndo& undo, const EvalAccumulator& accumulator, int depth) {
+        if (position.winner >= 0) return 1.0f;
+        EvalAccumulator child_accumulator = accumulator;
+        if (use_network) neural_evaluator.update(position, undo, child_accumulator);
+        return 1.0f - search(child_accumulator, depth);
+    }
+
+    float playAction(int action, int damage, const EvalAccumulator& accumulator, int depth) {
+        HeadlessUndo undo = applyHeadlessAction(position, action, damage);
+        float value = childValue(undo, accumulator, depth);
+        undoHeadlessAction(position, undo);
+        return value;
+    }
+
+    float actionValue(const EvalAccumulator& accumulator, int action, int depth) {
+        if (action >= HEADLESS_MOVES) return playAction(action, 0, accumulator, depth - 1);
+
+        const HeadlessSide& attacker = position.sides[position.to_move];
+        const HeadlessSide& defender = position.sides[1 - position.to_move];
+        const HitOutcomes& outcomes = searchTables().outcomes[attacker.species[attacker.active]][action]
+                                                             [defender.species[defender.active]];
+        float value = 0.0f;
+        if (outcomes.miss_chance > 0.0f) {
+            value += outcomes.miss_chance * playAction(action, 0, accumulator, depth - 1);
+        }
+        int defender_hp = defender.hp[defender.active];
+        for (int i = 0; i < outcomes.count; i++) {
+            // Every roll from here on knocks the defender out, so play it once
+            float chance = outcomes.chance[i];
+            bool knocks_out = outcomes.damage[i] >= defender_hp;
+            if (knocks_out) {
+                for (int j = i + 1; j < outcomes.count; j++) chance += outcomes.chance[j];
+            }
+            value += chance * playAction(action, outcomes.damage[i], accumulator, depth - 1);
+            if (knocks_out) break;
+        }
+        return value;
+    }
+
+    float search(const EvalAccumulator& accumulator, int depth) {
+        nodes++;
+        if (depth == 0) return evaluate(position, accumulator);
+        if ((nodes & 255) == 0 && ((stop != nullptr && stop->load(memory_order_relaxed)) ||
+                                   chrono::steady_clock::now() >= deadline)) {
+            aborted = true;
+        }
+        if (aborted) return 0.0f;
+
+        uint64_t key = 0;
+        if (table != nullptr) {
+            float stored;
+            key = searchKey(position);
+            if (table->probe(key, depth, stored)) return stored;
+        }
+
+        int actions[SEARCH_MAX_ACTIONS];
+        int count = searchActions(position, actions);
+        float best = 0.0f;
+        for (int i = 0; i < count; i++) {
+            best = max(best, actionValue(accumulator, actions[(i + rotation) % count], depth));
+        }
+        if (table != nullptr && !aborted) table->store(key, depth, best);
+        return best;
+    }
+
+public:
+    explicit ExpectimaxSearch(const atomic<bool>* stop_flag = nullptr, TranspositionTable* shared_table = nullptr,
+                              int action_rotation = 0,
+                              chrono::steady_clock::time_point stop_at = chrono::steady_clock::time_point::max())
+        : stop(stop_flag), table(shared_table), rotation(action_rotation), deadline(stop_at),
+          use_network(neural_evaluator.isLoaded()) {}
+
+    long long nodeCount() const { return nodes; }
+
+    // Best action for the side to move, searching depth plies. Returns -1 if
+    // stopped before every action was scored.
+    int bestAction(const HeadlessBattle& root, int depth, float* best_value = nullptr) {
+        EvalAccumulator accumulator;
+        if (use_network) neural_evaluator.refresh(root, accumulator);
+        aborted = false;
+        position = root;
+
+        int actions[SEARCH_MAX_ACTIONS];
+        int count = searchActions(root, actions);
+        int best_action = -1;
+        float best = -1.0f;
+        for (int i = 0; i < count; i++) {
+            int action = actions[(i + rotation) % count];
+            float value = actionValue(accumulator, action, depth);
+            if (aborted) return -1;
+            if (value > best || (value == best && action < best_action)) {
+                best = value;
+                best_action = action;
+            }
+        }
+        if (best_value != nullptr) *best_value = best;
+        return best_action;
+    }
+};
+
+// Worker threads running iterative deepening on the position they were last
+// given. With the enemy to move they publish the best move of the deepest
+// search finished; with the player to move the first PONDER_THREADS of them
+// ponder for a bounded time, searching every action the player might take so
+// the enemy's replies are in the table when it is asked. Extra workers follow the Lazy SMP scheme: each runs the same
+// search with its own action order, and some one ply ahead, sharing only the
+// table, so positions one worker finishes are free for the others.
+class AnytimeSearch {
+private:
+    mutex search_mutex;
+    condition_variable wake;
+    condition_variable finished;
+    bool running = false;
+    uint64_t job = 0;       // Bumped for every position handed out
+    int busy = 0;           // Workers still on the current job
+    HeadlessBattle position = {};
+    int max_depth = SEARCH_MAX_DEPTH;
+    int job_threads = 0;    // Workers taking part in the current job
+    chrono::steady_clock::time_point job_deadline = chrono::steady_clock::time_point::max();
+    int reply_depth = PONDER_START_DEPTH;   // Depth the last move played came from
+    atomic<bool> stop_requested{false};
+    atomic<int> result{0xFF};   // Deepest finished depth << 8 | its move, 0xFF for none
+    atomic<long long> nodes{0};
+    TranspositionTable table;
+    vector<thread> workers;
+
+    // Keeps whichever finished search went deepest
+    void publish(int depth, int move) {
+        int packed = (depth << 8) | (move & 0xFF);
+        int current = result.load();
+        while ((current >> 8) < depth && !result.compare_exchange_weak(current, packed)) {}
+    }
+
+    void run(int index) {
+        uint64_t seen = 0;
+        unique_lock<mutex> lock(search_mutex);
+        while (true) {
+            wake.wait(lock, [&] { return job != seen || !running; });
+            if (!running) break;
+            seen = job;
+            if (index >= job_threads) {
+                if (--busy == 0) finished.notify_all();
+                continue;
+            }
+            HeadlessBattle root = position;
+            int last_depth = max_depth;
+            chrono::steady_clock::time_point deadline = job_deadline;
+            lock.unlock();
+
+            ExpectimaxSearch search(&stop_requested, &table, index, deadline);
+            for (int depth = 1 + (index & 1); depth <= last_depth && !stop_requested.load(); depth++) {
+                int move = search.bestAction(root, depth);
+                if (move < 0) break;
+                publish(depth, root.to_move == SIDE_ENEMY ? move : 0xFF);
+                if (depth == last_depth) stop_requested.store(true);
+            }
+            nodes.fetch_add(search.nodeCount());
+
+            lock.lock();
+            if (--busy == 0) finished.notify_all();
+        }
+    }
+
+    // Caller holds the lock
+    void waitUntilIdle(unique_lock<mutex>& lock) {
+        stop_requested.store(true);
+        finished.wait(lock, [this] { return busy == 0; });
+    }
+
+    // Caller holds the lock and has waited until idle
+    void post(const HeadlessBattle& root, int depth_limit, int threads,
+              chrono::steady_clock::time_point deadline = chrono::steady_clock::time_point::max()) {
+        if (root.to_move == SIDE_PLAYER) table.newGeneration();
+        position = root;
+        max_depth = depth_limit;
+        job_threads = threads;
+        job_deadline = deadline;
+        busy = (int)workers.size();
+        job++;
+        stop_requested.store(false);
+        result.store(0xFF);
+        nodes.store(0);
+    }
+
+public:
+    void start(int threads) {
+        lock_guard<mutex> lock(search_mutex);
+        if (running) return;
+        if (!table.isAllocated()) table.resize(SEARCH_TABLE_BITS);
+        running = true;
+        for (int i = 0; i < max(1, threads); i++) workers.emplace_back(&AnytimeSearch::run, this, i);
+    }
+
+    void stop() {
+        {
+            lock_guard<mutex> lock(search_mutex);
+            if (!running) return;
+            running = false;
+            stop_requested.store(true);
+        }
+        wake.notify_all();
+        for (thread& worker : workers) worker.join();
+        workers.clear();
+        busy = 0;
+    }
+
+    // Starts searching a position, dropping any search still going. Each
+    // turn, from pondering to the enemy's reply, is one table generation.
+    // The enemy's own move gets every worker until it is taken. Pondering
+    // gets PONDER_THREADS workers and stops one ply past the depth the last
+    // reply reached, which leaves the replies to that depth in the table,
+    // or after PONDER_BUDGET_MS, so a slow player does not keep cores busy.
+    void think(const HeadlessBattle& root) {
+        {
+            unique_lock<mutex> lock(search_mutex);
+            if (!running) return;
+            waitUntilIdle(lock);
+            if (root.to_move == SIDE_PLAYER) {
+                post(root, min(SEARCH_MAX_DEPTH, reply_depth + 1), PONDER_THREADS,
+                     chrono::steady_clock::now() + chrono::milliseconds(PONDER_BUDGET_MS));
+            } else {
+                post(root, SEARCH_MAX_DEPTH, (int)workers.size());
+            }
+        }
+        wake.notify_all();
+    }
+
+    // Searches root until some worker finishes depth; returns that search's
+    // move, or -1 if not running. For the benchmarks.
+    int searchToDepth(const HeadlessBattle& root, int depth) {
+        unique_lock<mutex> lock(search_mutex);
+        if (!running) return -1;
+        waitUntilIdle(lock);
+        post(root, depth, (int)workers.size());
+        wake.notify_all();
+        finished.wait(lock, [this] { return busy == 0; });
+        int move = result.load() & 0xFF;
+        return move == 0xFF ? -1 : move;
+    }
+
+    // Stops thinking and returns the best move found, or -1 if there is none
+    int takeBestMove() {
+        unique_lock<mutex> lock(search_mutex);
+        if (!running) return -1;
+        waitUntilIdle(lock);
+        int packed = result.exchange(0xFF);
+        int move = packed & 0xFF;
+        if (move == 0xFF) return -1;
+        reply_depth = packed >> 8;
+        return move;
+    }
+
+    void clearTable() {
+        unique_lock<mutex> lock(search_mutex);
+        if (running) waitUntilIdle(lock);
+        table.clear();
+    }
+
+    // Nodes visited by all workers on the last finished search
+    long long nodeCount() const { return nodes.load(); }
+
+    // Drops the current search and its answer, e.g. when the battle ends
+    void cancel() {
+        unique_lock<mutex> lock(search_mutex);
+        if (!running) return;
+        waitUntilIdle(lock);
+        result.store(0xFF);
+    }
+
+    int depthReached() const { return result.load() >> 8; }
+};
+
+// Started in main; idle unless the enemy is about to move
+AnytimeSearch enemy_search;
+
+// Hands the battle on screen to the search as soon as it is the enemy's turn
+void startEnemyThinking(const Team& player, int player_active, const Team& enemy, int enemy_active) {
+    HeadlessBattle root;
+    if (headlessFromTeams(player, player_active, enemy, enemy_active, SIDE_ENEMY, root)) {
+        enemy_search.think(root);
+    }
+}
+
+// While the player decides, the enemy works out its replies in advance
+void startEnemyPondering(const Team& player, int player_active, const Team& enemy, int enemy_active) {
+    HeadlessBattle root;
+    if (headlessFromTeams(player, player_active, enemy, enemy_active, SIDE_PLAYER, root)) {
+        enemy_search.think(root);
+    }
+}
+
+// Move for the enemy's active fighter: the search's answer when it has one,
+// then the trained policy's pick, otherwise a random move as before
+int chooseEnemyMove(const Team& enemy, int enemy_active, const Team& player, int player_active) {
+    int move_count = (int)enemy[enemy_active].getMoves().size();
+    int searched = enemy_search.takeBestMove();
+    if (searched >= 0 && searched < move_count) return searched;
+    if (!enemy_policy.empty() && move_count == HEADLESS_MOVES) {
+        int state = policyStateFor(enemy, enemy_active, player, player_active);
+        if (state >= 0 && enemy_policy[state] != POLICY_RANDOM_MOVE) return enemy_policy[state];
+    }
+    return rand() % move_count;
+}
+
+// ============================================================================
+// TRAINING ENVIRONMENT - The C API in pokemon_env.h; -DBUILD_ENV_LIBRARY
+// ============================================================================
+#if defined(BUILD_ENV_LIBRARY) || defined(RUN_BENCHMARKS)
+
+static_assert(POKEMON_ENV_ACTION_COUNT == HEADLESS_MOVES + HEADLESS_TEAM_SIZE,
+              "pokemon_env.h actions are the moves, then a switch to each team slot");
+static_assert(POKEMON_ENV_OBSERVATION_SIZE ==
+              2 * HEADLESS_TEAM_SIZE * (HEADLESS_SPECIES + 2) + POKEMON_ENV_ACTION_COUNT,
+              "pokemon_env.h observation layout doesn't match the headless battle");
+
+// Every array is sized once in pokemon_env_create
+struct PokemonEnv {
+    vector<HeadlessBattle> battles;
+    vector<FastRng> rngs;
+};
+
+// Layout documented at POKEMON_ENV_OBSERVATION_SIZE; always the player's turn
+void writeEnvObservation(const HeadlessBattle& battle, float* out) {
+    const HeadlessRules& rules = headlessRules();
+    for (int side = 0; side < 2; side++) {
+        const HeadlessSide& team = battle.sides[side];
+        for (int slot = 0; slot < HEADLESS_TEAM_SIZE; slot++) {
+            int species = team.species[slot];
+            for (int s = 0; s < HEADLESS_SPECIES; s++) *out++ = s == species ? 1.0f : 0.0f;
+            *out++ = team.hp[slot] / (float)rules.max_hp[species];
+            *out++ = slot == team.active ? 1.0f : 0.0f;
+        }
+    }
+    const HeadlessSide& player = battle.sides[SIDE_PLAYER];
+    for (int m = 0; m < HEADLESS_MOVES; m++) *out++ = 1.0f;
+    for (int slot = 0; slot < HEADLESS_TEAM_SIZE; slot++) {
+        *out++ = (slot != player.active && player.hp[slot] > 0) ? 1.0f : 0.0f;
+    }
+}
+
+extern "C" {
+
+int pokemon_env_version(void) {
+    return POKEMON_ENV_VERSION;
+}
+
+PokemonEnv* pokemon_env_create(int32_t count) {
+    if (count < 1 || !headlessRules().valid) return nullptr;
+    PokemonEnv* env = new PokemonEnv();
+    env->battles.resize(count);
+    env->rngs.resize(count);
+    for (int32_t i = 0; i < count; i++) {
+        env->rngs[i].seed((uint64_t)i);
+        resetHeadlessBattle(env->battles[i], env->rngs[i]);
+    }
+    return env;
+}
+
+void pokemon_env_destroy(PokemonEnv* env) {
+    delete env;
+}
+
+int32_t pokemon_env_count(const PokemonEnv* env) {
+    return env == nullptr ? 0 : (int32_t)env->battles.size();
+}
+
+// Call before stepping; every environment reads the same table
+int pokemon_env_load_enemy_policy(const char* path) {
+    return path != nullptr && loadEnemyPolicy(path) ? 1 : 0;
+}
+
+void pokemon_env_reset(PokemonEnv* env, const uint64_t* seeds, float* observations) {
+    if (env == nullptr) return;
+    for (size_t i = 0; i < env->battles.size(); i++) {
+        env->rngs[i].seed(seeds[i]);
+        resetHeadlessBattle(env->battles[i], env->rngs[i]);
+        writeEnvObservation(env->battles[i], observations + i * POKEMON_ENV_OBSERVATION_SIZE);
+    }
+}
+
+void pokemon_env_step(PokemonEnv* env, const int32_t* actions, float* observations,
+                      float* rewards, uint8_t* dones) {
+    if (env == nullptr) return;
+    for (size_t i = 0; i < env->battles.size(); i++) {
+        HeadlessBattle& battle = env->battles[i];
+        FastRng& rng = env->rngs[i];
+        int action = actions[i];
+        if (action < HEADLESS_MOVES || !switchHeadlessBattle(battle, action - HEADLESS_MOVES)) {
+            stepHeadlessBattle(battle, (action >= 0 && action < HEADLESS_MOVES) ? action : 0, rng);
+        }
+        if (battle.winner < 0) {
+            stepHeadlessBattle(battle, policyMove(enemy_policy, battle, rng), rng);
+        }
+
+        rewards[i] = battle.winner < 0 ? 0.0f : (battle.winner == SIDE_PLAYER ? 1.0f : -1.0f);
+        dones[i] = battle.winner < 0 ? 0 : 1;
+        if (dones[i]) resetHeadlessBattle(battle, rng);
+        writeEnvObservation(battle, observations + i * POKEMON_ENV_OBSERVATION_SIZE);
+    }
+}
+
+}
+
+#endif
+
 // ============================================================================
 // GAME STATE - Track current game status
 // ============================================================================
@@ -1148,19 +5343,39 @@ string password_input = "";
 int active_input_field = 0; // 0 = username, 1 = password
 string login_error_message = "";
 bool is_register_mode = false;
+int leaderboard_first_rank = 0; // Top row of the leaderboard screen
+
+// Password hashing in flight for the login screen
+enum class LoginRequest { NONE, LOGIN, REGISTER };
+const unsigned int PASSWORD_WORKER_COUNT = 2;
+LoginRequest pending_login = LoginRequest::NONE;
+string pending_username;
+future<PasswordCheck> pending_check; // LOGIN
+future<string> pending_record;       // REGISTER
+
+// Everything the current battle allocates (teams, fighters, move lists) comes
+// from this arena: allocation is a pointer bump, frees are no-ops, and the
+// whole battle is reclaimed at once when the next one starts. Oversized
+// battles spill to the heap rather than fail.
+const size_t BATTLE_ARENA_BYTES = 16 * 1024;
+alignas(max_align_t) unsigned char battle_arena_buffer[BATTLE_ARENA_BYTES];
+pmr::monotonic_buffer_resource battle_arena(battle_arena_buffer, sizeof(battle_arena_buffer));
 
 // Battle variables
-vector<Fighter> player_team;
-vector<Fighter> enemy_team;
+Team player_team(&battle_arena);
+Team enemy_team(&battle_arena);
 int player_active_index = 0;
 int enemy_active_index = 0;
 
-GameState state = GameState::LOGIN;
+// Shared by both threads: the simulation thread owns the battle variables
+// while state is BATTLE, the main thread owns them otherwise.
+atomic<GameState> state{GameState::LOGIN};
 bool player_turn = true;
 int turn_number = 1;
-string battle_log = "Battle Start! Choose your move!";
+BattleEventLog battle_events;
 
 int player_x = PLAYER_X;
+int previous_player_x = PLAYER_X; // Position at the previous tick, for interpolation
 int enemy_x = ENEMY_X;
 bool animating = false;
 int animation_frame = 0;
@@ -1168,12 +5383,56 @@ int animation_frame = 0;
 unsigned int ai_action_time = 0;
 bool ai_waiting = false;
 
+// Fixed-timestep clock (simulation thread)
+unsigned int last_clock_ticks = 0;
+double sim_accumulator_ms = 0.0;
+
+// Everything the renderer needs from a battle, copied out once per tick so
+// drawing never reads state the simulation thread is changing.
+struct BattleSnapshot {
+    GameState state;
+    Team player_team;
+    Team enemy_team;
+    int player_active_index;
+    int enemy_active_index;
+    bool player_turn;
+    bool ai_waiting;
+    int turn_number;
+    BattleEvent log_events[MAX_ACTION_EVENTS]; // Latest action, formatted when drawn
+    int log_event_count;
+    uint32_t log_sequence; // Changes whenever a new action is logged
+    int player_x;
+    int previous_player_x;
+    int enemy_x;
+    unsigned int tick_time; // current_ticks() when published
+
+    const Fighter& playerActive() const { return player_team[player_active_index]; }
+    const Fighter& enemyActive() const { return enemy_team[enemy_active_index]; }
+};
+
+enum class BattleCommandType { USE_MOVE, SWITCH };
+
+// A player choice, sent from the input (main) thread to the simulation thread
+struct BattleCommand {
+    BattleCommandType type;
+    int index;
+};
+
+const size_t BATTLE_COMMAND_CAPACITY = 16;
+
+TripleBuffer<BattleSnapshot> battle_snapshots;
+SpscQueue<BattleCommand, BATTLE_COMMAND_CAPACITY> battle_commands;
+const BattleSnapshot* frame_snapshot = nullptr; // Snapshot being drawn this frame
+mutex battle_mutex;       // Held while a tick runs or a new battle is set up
+atomic<bool> simulation_running{false};
+thread simulation_thread;
+
 // Helper accessors
-Fighter& playerActive() {
+const Fighter& playerActive() {
     return player_team[player_active_index];
 }
 
-Fighter& enemyActive() {
+const Fighter& enemyActive() {
     return enemy_team[enemy_active_index];
 }
 
@@ -1185,27 +5444,29 @@ const Fighter& enemyActiveConst() {
     return enemy_team[enemy_active_index];
 }
 
-bool teamHasLiving(const vector<Fighter>& team) {
-    for (const Fighter& fighter : team) {
-        if (fighter.isAlive()) {
-            return true;
-        }
-    }
-    return false;
+bool teamHasLiving(const Team& team) {
+    return team.hasLiving();
 }
 
-int findReplacementIndex(const vector<Fighter>& team, int skip_index) {
-    for (size_t i = 0; i < team.size(); i++) {
-        if ((int)i == skip_index) continue;
-        if (team[i].isAlive()) {
-            return static_cast<int>(i);
-        }
-    }
-    return -1;
+int findReplacementIndex(const Team& team, int skip_index) {
+    return team.nextAlive(skip_index);
+}
+
+// Move the player sprite without interpolating from its old position
+void placePlayer(int x) {
+    player_x = x;
+    previous_player_x = x;
+}
+
+// Player sprite position for this render frame, blended between the last two
+// simulation ticks by how long ago the snapshot was taken.
+int interpolatedPlayerX(const BattleSnapshot& snapshot) {
+    double alpha = min(1.0, (current_ticks() - snapshot.tick_time) / SIM_TICK_MS);
+    return snapshot.previous_player_x + (int)((snapshot.player_x - snapshot.previous_player_x) * alpha);
 }
 
 bool forceSwitchToNext(bool is_player) {
-    vector<Fighter>& team = is_player ? player_team : enemy_team;
+    Team& team = is_player ? player_team : enemy_team;
     int& active_index = is_player ? player_active_index : enemy_active_index;
     int replacement = findReplacementIndex(team, active_index);
     if (replacement == -1) {
@@ -1213,7 +5474,7 @@ bool forceSwitchToNext(bool is_player) {
     }
     active_index = replacement;
     if (is_player) {
-        player_x = PLAYER_X;
+        placePlayer(PLAYER_X);
     } else {
         enemy_x = ENEMY_X;
     }
@@ -1228,20 +5489,20 @@ bool canPlayerSwitchTo(int target_index) {
 
 void performPlayerSwitch(int target_index) {
     if (!canPlayerSwitchTo(target_index)) return;
-    string previous = playerActive().getName();
+    battle_events.beginAction();
+    battle_events.record(EVENT_SWITCHED, 0, target_index, player_active_index);
     player_active_index = target_index;
-    player_x = PLAYER_X;
-    battle_log = "You switched from " + previous + " to " + playerActive().getName() + "!";
+    placePlayer(PLAYER_X);
     player_turn = false;
     animating = false;
     animation_frame = 0;
     ai_action_time = current_ticks() + AI_DELAY_MS;
     ai_waiting = true;
+    startEnemyThinking(player_team, player_active_index, enemy_team, enemy_active_index);
 }
 
 void endBattle(bool playerWon) {
     if (state == GameState::VICTORY || state == GameState::DEFEAT) return;
-    state = playerWon ? GameState::VICTORY : GameState::DEFEAT;
     if (current_user != nullptr) {
         if (playerWon) {
             current_user->recordWin();
@@ -1250,58 +5511,80 @@ void endBattle(bool playerWon) {
         }
         updateUserStats(all_users, current_user);
     }
+    if (battle_telemetry.isRunning()) {
+        battle_telemetry.submit(buildBattleRecord(battle_events, player_team, enemy_team,
+                                                  playerWon, turn_number));
+    }
     ai_waiting = false;
+    enemy_search.cancel();
+    reportBattleAllocations();
+    // Changed last: this hands the user data back to the main thread
+    state = playerWon ? GameState::VICTORY : GameState::DEFEAT;
 }
 
 // ============================================================================
 // GAME FUNCTIONS
 // ============================================================================
 
-void initializeFighters() {
-    player_team = createRandomTeam(true);
-    enemy_team = createRandomTeam(false);
+// Replace both teams with fresh ones built in the battle arena
+void createBattleTeams() {
+    // The old teams point into the arena, so drop them before rewinding it
+    player_team = Team(&battle_arena);
+    enemy_team = Team(&battle_arena);
+    battle_arena.release();
+
+    // Same memory resource, so these assignments just take over the storage
+    // The enemy picks its order from the lineup equilibrium once it is known
+    player_team = createRandomTeam(true, &battle_arena);
+    vector<string> enemy_lineup = sampleEnemyLineup();
+    enemy_team = enemy_lineup.empty()
+        ? createRandomTeam(false, &battle_arena)
+        : createTeamInOrder(enemy_lineup, false, &battle_arena);
     player_active_index = 0;
     enemy_active_index = 0;
+}
+
+void initializeFighters() {
+    createBattleTeams();
     playRandomMusic();
     loadRandomBackground();
 }
 
+uint8_t damageEventFlags(const DamageResult& result, uint8_t side) {
+    uint8_t flags = side;
+    if (result.critical) flags |= EVENT_CRITICAL;
+    if (result.typeMultiplier > 1.0) flags |= EVENT_SUPER_EFFECTIVE;
+    else if (result.typeMultiplier < 1.0) flags |= EVENT_NOT_VERY_EFFECTIVE;
+    return flags;
+}
+
 void executePlayerMove(int move_index) {
-    const vector<Move>& moves = playerActive().getMoves();
+    const MoveList& moves = playerActive().getMoves();
     // Bounds checking
     if (move_index < 0 || move_index >= (int)moves.size()) {
         return;
     }
-    Move chosen_move = moves[move_index];
+    const Move& chosen_move = moves[move_index];
 
-    string attacker_name = playerActive().getName();
-    string defender_name = enemyActive().getName();
     DamageResult result = calculateDamage(playerActive(), enemyActive(), chosen_move);
+    battle_events.beginAction();
 
     if (result.missed) {
         // Attack missed
-        battle_log = attacker_name + " used " + chosen_move.getName() + " but it missed!";
+        battle_events.record(EVENT_MOVE_MISSED, 0, player_active_index, move_index);
     } 
     else {
-        enemyActive().takeDamage(result.damage);  // Apply damage
-        // Optimize string concatenation
-        battle_log = attacker_name + " used " + chosen_move.getName() + "! " +
-                     to_string(result.damage) + " damage!";
-
-        // Add battle feedback
-        if (result.critical) battle_log += " A critical hit!";
-        if (result.typeMultiplier > 1.0)
-            battle_log += " It's super effective!";
-        else if (result.typeMultiplier < 1.0)
-            battle_log += " It's not very effective...";
+        enemy_team.takeDamage(enemy_active_index, result.damage);  // Apply damage
+        battle_events.record(EVENT_MOVE_HIT, damageEventFlags(result, 0),
+                             player_active_index, move_index, result.damage);
 
         if (!enemyActive().isAlive()) {
-            battle_log += " " + defender_name + " fainted!";
+            battle_events.record(EVENT_FAINTED, EVENT_ENEMY, enemy_active_index);
             if (!forceSwitchToNext(false)) {
                 endBattle(true);
                 return;
             } else {
-                battle_log += " Enemy sent out " + enemyActive().getName() + "!";
+                battle_events.record(EVENT_SENT_OUT, EVENT_ENEMY, enemy_active_index);
             }
         }
     }
@@ -1312,49 +5595,45 @@ void executePlayerMove(int move_index) {
     animation_frame = 0;
     ai_action_time = current_ticks() + AI_DELAY_MS;
     ai_waiting = true;
+    startEnemyThinking(player_team, player_active_index, enemy_team, enemy_active_index);
 }
 
 void executeEnemyMove() {
     ai_waiting = false;
 
-    vector<Move> enemy_moves = enemyActive().getMoves();
-    int random_move_index = rand() % enemy_moves.size();
-    Move ai_move = enemy_moves[random_move_index];
+    const MoveList& enemy_moves = enemyActive().getMoves();
+    int ai_move_index = chooseEnemyMove(enemy_team, enemy_active_index, player_team, player_active_index);
+    const Move& ai_move = enemy_moves[ai_move_index];
 
-    string attacker_name = enemyActive().getName();
-    string defender_name = playerActive().getName();
     DamageResult result = calculateDamage(enemyActive(), playerActive(), ai_move);
+    battle_events.beginAction();
 
     if (result.missed) {
-        battle_log = attacker_name + " used " + ai_move.getName() + " but it missed!";
+        battle_events.record(EVENT_MOVE_MISSED, EVENT_ENEMY, enemy_active_index, ai_move_index);
     } 
     else {
-        playerActive().takeDamage(result.damage);
-        battle_log = attacker_name + " used " + ai_move.getName() + "! " +
-                     to_string(result.damage) + " damage!";
-
-        if (result.critical) battle_log += " A critical hit!";
-        if (result.typeMultiplier > 1.0)
-            battle_log += " It's super effective!";
-        else if (result.typeMultiplier < 1.0)
-            battle_log += " It's not very effective...";
+        player_team.takeDamage(player_active_index, result.damage);
+        battle_events.record(EVENT_MOVE_HIT, damageEventFlags(result, EVENT_ENEMY),
+                             enemy_active_index, ai_move_index, result.damage);
 
         if (!playerActive().isAlive()) {
-            battle_log += " " + defender_name + " fainted!";
+            battle_events.record(EVENT_FAINTED, 0, player_active_index);
             if (!forceSwitchToNext(true)) {
                 endBattle(false);
                 return;
             } else {
-                battle_log += " You sent out " + playerActive().getName() + "!";
+                battle_events.record(EVENT_SENT_OUT, 0, player_active_index);
             }
         }
     }
 
     player_turn = true;
     turn_number++;
+    startEnemyPondering(player_team, player_active_index, enemy_team, enemy_active_index);
 }
 
 void handleAnimation() {
+    previous_player_x = player_x;
     if (animating) {
         animation_frame++;
         
@@ -1377,41 +5656,13 @@ void handlePlayerTurn() {
         }
         return;
     }
-    vector<Move> moves = playerActive().getMoves();
-    
-    for (size_t i = 0; i < moves.size(); i++) {
-        int button_x = MOVE_BUTTON_START_X + (i * MOVE_BUTTON_SPACING);
-        int button_y = MOVE_BUTTON_Y;
-        int button_width = MOVE_BUTTON_WIDTH;
-        int button_height = MOVE_BUTTON_HEIGHT;
-        
-        // Check if button clicked
-        bool is_hovered = (mouse_x() >= button_x && 
-                          mouse_x() <= button_x + button_width &&
-                          mouse_y() >= button_y && 
-                          mouse_y() <= button_y + button_height);
-        
-        if (is_hovered && mouse_clicked(LEFT_BUTTON)) {
-            executePlayerMove(i);
-            break;
-        }
-    }
-
-    // Switch buttons
-    for (size_t i = 0; i < player_team.size(); i++) {
-        int button_x = MOVE_BUTTON_START_X + (i * MOVE_BUTTON_SPACING);
-        int button_y = SWITCH_BUTTON_Y;
-        int button_width = MOVE_BUTTON_WIDTH;
-        int button_height = SWITCH_BUTTON_HEIGHT;
 
-        bool is_hovered = (mouse_x() >= button_x &&
-                           mouse_x() <= button_x + button_width &&
-                           mouse_y() >= button_y &&
-                           mouse_y() <= button_y + button_height);
-
-        if (is_hovered && mouse_clicked(LEFT_BUTTON) && canPlayerSwitchTo(static_cast<int>(i))) {
-            performPlayerSwitch(static_cast<int>(i));
-            break;
+    BattleCommand command;
+    if (battle_commands.pop(command)) {
+        if (command.type == BattleCommandType::USE_MOVE) {
+            executePlayerMove(command.index);
+        } else {
+            performPlayerSwitch(command.index);
         }
     }
 }
@@ -1429,6 +5680,42 @@ void handleEnemyTurn() {
     }
 }
 
+void checkBattleEnd();
+
+// One fixed simulation tick. Headless callers can run this in a loop directly
+// without the clock for an unthrottled simulation.
+void stepSimulation() {
+    if (state != GameState::BATTLE) return;
+
+    handleAnimation();
+    if (player_turn && !ai_waiting) {
+        handlePlayerTurn();
+    } else {
+        battle_commands.clear(); // Clicks made while the enemy acts are dropped
+        if (!player_turn) {
+            handleEnemyTurn();
+        }
+    }
+    checkBattleEnd();
+}
+
+// Run as many fixed ticks as real time has accumulated since the last frame
+void advanceSimulationClock() {
+    unsigned int now = current_ticks();
+    sim_accumulator_ms += now - last_clock_ticks;
+    last_clock_ticks = now;
+
+    int ticks = 0;
+    while (sim_accumulator_ms >= SIM_TICK_MS && ticks < MAX_SIM_TICKS_PER_FRAME) {
+        stepSimulation();
+        sim_accumulator_ms -= SIM_TICK_MS;
+        ticks++;
+    }
+    if (ticks == MAX_SIM_TICKS_PER_FRAME) {
+        sim_accumulator_ms = 0.0;
+    }
+}
+
 void checkBattleEnd() {
     if (state != GameState::BATTLE) return;
     if (!teamHasLiving(player_team)) {
@@ -1438,112 +5725,271 @@ void checkBattleEnd() {
     }
 }
 
+void publishBattleSnapshot() {
+    BattleSnapshot& snapshot = battle_snapshots.writeBuffer();
+    snapshot.state = state;
+    snapshot.player_team = player_team; // Reuses the slot's storage after the first copy
+    snapshot.enemy_team = enemy_team;
+    snapshot.player_active_index = player_active_index;
+    snapshot.enemy_active_index = enemy_active_index;
+    snapshot.player_turn = player_turn;
+    snapshot.ai_waiting = ai_waiting;
+    snapshot.turn_number = turn_number;
+    snapshot.log_event_count = battle_events.copyLatestAction(snapshot.log_events, MAX_ACTION_EVENTS);
+    snapshot.log_sequence = battle_events.action_start;
+    snapshot.player_x = player_x;
+    snapshot.previous_player_x = previous_player_x;
+    snapshot.enemy_x = enemy_x;
+    snapshot.tick_time = current_ticks();
+    battle_snapshots.publish();
+}
+
 void resetBattle() {
+    // Wait for any in-flight tick from the previous battle to finish
+    lock_guard<mutex> lock(battle_mutex);
+    AllocationScope allocation_scope(ALLOC_BATTLE);
+    beginBattleAllocations();
+
     // Reset fighters
     initializeFighters();
 
-    // Reset battle state
-    state = GameState::BATTLE;
-    turn_number = 1;
-    player_turn = true;
-    battle_log = "Battle Start! Use your moves or switch between your 3 Pokemon!";
-    player_x = PLAYER_X;
-    enemy_x = ENEMY_X;
-    ai_waiting = false;
-    animating = false;
-    animation_frame = 0;
+    // Reset battle state
+    turn_number = 1;
+    player_turn = true;
+    battle_events.clear();
+    battle_events.record(EVENT_BATTLE_START, 0, 0);
+    placePlayer(PLAYER_X);
+    enemy_x = ENEMY_X;
+    ai_waiting = false;
+    animating = false;
+    animation_frame = 0;
+    battle_commands.clear();
+    startEnemyPondering(player_team, player_active_index, enemy_team, enemy_active_index);
+
+    // Publish the opening frame, then hand the battle to the simulation thread
+    state = GameState::BATTLE;
+    publishBattleSnapshot();
+    frame_snapshot = &battle_snapshots.read(); // Draw the new battle this frame
+}
+
+// ============================================================================
+// SIMULATION THREAD - Battle logic runs here, independent of drawing
+// ============================================================================
+
+// Ticks the battle at SIM_TICK_RATE and publishes a snapshot after each pass,
+// so a slow frame on the render thread never delays input or the AI timer.
+void simulationThreadMain() {
+    AllocationScope allocation_scope(ALLOC_BATTLE);
+    const chrono::microseconds tick_length((long long)(SIM_TICK_MS * 1000));
+    chrono::steady_clock::time_point next_tick = chrono::steady_clock::now();
+
+    while (simulation_running) {
+        {
+            lock_guard<mutex> lock(battle_mutex);
+            if (state == GameState::BATTLE) {
+                advanceSimulationClock();
+                publishBattleSnapshot();
+            } else {
+                // Idle: keep the clock current so the next battle starts cleanly
+                last_clock_ticks = current_ticks();
+                sim_accumulator_ms = 0.0;
+            }
+        }
+
+        next_tick += tick_length;
+        chrono::steady_clock::time_point now = chrono::steady_clock::now();
+        if (next_tick < now) {
+            next_tick = now; // Fell behind - don't try to catch up with sleeps
+        }
+        this_thread::sleep_until(next_tick);
+    }
+}
+
+void startSimulationThread() {
+    simulation_running = true;
+    simulation_thread = thread(simulationThreadMain);
+}
+
+void stopSimulationThread() {
+    simulation_running = false;
+    if (simulation_thread.joinable()) {
+        simulation_thread.join();
+    }
+}
+
+// ============================================================================
+// TEXT INPUT - Typed characters arrive through SplashKit's text entry events
+// ============================================================================
+
+// A string currently receiving keyboard text. Only one box reads at a time;
+// SplashKit handles shift, key repeat and backspace for us.
+struct TextInputBox {
+    string* target;
+    size_t max_length;
+    rectangle area;
+};
+
+TextInputBox active_text_box = {nullptr, 0, rectangle_from(0, 0, 0, 0)};
+
+void beginTextInput(string& target, rectangle area, size_t max_length) {
+    if (reading_text()) {
+        end_reading_text();
+    }
+    active_text_box = {&target, max_length, area};
+    start_reading_text(area, target);
+}
+
+void endTextInput() {
+    if (reading_text()) {
+        end_reading_text();
+    }
+    active_text_box.target = nullptr;
+}
+
+bool isTextInputActive(const string& target) {
+    return active_text_box.target == &target;
+}
+
+// Copy whatever was typed this frame into the bound string. Cost depends on
+// the keystrokes received, not on how many keys exist.
+void pollTextInput() {
+    TextInputBox& box = active_text_box;
+    if (box.target == nullptr) return;
+
+    if (!text_entry_cancelled()) {
+        string typed = text_input();
+        if (typed.length() > box.max_length) {
+            typed.resize(box.max_length);
+            end_reading_text(); // Restart so SplashKit's buffer matches the limit
+        }
+        *box.target = typed;
+    }
+
+    // SplashKit stops reading on Enter/Escape - keep the field live
+    if (!reading_text()) {
+        start_reading_text(box.area, *box.target);
+    }
+}
+
+const size_t LOGIN_FIELD_MAX_LENGTH = 20;
+
+void focusLoginField(int field) {
+    active_input_field = field;
+    string& target = (field == 0) ? username_input : password_input;
+    int field_y = (field == 0) ? LOGIN_USERNAME_FIELD_Y : LOGIN_PASSWORD_FIELD_Y;
+    beginTextInput(target, rectangle_from(LOGIN_FIELD_X, field_y, INPUT_FIELD_WIDTH, INPUT_FIELD_HEIGHT),
+                   LOGIN_FIELD_MAX_LENGTH);
+}
+
+void leaveLoginScreen() {
+    endTextInput();
+    username_input = "";
+    password_input = "";
+    login_error_message = "";
+    state = GameState::MAIN_MENU;
+}
+
+// Hash on a worker; finishPendingLogin picks up the result
+void startLogin() {
+    const User* user = findUser(all_users, username_input);
+    bool known = user != nullptr;
+    string record = known ? user->getPassword() : "";
+    string password = password_input;
+    pending_username = username_input;
+    pending_check = password_workers.submit<PasswordCheck>([known, record, password] {
+        PasswordCheck check = verifyPassword(password, known ? record : decoyPasswordRecord());
+        if (!known) check = PasswordCheck();
+        return check;
+    });
+    pending_login = LoginRequest::LOGIN;
+    login_error_message = "Checking password...";
+}
+
+void startRegistration() {
+    string password = password_input;
+    pending_username = username_input;
+    pending_record = password_workers.submit<string>([password] { return hashPassword(password); });
+    pending_login = LoginRequest::REGISTER;
+    login_error_message = "Creating account...";
 }
 
-void handleLoginInput() {
-    // Handle keyboard input for typing
-    // Check for alphanumeric keys and common symbols
-    for (int key = 32; key <= 126; key++) {  // ASCII printable characters
-        key_code kc = static_cast<key_code>(key);
-        if (key_typed(kc)) {
-            char typed_char = static_cast<char>(key);
-
-            if (active_input_field == 0) {
-                if (username_input.length() < 20) {
-                    username_input += typed_char;
-                }
-            } else {
-                if (password_input.length() < 20) {
-                    password_input += typed_char;
-                }
-            }
+// Requests a full redraw (defined with the dirty regions below)
+void markScreenDirty();
+
+// Called every frame on the login screen; acts once the worker is done. The
+// menus only redraw on input, so the result has to ask for a redraw itself.
+void finishPendingLogin() {
+    if (pending_login == LoginRequest::LOGIN) {
+        if (pending_check.wait_for(chrono::seconds(0)) != future_status::ready) return;
+        pending_login = LoginRequest::NONE;
+        markScreenDirty(); // Replaces "Checking password..."
+        PasswordCheck check = pending_check.get();
+        User* user = findUser(all_users, pending_username);
+        if (user == nullptr || !check.matches) {
+            login_error_message = "Invalid username or password!";
+            return;
+        }
+        if (!check.upgraded_record.empty()) {
+            user->setPassword(check.upgraded_record); // Plain text or old cost: store the new hash
+            saveUser(*user, all_users);
+        }
+        current_user = user;
+        leaveLoginScreen();
+    } else if (pending_login == LoginRequest::REGISTER) {
+        if (pending_record.wait_for(chrono::seconds(0)) != future_status::ready) return;
+        pending_login = LoginRequest::NONE;
+        markScreenDirty(); // Replaces "Creating account..."
+        if (registerUser(all_users, pending_username, pending_record.get())) {
+            current_user = findUser(all_users, pending_username);
+            is_register_mode = false;
+            leaveLoginScreen();
+        } else {
+            login_error_message = "Username already exists!";
         }
     }
+}
 
-    // Handle backspace
-    if (key_typed(BACKSPACE_KEY)) {
-        if (active_input_field == 0 && !username_input.empty()) {
-            username_input.pop_back();
-        } else if (active_input_field == 1 && !password_input.empty()) {
-            password_input.pop_back();
-        }
+void handleLoginInput() {
+    finishPendingLogin();
+    if (state != GameState::LOGIN) return;
+
+    // Start reading into the active field when the screen is first shown
+    if (!isTextInputActive(username_input) && !isTextInputActive(password_input)) {
+        focusLoginField(active_input_field);
     }
+    pollTextInput();
 
     // Handle tab to switch fields
     if (key_typed(TAB_KEY)) {
-        active_input_field = (active_input_field + 1) % 2;
+        focusLoginField((active_input_field + 1) % 2);
     }
 
     // Handle mouse clicks on input fields
     if (mouse_clicked(LEFT_BUTTON)) {
-        int username_field_y = LOGIN_BOX_Y + 165;
-        int password_field_y = LOGIN_BOX_Y + 255;
-        int field_x = LOGIN_BOX_X + 50;
-
-        if (mouse_x() >= field_x && mouse_x() <= field_x + INPUT_FIELD_WIDTH) {
-            if (mouse_y() >= username_field_y && mouse_y() <= username_field_y + INPUT_FIELD_HEIGHT) {
-                active_input_field = 0;
-            } else if (mouse_y() >= password_field_y && mouse_y() <= password_field_y + INPUT_FIELD_HEIGHT) {
-                active_input_field = 1;
-            }
+        if (hovered_button == BUTTON_LOGIN_USERNAME) {
+            focusLoginField(0);
+        } else if (hovered_button == BUTTON_LOGIN_PASSWORD) {
+            focusLoginField(1);
         }
 
-        // Handle button clicks
-        int btn1_x = LOGIN_BOX_X + 50;
-        int btn2_x = LOGIN_BOX_X + 200;
-        int btn_y = LOGIN_BOX_Y + 360;
-
         // Button 1 (Login or Register)
-        if (mouse_x() >= btn1_x && mouse_x() <= btn1_x + BUTTON_WIDTH &&
-            mouse_y() >= btn_y && mouse_y() <= btn_y + BUTTON_HEIGHT) {
+        if (hovered_button == BUTTON_LOGIN_PRIMARY && pending_login == LoginRequest::NONE) {
 
             if (is_register_mode) {
-                // Register user
-                if (registerUser(all_users, username_input, password_input)) {
-                    current_user = authenticateUser(all_users, username_input, password_input);
-                    state = GameState::MAIN_MENU;
-                    username_input = "";
-                    password_input = "";
-                    login_error_message = "";
-                    is_register_mode = false;
+                if (username_input.empty() || password_input.empty()) {
+                    login_error_message = "Username and password cannot be empty!";
+                } else if (usernameExists(all_users, username_input)) {
+                    login_error_message = "Username already exists!";
                 } else {
-                    if (username_input.empty() || password_input.empty()) {
-                        login_error_message = "Username and password cannot be empty!";
-                    } else {
-                        login_error_message = "Username already exists!";
-                    }
+                    startRegistration();
                 }
             } else {
-                // Login user
-                current_user = authenticateUser(all_users, username_input, password_input);
-                if (current_user != nullptr) {
-                    state = GameState::MAIN_MENU;
-                    username_input = "";
-                    password_input = "";
-                    login_error_message = "";
-                } else {
-                    login_error_message = "Invalid username or password!";
-                }
+                startLogin();
             }
         }
 
         // Button 2 (Register or Back)
-        if (mouse_x() >= btn2_x && mouse_x() <= btn2_x + BUTTON_WIDTH &&
-            mouse_y() >= btn_y && mouse_y() <= btn_y + BUTTON_HEIGHT) {
+        if (hovered_button == BUTTON_LOGIN_SECONDARY && pending_login == LoginRequest::NONE) {
 
             is_register_mode = !is_register_mode;
             login_error_message = "";
@@ -1551,29 +5997,36 @@ void handleLoginInput() {
     }
 }
 
+int currentUserIndex() {
+    return current_user != nullptr ? (int)(current_user - all_users.data()) : -1;
+}
+
+void scrollLeaderboard(int rows) {
+    int last_page_start = max(0, leaderboard_index.size() - LEADERBOARD_ROWS);
+    leaderboard_first_rank = max(0, min(leaderboard_first_rank + rows, last_page_start));
+}
+
+// Opens on the page around the player's own rank
+void showLeaderboard() {
+    leaderboard_first_rank = leaderboard_index.pageStartAround(currentUserIndex(), LEADERBOARD_ROWS);
+    state = GameState::LEADERBOARD;
+}
+
 void handleMainMenuInput() {
     if (!mouse_clicked(LEFT_BUTTON)) return;
 
-    int btn_x = WINDOW_WIDTH / 2 - MENU_BUTTON_WIDTH / 2;
-    int btn1_y = 250;
-    int btn2_y = btn1_y + MENU_BUTTON_SPACING;
-    int btn3_y = btn2_y + MENU_BUTTON_SPACING;
-
     // Play Battle button
-    if (mouse_x() >= btn_x && mouse_x() <= btn_x + MENU_BUTTON_WIDTH &&
-        mouse_y() >= btn1_y && mouse_y() <= btn1_y + MENU_BUTTON_HEIGHT) {
+    if (hovered_button == BUTTON_MENU_PLAY) {
         resetBattle();
     }
 
     // Leaderboard button
-    if (mouse_x() >= btn_x && mouse_x() <= btn_x + MENU_BUTTON_WIDTH &&
-        mouse_y() >= btn2_y && mouse_y() <= btn2_y + MENU_BUTTON_HEIGHT) {
-        state = GameState::LEADERBOARD;
+    if (hovered_button == BUTTON_MENU_LEADERBOARD) {
+        showLeaderboard();
     }
 
     // Logout button
-    if (mouse_x() >= btn_x && mouse_x() <= btn_x + MENU_BUTTON_WIDTH &&
-        mouse_y() >= btn3_y && mouse_y() <= btn3_y + MENU_BUTTON_HEIGHT) {
+    if (hovered_button == BUTTON_MENU_LOGOUT) {
         current_user = nullptr;
         username_input = "";
         password_input = "";
@@ -1584,19 +6037,71 @@ void handleMainMenuInput() {
 }
 
 void handleLeaderboardInput() {
-    if (!mouse_clicked(LEFT_BUTTON)) return;
+    double wheel = mouse_wheel_scroll().y;
+    if (wheel != 0) scrollLeaderboard(wheel > 0 ? -3 : 3);
+    if (key_typed(UP_KEY)) scrollLeaderboard(-1);
+    if (key_typed(DOWN_KEY)) scrollLeaderboard(1);
+    if (key_typed(PAGE_UP_KEY)) scrollLeaderboard(-LEADERBOARD_ROWS);
+    if (key_typed(PAGE_DOWN_KEY)) scrollLeaderboard(LEADERBOARD_ROWS);
+    if (key_typed(HOME_KEY)) scrollLeaderboard(-leaderboard_index.size());
+    if (key_typed(END_KEY)) scrollLeaderboard(leaderboard_index.size());
+    if (key_typed(M_KEY)) {
+        leaderboard_first_rank = leaderboard_index.pageStartAround(currentUserIndex(), LEADERBOARD_ROWS);
+    }
 
-    int back_btn_x = WINDOW_WIDTH / 2 - 75;
-    int back_btn_y = LEADERBOARD_Y + LEADERBOARD_HEIGHT + 20;
+    if (!mouse_clicked(LEFT_BUTTON)) return;
 
     // Back button
-    if (mouse_x() >= back_btn_x && mouse_x() <= back_btn_x + 150 &&
-        mouse_y() >= back_btn_y && mouse_y() <= back_btn_y + 45) {
+    if (hovered_button == BUTTON_LEADERBOARD_BACK) {
         state = GameState::MAIN_MENU;
     }
 }
 
+const HitGrid* hitGridForState(GameState game_state) {
+    switch (game_state) {
+        case GameState::LOGIN: return &login_hit_grid;
+        case GameState::MAIN_MENU: return &menu_hit_grid;
+        case GameState::LEADERBOARD: return &leaderboard_hit_grid;
+        case GameState::BATTLE: return &battle_hit_grid;
+        default: return nullptr;
+    }
+}
+
+// Resolve the button under the mouse once; input and rendering both use it
+void updateHoveredButton() {
+    const HitGrid* grid = hitGridForState(state);
+    hovered_button = (grid != nullptr) ? hitTest(*grid, mouse_x(), mouse_y()) : BUTTON_NONE;
+
+    // Ignore battle buttons that are not currently shown
+    if (state == GameState::BATTLE) {
+        const BattleSnapshot& snapshot = *frame_snapshot;
+        if (!snapshot.player_turn || snapshot.ai_waiting) {
+            hovered_button = BUTTON_NONE;
+        } else if (isMoveButton(hovered_button) &&
+                   hovered_button - BUTTON_MOVE_FIRST >= (int)snapshot.playerActive().getMoves().size()) {
+            hovered_button = BUTTON_NONE;
+        } else if (isSwitchButton(hovered_button) &&
+                   hovered_button - BUTTON_SWITCH_FIRST >= (int)snapshot.player_team.size()) {
+            hovered_button = BUTTON_NONE;
+        }
+    }
+}
+
+// Turn a click on a battle button into a command for the simulation thread
+void handleBattleInput() {
+    if (!mouse_clicked(LEFT_BUTTON)) return;
+
+    if (isMoveButton(hovered_button)) {
+        battle_commands.push({BattleCommandType::USE_MOVE, hovered_button - BUTTON_MOVE_FIRST});
+    } else if (isSwitchButton(hovered_button)) {
+        battle_commands.push({BattleCommandType::SWITCH, hovered_button - BUTTON_SWITCH_FIRST});
+    }
+}
+
 void handleInput() {
+    frame_snapshot = &battle_snapshots.read();
+    updateHoveredButton();
+
     if (state == GameState::LOGIN) {
         handleLoginInput();
     } else if (state == GameState::MAIN_MENU) {
@@ -1604,11 +6109,7 @@ void handleInput() {
     } else if (state == GameState::LEADERBOARD) {
         handleLeaderboardInput();
     } else if (state == GameState::BATTLE) {
-        if (player_turn && !ai_waiting) {
-            handlePlayerTurn();
-        } else if (!player_turn) {
-            handleEnemyTurn();
-        }
+        handleBattleInput();
     } else if (state == GameState::VICTORY || state == GameState::DEFEAT) {
         // Battle ended - go back to main menu
         if (key_typed(SPACE_KEY)) {
@@ -1617,6 +6118,251 @@ void handleInput() {
     }
 }
 
+// ============================================================================
+// RETAINED UI - Only redraw the parts of the screen that changed
+// ============================================================================
+
+// The battle scene is split into regions. Each region knows its bounds and how
+// to draw itself, and is only redrawn (clipped to its bounds) when the state
+// it shows has changed since the last frame.
+enum UiRegion {
+    REGION_PLAYER,
+    REGION_ENEMY,
+    REGION_TURN_INFO,
+    REGION_BATTLE_LOG,
+    REGION_CONTROL_PANEL,
+    NUM_UI_REGIONS
+};
+
+struct UiWidget {
+    rectangle bounds;
+    void (*draw)();
+    bool dirty;
+};
+
+// Snapshot of everything the battle scene shows, used to work out what changed
+struct BattleView {
+    GameState state;
+    int player_active;
+    int enemy_active;
+    vector<int> player_hp;
+    vector<int> enemy_hp;
+    int player_x;
+    int enemy_x;
+    int turn;
+    bool player_turn;
+    bool ai_waiting;
+    UiButton hovered;
+    uint32_t log_sequence;
+};
+
+BattleView last_battle_view;
+GameState last_screen_state = GameState::LOGIN;
+bool screen_dirty = true; // Whole-window redraw (non-battle screens, new battles)
+
+// Region draw functions only read the frame's snapshot, never live battle state
+void drawPlayerSide() {
+    const BattleSnapshot& snapshot = *frame_snapshot;
+    const Fighter& active = snapshot.playerActive();
+    drawFighter(active, interpolatedPlayerX(snapshot), PLAYER_Y);
+    drawCachedText(active.getName() + " (" + active.getType() + ")",
+              COLOR_BLACK, DEFAULT_FONT, 20, PLAYER_HP_BAR_X, PLAYER_HP_BAR_Y - 32);
+    drawHPBar(active, PLAYER_HP_BAR_X, PLAYER_HP_BAR_Y, HP_BAR_WIDTH, HP_BAR_HEIGHT);
+    drawTeamStatus(snapshot.player_team, snapshot.player_active_index, 70, PLAYER_HP_BAR_Y - 80);
+}
+
+void drawEnemySide() {
+    const BattleSnapshot& snapshot = *frame_snapshot;
+    const Fighter& active = snapshot.enemyActive();
+    drawFighter(active, snapshot.enemy_x, ENEMY_Y);
+    drawCachedText(active.getName() + " (" + active.getType() + ")",
+              COLOR_BLACK, DEFAULT_FONT, 20, ENEMY_HP_BAR_X, ENEMY_HP_BAR_Y - 45);
+    drawHPBar(active, ENEMY_HP_BAR_X, ENEMY_HP_BAR_Y, HP_BAR_WIDTH, HP_BAR_HEIGHT);
+    drawTeamStatus(snapshot.enemy_team, snapshot.enemy_active_index, WINDOW_WIDTH - 470, ENEMY_HP_BAR_Y - 90);
+}
+
+void drawTurnInfoRegion() {
+    drawTurnInfo(frame_snapshot->turn_number);
+}
+
+void drawBattleLogRegion() {
+    const BattleSnapshot& snapshot = *frame_snapshot;
+    static char log_text[BATTLE_LOG_TEXT_SIZE]; // Reused for every redraw
+    formatBattleEvents(snapshot.log_events, snapshot.log_event_count,
+                       snapshot.player_team, snapshot.enemy_team, log_text, sizeof(log_text));
+    drawBattleLog(log_text);
+}
+
+void drawControlPanel() {
+    const BattleSnapshot& snapshot = *frame_snapshot;
+
+    // The panel is hidden behind the result overlay once the battle is over
+    if (snapshot.state != GameState::BATTLE) return;
+
+    drawUIPanel();
+
+    if (snapshot.player_turn && !snapshot.ai_waiting) {
+        drawCachedText("Your Turn! Choose a move:", COLOR_YELLOW, DEFAULT_FONT, 22,
+                  MOVE_BUTTON_START_X, UI_PANEL_Y + 20);
+
+        const MoveList& moves = snapshot.playerActive().getMoves();
+        for (size_t i = 0; i < moves.size(); i++) {
+            drawMoveButton(moves[i], moveButtonX(i), MOVE_BUTTON_Y, MOVE_BUTTON_WIDTH, MOVE_BUTTON_HEIGHT,
+                           hovered_button == BUTTON_MOVE_FIRST + static_cast<int>(i));
+        }
+
+        // Draw switch buttons
+        drawCachedText("Switch Pokemon:", COLOR_WHITE, DEFAULT_FONT, 18,
+                  MOVE_BUTTON_START_X, SWITCH_BUTTON_Y - 26);
+        for (size_t i = 0; i < snapshot.player_team.size(); i++) {
+            bool is_active = static_cast<int>(i) == snapshot.player_active_index;
+            bool is_disabled = is_active || !snapshot.player_team[i].isAlive();
+            bool is_hovered = hovered_button == BUTTON_SWITCH_FIRST + static_cast<int>(i);
+            drawSwitchButton(snapshot.player_team[i], moveButtonX(i), SWITCH_BUTTON_Y,
+                             MOVE_BUTTON_WIDTH, SWITCH_BUTTON_HEIGHT,
+                             is_active, is_disabled, is_hovered);
+        }
+    } else if (!snapshot.player_turn) {
+        drawCachedText("Enemy's Turn...", COLOR_ORANGE, DEFAULT_FONT, 22,
+                  MOVE_BUTTON_START_X, UI_PANEL_Y + 30);
+        drawCachedText("Wait for enemy to attack", COLOR_WHITE, DEFAULT_FONT, 18,
+                  MOVE_BUTTON_START_X, UI_PANEL_Y + 60);
+    }
+}
+
+// Listed in draw order. Bounds cover everything a region can draw, including
+// the attack animation and the circle fallback when sprites are missing.
+UiWidget battle_widgets[NUM_UI_REGIONS] = {
+    { rectangle_from(60, 380, 460, 180), drawPlayerSide, true },
+    { rectangle_from(680, 60, 470, 300), drawEnemySide, true },
+    { rectangle_from((WINDOW_WIDTH - 260) / 2, 20, 260, 44), drawTurnInfoRegion, true },
+    { rectangle_from(30, UI_PANEL_Y - 90, WINDOW_WIDTH - 60, 80), drawBattleLogRegion, true },
+    { rectangle_from(0, SWITCH_BUTTON_Y - 30, WINDOW_WIDTH, WINDOW_HEIGHT - (SWITCH_BUTTON_Y - 30)),
+      drawControlPanel, true }
+};
+
+void markRegionDirty(UiRegion region) {
+    battle_widgets[region].dirty = true;
+}
+
+void markScreenDirty() {
+    screen_dirty = true;
+}
+
+bool rectanglesOverlap(const rectangle& a, const rectangle& b) {
+    return a.x < b.x + b.width && b.x < a.x + a.width &&
+           a.y < b.y + b.height && b.y < a.y + a.height;
+}
+
+bool teamHPChanged(const Team& team, vector<int>& last_hp) {
+    bool changed = last_hp.size() != team.size();
+    last_hp.resize(team.size());
+    for (size_t i = 0; i < team.size(); i++) {
+        if (last_hp[i] != team[i].getHP()) {
+            last_hp[i] = team[i].getHP();
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+// Compare the battle state with what was last drawn and flag the regions
+// showing anything that changed.
+void updateBattleDirtyRegions(const BattleSnapshot& snapshot) {
+    BattleView& view = last_battle_view;
+
+    if (view.state != snapshot.state) {
+        view.state = snapshot.state;
+        markScreenDirty(); // Result overlay appeared
+    }
+    int player_x_now = interpolatedPlayerX(snapshot);
+    if (teamHPChanged(snapshot.player_team, view.player_hp) ||
+        view.player_active != snapshot.player_active_index || view.player_x != player_x_now) {
+        view.player_active = snapshot.player_active_index;
+        view.player_x = player_x_now;
+        markRegionDirty(REGION_PLAYER);
+        markRegionDirty(REGION_CONTROL_PANEL); // Switch buttons and moves follow the player
+    }
+    if (teamHPChanged(snapshot.enemy_team, view.enemy_hp) ||
+        view.enemy_active != snapshot.enemy_active_index || view.enemy_x != snapshot.enemy_x) {
+        view.enemy_active = snapshot.enemy_active_index;
+        view.enemy_x = snapshot.enemy_x;
+        markRegionDirty(REGION_ENEMY);
+    }
+    if (view.turn != snapshot.turn_number) {
+        view.turn = snapshot.turn_number;
+        markRegionDirty(REGION_TURN_INFO);
+    }
+    if (view.log_sequence != snapshot.log_sequence) {
+        view.log_sequence = snapshot.log_sequence;
+        markRegionDirty(REGION_BATTLE_LOG);
+    }
+    if (view.player_turn != snapshot.player_turn || view.ai_waiting != snapshot.ai_waiting ||
+        view.hovered != hovered_button) {
+        view.player_turn = snapshot.player_turn;
+        view.ai_waiting = snapshot.ai_waiting;
+        view.hovered = hovered_button;
+        markRegionDirty(REGION_CONTROL_PANEL);
+    }
+}
+
+// Returns true when something on screen needs to be drawn this frame
+bool updateDirtyRegions() {
+    if (last_screen_state != state) {
+        last_screen_state = state;
+        markScreenDirty();
+    }
+
+    if (state == GameState::BATTLE || state == GameState::VICTORY || state == GameState::DEFEAT) {
+        updateBattleDirtyRegions(*frame_snapshot);
+    } else {
+        if (last_battle_view.hovered != hovered_button) {
+            last_battle_view.hovered = hovered_button;
+            markScreenDirty();
+        }
+        // Otherwise menus only change in response to clicks, typing or scrolling
+        if (mouse_clicked(LEFT_BUTTON) || any_key_pressed() || mouse_wheel_scroll().y != 0) {
+            markScreenDirty();
+        }
+    }
+
+    if (screen_dirty) return true;
+    for (const UiWidget& widget : battle_widgets) {
+        if (widget.dirty) return true;
+    }
+    return false;
+}
+
+void drawResultOverlay() {
+    if (frame_snapshot->state == GameState::VICTORY) {
+        drawVictoryScreen();
+    } else if (frame_snapshot->state == GameState::DEFEAT) {
+        drawDefeatScreen();
+    }
+}
+
+void drawBattleScene() {
+    drawBackground();
+    for (const UiWidget& widget : battle_widgets) {
+        widget.draw();
+    }
+    drawResultOverlay();
+}
+
+// Redraw one region: clip to it, then repaint the background and every region
+// overlapping it so layered elements stay in the right order.
+void redrawRegion(const UiWidget& target) {
+    set_clip(target.bounds);
+    drawBackground();
+    for (const UiWidget& widget : battle_widgets) {
+        if (rectanglesOverlap(widget.bounds, target.bounds)) {
+            widget.draw();
+        }
+    }
+    drawResultOverlay();
+    reset_clip();
+}
+
 void render() {
     if (state == GameState::LOGIN) {
         drawLoginScreen(username_input, password_input, active_input_field,
@@ -1626,126 +6372,726 @@ void render() {
             drawMainMenu(current_user->getUsername());
         }
     } else if (state == GameState::LEADERBOARD) {
-        vector<User> leaderboard = getLeaderboard(all_users);
+        static vector<int> page_users; // Reused so paging never allocates
+        leaderboard_index.page(leaderboard_first_rank, LEADERBOARD_ROWS, page_users);
         string current_username = (current_user != nullptr) ? current_user->getUsername() : "";
-        drawLeaderboard(leaderboard, current_username);
+        drawLeaderboard(all_users, page_users, leaderboard_first_rank, leaderboard_index.size(),
+                        current_username, leaderboard_index.rankOf(currentUserIndex()));
     } else if (state == GameState::BATTLE || state == GameState::VICTORY || state == GameState::DEFEAT) {
-        // Draw background
-        drawBackground();
-
-        // Draw fighters
-        drawFighter(playerActiveConst(), player_x, PLAYER_Y);
-        draw_text(playerActiveConst().getName() + " (" + playerActiveConst().getType() + ")",
-                  COLOR_BLACK, DEFAULT_FONT, 20, PLAYER_HP_BAR_X, PLAYER_HP_BAR_Y - 32);
-        drawHPBar(playerActiveConst(), PLAYER_HP_BAR_X, PLAYER_HP_BAR_Y, HP_BAR_WIDTH, HP_BAR_HEIGHT);
-
-        drawFighter(enemyActiveConst(), enemy_x, ENEMY_Y);
-        draw_text(enemyActiveConst().getName() + " (" + enemyActiveConst().getType() + ")",
-                  COLOR_BLACK, DEFAULT_FONT, 20, ENEMY_HP_BAR_X, ENEMY_HP_BAR_Y - 45);
-        drawHPBar(enemyActiveConst(), ENEMY_HP_BAR_X, ENEMY_HP_BAR_Y, HP_BAR_WIDTH, HP_BAR_HEIGHT);
-
-        if (!player_team.empty() && !enemy_team.empty()) {
-            drawTeamStatus(player_team, player_active_index, 70, PLAYER_HP_BAR_Y - 80);
-            drawTeamStatus(enemy_team, enemy_active_index, WINDOW_WIDTH - 470, ENEMY_HP_BAR_Y - 90);
-        }
-
-        // Draw UI
-        drawTurnInfo(turn_number);
-        drawBattleLog(battle_log);
-
-        // Render based on state
-        if (state == GameState::VICTORY) {
-            drawVictoryScreen();
-        } else if (state == GameState::DEFEAT) {
-            drawDefeatScreen();
+        if (screen_dirty) {
+            drawBattleScene();
         } else {
-            // Draw gameplay UI
-            drawUIPanel();
-
-            if (player_turn && !ai_waiting) {
-                draw_text("Your Turn! Choose a move:", COLOR_YELLOW, DEFAULT_FONT, 22,
-                          MOVE_BUTTON_START_X, UI_PANEL_Y + 20);
-
-                vector<Move> moves = playerActive().getMoves();
-                for (size_t i = 0; i < moves.size(); i++) {
-                    int button_x = MOVE_BUTTON_START_X + (i * MOVE_BUTTON_SPACING);
-                    int button_y = MOVE_BUTTON_Y;
-                    int button_width = MOVE_BUTTON_WIDTH;
-                    int button_height = MOVE_BUTTON_HEIGHT;
-
-                    bool is_hovered = (mouse_x() >= button_x &&
-                                      mouse_x() <= button_x + button_width &&
-                                      mouse_y() >= button_y &&
-                                      mouse_y() <= button_y + button_height);
-
-                    drawMoveButton(moves[i], button_x, button_y,
-                                  button_width, button_height, is_hovered);
+            for (const UiWidget& widget : battle_widgets) {
+                if (widget.dirty) {
+                    redrawRegion(widget);
+                }
+            }
+        }
+    }
+
+    screen_dirty = false;
+    for (UiWidget& widget : battle_widgets) {
+        widget.dirty = false;
+    }
+}
+
+// ============================================================================
+// BENCHMARKS - Build with -DRUN_BENCHMARKS to time the battle core
+// ============================================================================
+#ifdef RUN_BENCHMARKS
+
+const double BENCHMARK_MIN_SECONDS = 0.2;
+const string BENCHMARK_USER_FILE = "bench_userdata.txt";
+const vector<string> ALL_TYPES = {"Fire", "Water", "Grass", "Flying", "Poison", "Ground",
+                                  "Ice", "Dragon", "Dark", "Psychic", "Fighting", "Electric"};
+
+volatile long long benchmark_sink = 0; // Stops the optimiser discarding results
+
+// Run fn(iterations) with growing iteration counts until it takes long enough
+// to time, then print ns/op, allocations/op and throughput. items_per_op
+// scales the throughput column for operations that process many items.
+template <typename Fn>
+void runBenchmark(const string& name, Fn fn, long long items_per_op = 1) {
+    long long iterations = 1;
+    double seconds = 0.0;
+    long long allocations = 0;
+    while (true) {
+        long long allocations_before = totalAllocationCount();
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        fn(iterations);
+        seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        allocations = totalAllocationCount() - allocations_before;
+        if (seconds >= BENCHMARK_MIN_SECONDS || iterations >= (1LL << 30)) break;
+        iterations *= 2;
+    }
+
+    char line[200];
+    snprintf(line, sizeof(line), "%-36s %12.1f ns/op %10.2f allocs/op %14.0f items/s",
+             name.c_str(), seconds * 1e9 / iterations, (double)allocations / iterations,
+             iterations * items_per_op / seconds);
+    write_line(line);
+}
+
+vector<User> makeBenchmarkUsers(int count) {
+    vector<User> users;
+    users.reserve(count);
+    mt19937 rng(1045);
+    for (int i = 0; i < count; i++) {
+        int wins = rng() % 200;
+        int losses = rng() % 200;
+        users.push_back(User("user" + to_string(i), "pass" + to_string(i), wins, losses,
+                             rng() % 10, rng() % 20, wins + losses, wins * 110 + losses * 10));
+    }
+    return users;
+}
+
+// Fresh teams for the battle benchmarks, without music or backgrounds
+void setUpBenchmarkBattle() {
+    createBattleTeams();
+    state = GameState::BATTLE;
+}
+
+int runBenchmarks() {
+    write_line("Pokemon Battle Simulator - core benchmarks");
+
+    runBenchmark("getTypeMultiplier (all pairs)", [](long long n) {
+        for (long long i = 0; i < n; i++) {
+            for (const string& attack : ALL_TYPES) {
+                for (const string& defend : ALL_TYPES) {
+                    benchmark_sink += (long long)getTypeMultiplier(attack, defend);
                 }
+            }
+        }
+    }, (long long)(ALL_TYPES.size() * ALL_TYPES.size()));
+
+    Fighter attacker = createRandomTeam(true)[0];
+    Fighter defender = createRandomTeam(false)[0];
+    runBenchmark("calculateDamage", [&](long long n) {
+        for (long long i = 0; i < n; i++) {
+            benchmark_sink += calculateDamage(attacker, defender, attacker.getMoves()[i % 4]).damage;
+        }
+    });
+
+    runBenchmark("createRandomTeam", [](long long n) {
+        for (long long i = 0; i < n; i++) {
+            benchmark_sink += createRandomTeam(i % 2 == 0).size();
+        }
+    });
+
+    runBenchmark("createBattleTeams (arena)", [](long long n) {
+        for (long long i = 0; i < n; i++) {
+            createBattleTeams();
+            benchmark_sink += player_team.size() + enemy_team.size();
+        }
+    }, 2);
+
+    // A full roster with only the last fighter standing, the worst case for a scan
+    Team roster;
+    for (int i = 0; i < MAX_TEAM_SIZE; i++) roster.add(createStarterByName(STARTER_POOL[i % STARTER_POOL.size()]));
+    for (int i = 0; i < MAX_TEAM_SIZE - 1; i++) roster.takeDamage(i, roster[i].getMaxHP());
+    runBenchmark("findReplacementIndex (64 fighters)", [&](long long n) {
+        for (long long i = 0; i < n; i++) {
+            benchmark_sink += findReplacementIndex(roster, (int)(i & 7)) + teamHasLiving(roster);
+        }
+    });
+
+    setUpBenchmarkBattle();
+    runBenchmark("executePlayerMove", [](long long n) {
+        for (long long i = 0; i < n; i++) {
+            if (state != GameState::BATTLE || !teamHasLiving(enemy_team)) {
+                setUpBenchmarkBattle();
+            }
+            player_turn = true;
+            executePlayerMove(i % 4);
+            benchmark_sink += battle_events.total;
+        }
+    });
+
+    User sample("benchmark_user", "secret", 42, 17, 3, 9, 59, 4790);
+    runBenchmark("User::serialize", [&](long long n) {
+        for (long long i = 0; i < n; i++) {
+            benchmark_sink += sample.serialize().size();
+        }
+    });
+
+    string serialized = sample.serialize();
+    runBenchmark("User::deserialize", [&](long long n) {
+        for (long long i = 0; i < n; i++) {
+            benchmark_sink += User::deserialize(serialized).getWins();
+        }
+    });
+
+    // One login costs one hash; ns/op here is the delay a player waits for
+    for (int iterations : {1000, 10000, PASSWORD_HASH_ITERATIONS}) {
+        runBenchmark("hashPassword (" + to_string(iterations) + " iterations)", [iterations](long long n) {
+            for (long long i = 0; i < n; i++) {
+                benchmark_sink += hashPassword("hunter2", iterations).size();
+            }
+        });
+    }
+
+    for (int count : {1000, 100000, 1000000}) {
+        saveAllUsers(makeBenchmarkUsers(count), BENCHMARK_USER_FILE);
+        runBenchmark("loadAllUsers (" + to_string(count) + " users)", [](long long n) {
+            for (long long i = 0; i < n; i++) {
+                benchmark_sink += loadAllUsers(BENCHMARK_USER_FILE).size();
+            }
+        }, count);
+    }
+    remove(BENCHMARK_USER_FILE.c_str());
+
+    for (int count : {1000, 100000}) {
+        vector<User> users = makeBenchmarkUsers(count);
+        string suffix = " (" + to_string(count) + " users)";
+        LeaderboardIndex index;
+        runBenchmark("LeaderboardIndex::rebuild" + suffix, [&](long long n) {
+            for (long long i = 0; i < n; i++) {
+                index.rebuild(users);
+                benchmark_sink += index.size();
+            }
+        }, count);
+
+        // What the leaderboard screen does each frame
+        vector<int> page_users;
+        runBenchmark("leaderboard page + rank" + suffix, [&](long long n) {
+            for (long long i = 0; i < n; i++) {
+                int user = (int)((i * 7919) % count);
+                index.page(index.pageStartAround(user, LEADERBOARD_ROWS), LEADERBOARD_ROWS, page_users);
+                benchmark_sink += page_users.size() + index.rankOf(user);
+            }
+        });
+
+        runBenchmark("LeaderboardIndex::update" + suffix, [&](long long n) {
+            for (long long i = 0; i < n; i++) {
+                int user = (int)((i * 7919) % count);
+                index.update(user, (int)i); // Always a new score, so always a move
+            }
+        });
+    }
+
+    string long_log = "Charizard used Fire Blast! 87 damage! A critical hit! It's super effective! "
+                      "Venusaur fainted! Enemy sent out Blastoise!";
+    runBenchmark("wrapBattleText", [&](long long n) {
+        for (long long i = 0; i < n; i++) {
+            benchmark_sink += wrapBattleText(long_log, 100).size();
+        }
+    });
+
+    setUpBenchmarkBattle();
+    BattleEvent action[MAX_ACTION_EVENTS] = {
+        { EVENT_MOVE_HIT, EVENT_CRITICAL | EVENT_SUPER_EFFECTIVE, 0, 0, 87 },
+        { EVENT_FAINTED, EVENT_ENEMY, 0, 0, 0 },
+        { EVENT_SENT_OUT, EVENT_ENEMY, 1, 0, 0 }
+    };
+    runBenchmark("formatBattleEvents", [&](long long n) {
+        char text[BATTLE_LOG_TEXT_SIZE];
+        for (long long i = 0; i < n; i++) {
+            benchmark_sink += formatBattleEvents(action, 3, player_team, enemy_team, text, sizeof(text));
+        }
+    });
+
+    FastRng headless_rng(1);
+    HeadlessBattle headless_battle;
+    runBenchmark("HeadlessBattle random episode", [&](long long n) {
+        for (long long i = 0; i < n; i++) {
+            resetHeadlessBattle(headless_battle, headless_rng);
+            while (headless_battle.winner < 0) {
+                stepHeadlessBattle(headless_battle, (int)headless_rng.below(HEADLESS_MOVES), headless_rng);
+            }
+            benchmark_sink += headless_battle.turns;
+        }
+    });
+
+    // Consecutive positions from random battles, for the evaluators
+    if (!neural_evaluator.load()) {
+        write_line("(" + EVALUATOR_FILE + " not found: timing the evaluator with zero weights)");
+    }
+    const int position_count = 1024;
+    vector<HeadlessBattle> before_positions(position_count), after_positions(position_count);
+    vector<EvalAccumulator> before_accumulators(position_count);
+    resetHeadlessBattle(headless_battle, headless_rng);
+    for (int i = 0; i < position_count; i++) {
+        if (headless_battle.winner >= 0) resetHeadlessBattle(headless_battle, headless_rng);
+        before_positions[i] = headless_battle;
+        neural_evaluator.refresh(headless_battle, before_accumulators[i]);
+        stepHeadlessBattle(headless_battle, (int)headless_rng.below(HEADLESS_MOVES), headless_rng);
+        after_positions[i] = headless_battle;
+    }
+    runBenchmark("heuristicEvaluate", [&](long long n) {
+        float total = 0.0f;
+        for (long long i = 0; i < n; i++) total += heuristicEvaluate(after_positions[i % position_count]);
+        benchmark_sink += (long long)total;
+    });
+    runBenchmark("NeuralEvaluator refresh + evaluate", [&](long long n) {
+        float total = 0.0f;
+        for (long long i = 0; i < n; i++) total += neural_evaluator.evaluate(after_positions[i % position_count]);
+        benchmark_sink += (long long)total;
+    });
+    runBenchmark("NeuralEvaluator update + evaluate", [&](long long n) {
+        float total = 0.0f;
+        for (long long i = 0; i < n; i++) {
+            int p = (int)(i % position_count);
+            EvalAccumulator accumulator = before_accumulators[p];
+            neural_evaluator.update(before_positions[p], after_positions[p], accumulator);
+            total += neural_evaluator.evaluate(after_positions[p], accumulator);
+        }
+        benchmark_sink += (long long)total;
+    });
+
+    runBenchmark("applyHeadlessAction + undo", [&](long long n) {
+        for (long long i = 0; i < n; i++) {
+            HeadlessBattle& position = before_positions[i % position_count];
+            HeadlessUndo undo = applyHeadlessAction(position, (int)(i % POKEMON_ENV_ACTION_COUNT), 30);
+            benchmark_sink += position.to_move;
+            undoHeadlessAction(position, undo);
+        }
+    });
+    runBenchmark("NeuralEvaluator undo-update + eval", [&](long long n) {
+        float total = 0.0f;
+        for (long long i = 0; i < n; i++) {
+            int p = (int)(i % position_count);
+            HeadlessBattle position = before_positions[p];
+            EvalAccumulator accumulator = before_accumulators[p];
+            HeadlessUndo undo = applyHeadlessAction(position, 0, 30);
+            if (position.winner >= 0) continue;
+            neural_evaluator.update(position, undo, accumulator);
+            total += neural_evaluator.evaluate(position, accumulator);
+        }
+        benchmark_sink += (long long)total;
+    });
+
+    // Items are search nodes; depth 3 is what the enemy finishes in a few ms
+    const int search_depth = 3;
+    HeadlessBattle search_root = before_positions[0];
+    for (const HeadlessBattle& position : before_positions) {
+        if (position.to_move == SIDE_ENEMY) {
+            search_root = position;
+            break;
+        }
+    }
+    ExpectimaxSearch node_counter;
+    node_counter.bestAction(search_root, search_depth);
+    runBenchmark("ExpectimaxSearch (depth 3)", [&](long long n) {
+        for (long long i = 0; i < n; i++) {
+            ExpectimaxSearch search;
+            benchmark_sink += search.bestAction(search_root, search_depth);
+        }
+    }, node_counter.nodeCount());
+    // Same items as above, so items/s shows the nodes the table saves
+    TranspositionTable search_table;
+    search_table.resize(16);
+    runBenchmark("ExpectimaxSearch + table (depth 3)", [&](long long n) {
+        for (long long i = 0; i < n; i++) {
+            search_table.clear();
+            ExpectimaxSearch search(nullptr, &search_table);
+            benchmark_sink += search.bestAction(search_root, search_depth);
+        }
+    }, node_counter.nodeCount());
+
+    // The enemy's reply once the player's turn has been pondered
+    HeadlessBattle ponder_root = search_root;
+    ponder_root.to_move = SIDE_PLAYER;
+    HeadlessBattle reply_root = ponder_root;
+    applyHeadlessDamage(reply_root, 0);
+    search_table.clear();
+    ExpectimaxSearch ponder(nullptr, &search_table);
+    for (int depth = 1; depth <= search_depth + 1; depth++) ponder.bestAction(ponder_root, depth);
+    runBenchmark("Reply after pondering (depth 3)", [&](long long n) {
+        for (long long i = 0; i < n; i++) {
+            ExpectimaxSearch search(nullptr, &search_table);
+            benchmark_sink += search.bestAction(reply_root, search_depth);
+        }
+    });
+
+    // Lazy SMP scaling: time for the first worker to finish depth 4, from a
+    // cold table, on enemy turns of a few seeded battles
+    vector<HeadlessBattle> scaling_positions;
+    FastRng scaling_rng(2024);
+    for (int battle_index = 0; battle_index < 4; battle_index++) {
+        HeadlessBattle battle;
+        resetHeadlessBattle(battle, scaling_rng);
+        for (int step = 0; step < 2 * battle_index + 1 && battle.winner < 0; step++) {
+            stepHeadlessBattle(battle, (int)scaling_rng.below(HEADLESS_MOVES), scaling_rng);
+        }
+        if (battle.winner < 0 && battle.to_move == SIDE_ENEMY) scaling_positions.push_back(battle);
+    }
+    const int scaling_depth = 4;
+    int max_threads = max(1, (int)thread::hardware_concurrency());
+    double single_thread_ms = 0.0;
+    for (int threads = 1;; threads = min(threads * 2, max_threads)) {
+        AnytimeSearch pool;
+        pool.start(threads);
+        double total_ms = 0.0;
+        long long total_nodes = 0;
+        for (const HeadlessBattle& position : scaling_positions) {
+            pool.clearTable();
+            chrono::steady_clock::time_point start = chrono::steady_clock::now();
+            benchmark_sink += pool.searchToDepth(position, scaling_depth);
+            total_ms += chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+            total_nodes += pool.nodeCount();
+        }
+        pool.stop();
+        if (threads == 1) single_thread_ms = total_ms;
+
+        char line[200];
+        snprintf(line, sizeof(line), "Lazy SMP depth %d, %2d thread%s %11.1f ms/position %10.2fx %14.0f nodes/s",
+                 scaling_depth, threads, threads == 1 ? " " : "s", total_ms / scaling_positions.size(),
+                 single_thread_ms / total_ms, total_nodes / (total_ms / 1000.0));
+        write_line(line);
+        if (threads == max_threads) break;
+    }
+
+    const int32_t env_count = 1024;
+    PokemonEnv* env = pokemon_env_create(env_count);
+    vector<uint64_t> env_seeds(env_count);
+    vector<int32_t> env_actions(env_count);
+    vector<float> env_observations((size_t)env_count * POKEMON_ENV_OBSERVATION_SIZE);
+    vector<float> env_rewards(env_count);
+    vector<uint8_t> env_dones(env_count);
+    for (int32_t i = 0; i < env_count; i++) env_seeds[i] = i;
+    pokemon_env_reset(env, env_seeds.data(), env_observations.data());
+    runBenchmark("pokemon_env_step (1024 envs)", [&](long long n) {
+        for (long long i = 0; i < n; i++) {
+            for (int32_t e = 0; e < env_count; e++) env_actions[e] = (int32_t)headless_rng.below(POKEMON_ENV_ACTION_COUNT);
+            pokemon_env_step(env, env_actions.data(), env_observations.data(), env_rewards.data(), env_dones.data());
+            benchmark_sink += env_dones[0];
+        }
+    }, env_count);
+    pokemon_env_destroy(env);
+
+    QTable self_play_table((size_t)POLICY_STATE_COUNT * HEADLESS_MOVES, 0.0f);
+    runBenchmark("trainSelfPlay episode", [&](long long n) {
+        trainSelfPlay(self_play_table, n, 7, TRAINER_LEARNING_RATE, TRAINER_EXPLORATION);
+    });
+
+    Team solver_player = createTeamInOrder({ "Charizard", "Blastoise", "Venusaur" }, true);
+    Team solver_enemy = createTeamInOrder({ "Venusaur", "Charizard", "Blastoise" }, false);
+    unsigned int solver_threads = max(1u, thread::hardware_concurrency());
+    WinProbabilitySolver solver(solver_player, 0, solver_enemy, 0);
+    runBenchmark("WinProbabilitySolver (1 thread)", [&](long long n) {
+        for (long long i = 0; i < n; i++) {
+            solver.solve(1);
+            benchmark_sink += (long long)(solver.playerWinChance() * 1e6);
+        }
+    }, solver.stateCount());
+    runBenchmark("WinProbabilitySolver (all cores)", [&](long long n) {
+        for (long long i = 0; i < n; i++) {
+            solver.solve(solver_threads);
+            benchmark_sink += (long long)(solver.playerWinChance() * 1e6);
+        }
+    }, solver.stateCount());
+
+    return 0;
+}
+
+#endif
+
+// ============================================================================
+// SOLVER REPORT - Build with -DRUN_SOLVER to print exact lineup odds
+// ============================================================================
+#ifdef RUN_SOLVER
+
+// First letter of each fighter, e.g. "CBV" for Charizard, Blastoise, Venusaur
+string orderInitials(const vector<string>& order) {
+    string initials;
+    for (const string& name : order) initials += name[0];
+    return initials;
+}
+
+int runSolver() {
+    unsigned int threads = max(1u, thread::hardware_concurrency());
+    vector<vector<string>> orders = allTeamOrders();
+
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    bool from_cache = false;
+    vector<vector<double>> win_chance = lineupPayoffs(orders, threads, &from_cache);
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    char line[200];
+    if (from_cache) {
+        snprintf(line, sizeof(line), "Player win %% under random play, player moves first (read from %s)",
+                 LINEUP_CACHE_FILE.c_str());
+    } else {
+        snprintf(line, sizeof(line), "Player win %% under random play, player moves first (%zu battles solved in %.2f s on %u threads)",
+                 orders.size() * orders.size(), seconds, threads);
+    }
+    write_line(line);
+
+    string header = "player\\enemy";
+    for (const vector<string>& enemy_order : orders) header += "    " + orderInitials(enemy_order);
+    write_line(header);
+    for (size_t p = 0; p < orders.size(); p++) {
+        string row = orderInitials(orders[p]) + "         ";
+        for (size_t e = 0; e < orders.size(); e++) {
+            snprintf(line, sizeof(line), " %6.2f", win_chance[p][e] * 100.0);
+            row += line;
+        }
+        write_line(row);
+    }
 
-                // Draw switch buttons
-                draw_text("Switch Pokemon:", COLOR_WHITE, DEFAULT_FONT, 18,
-                          MOVE_BUTTON_START_X, SWITCH_BUTTON_Y - 26);
-                for (size_t i = 0; i < player_team.size(); i++) {
-                    int button_x = MOVE_BUTTON_START_X + (i * MOVE_BUTTON_SPACING);
-                    int button_y = SWITCH_BUTTON_Y;
-                    bool is_active = static_cast<int>(i) == player_active_index;
-                    bool is_disabled = is_active || !player_team[i].isAlive();
-                    bool is_hovered = (mouse_x() >= button_x &&
-                                       mouse_x() <= button_x + MOVE_BUTTON_WIDTH &&
-                                       mouse_y() >= button_y &&
-                                       mouse_y() <= button_y + SWITCH_BUTTON_HEIGHT);
-                    drawSwitchButton(player_team[i], button_x, button_y,
-                                     MOVE_BUTTON_WIDTH, SWITCH_BUTTON_HEIGHT,
-                                     is_active, is_disabled, is_hovered);
+    // Lead against lead, averaged over how the rest of both teams are ordered
+    write_line("");
+    write_line("Player win % by lead (rest of both teams in random order)");
+    header = "player\\enemy";
+    for (const string& enemy_lead : STARTER_POOL) {
+        snprintf(line, sizeof(line), " %10s", enemy_lead.c_str());
+        header += line;
+    }
+    write_line(header + "        any");
+    double overall = 0.0;
+    for (const string& player_lead : STARTER_POOL) {
+        snprintf(line, sizeof(line), "%-12s", player_lead.c_str());
+        string row = line;
+        double lead_total = 0.0;
+        int lead_count = 0;
+        for (const string& enemy_lead : STARTER_POOL) {
+            double total = 0.0;
+            int count = 0;
+            for (size_t p = 0; p < orders.size(); p++) {
+                if (orders[p][0] != player_lead) continue;
+                for (size_t e = 0; e < orders.size(); e++) {
+                    if (orders[e][0] != enemy_lead) continue;
+                    total += win_chance[p][e];
+                    count++;
                 }
-            } else if (!player_turn) {
-                draw_text("Enemy's Turn...", COLOR_ORANGE, DEFAULT_FONT, 22,
-                          MOVE_BUTTON_START_X, UI_PANEL_Y + 30);
-                draw_text("Wait for enemy to attack", COLOR_WHITE, DEFAULT_FONT, 18,
-                          MOVE_BUTTON_START_X, UI_PANEL_Y + 60);
             }
+            lead_total += total;
+            lead_count += count;
+            snprintf(line, sizeof(line), " %10.2f", total / count * 100.0);
+            row += line;
+        }
+        snprintf(line, sizeof(line), " %10.2f", lead_total / lead_count * 100.0);
+        write_line(row + line);
+        overall += lead_total / lead_count / STARTER_POOL.size();
+    }
+
+    snprintf(line, sizeof(line), "Random teams on both sides: %.2f%%", overall * 100.0);
+    write_line("");
+    write_line(line);
+
+    // Best mixes of orders when each side expects the other to adapt
+    LineupEquilibrium equilibrium = solveLineupEquilibrium(win_chance, LINEUP_REGRET_ITERATIONS);
+    write_line("");
+    write_line("Lineup equilibrium (chance each order is fielded)");
+    write_line("order       player   enemy");
+    for (size_t i = 0; i < orders.size(); i++) {
+        snprintf(line, sizeof(line), "%-9s %7.2f%% %7.2f%%", orderInitials(orders[i]).c_str(),
+                 equilibrium.player_strategy[i] * 100.0, equilibrium.enemy_strategy[i] * 100.0);
+        write_line(line);
+    }
+    snprintf(line, sizeof(line), "Player win %% at equilibrium: %.2f%% (exploitability %.4f%%)",
+             equilibrium.value * 100.0, equilibrium.exploitability * 100.0);
+    write_line(line);
+    return 0;
+}
+
+#endif
+
+// ============================================================================
+// TRAINER REPORT - Build with -DRUN_TRAINER to train and export the enemy policy
+// ============================================================================
+#ifdef RUN_TRAINER
+
+// Mean absolute error in win chance over samples, in percentage points
+template <typename Evaluate>
+double evaluatorError(const vector<EvalSample>& samples, size_t count, Evaluate evaluate) {
+    double total = 0.0;
+    for (size_t i = 0; i < count; i++) total += fabs(evaluate(samples[i].battle) - samples[i].win_chance);
+    return total / count * 100.0;
+}
+
+int trainNeuralEvaluator() {
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    vector<EvalSample> samples = buildEvaluatorSamples(EVAL_TRAIN_SAMPLES_PER_SIDE, 5);
+    FastRng rng(9);
+    for (size_t i = samples.size() - 1; i > 0; i--) swap(samples[i], samples[rng.below((uint32_t)i + 1)]);
+    size_t validation = samples.size() / 20; // The first 5% are held out
+
+    char line[200];
+    write_line("");
+    snprintf(line, sizeof(line), "Evaluator: %zu exact positions labelled in %.1f s, %zu held out",
+             samples.size(), chrono::duration<double>(chrono::steady_clock::now() - start).count(), validation);
+    write_line(line);
+    snprintf(line, sizeof(line), "Heuristic error on held-out positions: %.2f win-%% points",
+             evaluatorError(samples, validation, heuristicEvaluate));
+    write_line(line);
+    write_line("epoch  train loss  float error  int8 error");
+
+    EvaluatorTrainer trainer(11);
+    for (int epoch = 1; epoch <= EVAL_TRAIN_EPOCHS; epoch++) {
+        for (size_t i = samples.size() - 1; i > validation; i--) {
+            swap(samples[i], samples[validation + rng.below((uint32_t)(i - validation) + 1)]);
+        }
+        double loss = 0.0;
+        int batches = 0;
+        float learning_rate = EVAL_TRAIN_LEARNING_RATE / epoch;
+        for (size_t first = validation; first < samples.size(); first += EVAL_TRAIN_BATCH) {
+            int count = (int)min((size_t)EVAL_TRAIN_BATCH, samples.size() - first);
+            loss += trainer.trainBatch(&samples[first], count, learning_rate);
+            batches++;
+        }
+
+        neural_evaluator.setNetwork(trainer.quantize());
+        snprintf(line, sizeof(line), "%5d %11.4f %12.2f %11.2f", epoch, loss / batches,
+                 evaluatorError(samples, validation, [&](const HeadlessBattle& battle) { return trainer.predict(battle); }),
+                 evaluatorError(samples, validation, [](const HeadlessBattle& battle) { return neural_evaluator.evaluate(battle); }));
+        write_line(line);
+    }
+
+    if (!neural_evaluator.save()) {
+        write_line("Warning: Unable to write " + EVALUATOR_FILE);
+        return 1;
+    }
+    write_line("Evaluator written to " + EVALUATOR_FILE);
+    return 0;
+}
+
+int runTrainer() {
+    if (!headlessRules().valid) {
+        write_line("The trainer needs STARTER_POOL to hold exactly 3 fighters with 4 moves each");
+        return 1;
+    }
+    unsigned int threads = max(1u, thread::hardware_concurrency());
+    QTable shared((size_t)POLICY_STATE_COUNT * HEADLESS_MOVES, 0.0f);
+    vector<QTable> local(threads, shared);
+    vector<uint8_t> policy(POLICY_STATE_COUNT, POLICY_RANDOM_MOVE);
+
+    char line[200];
+    snprintf(line, sizeof(line), "Self-play Q-learning on %u threads, %lld episodes per thread per epoch",
+             threads, TRAINER_EPISODES_PER_EPOCH);
+    write_line(line);
+    snprintf(line, sizeof(line), "Enemy win %% against random moves, both sides random: %.2f%%",
+             evaluatePolicy(policy, TRAINER_EVAL_EPISODES, 1) * 100.0);
+    write_line(line);
+    write_line("epoch    episodes  episodes/min  enemy win %  moves changed");
+
+    long long episodes = 0;
+    for (int epoch = 1; epoch <= TRAINER_EPOCHS; epoch++) {
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        vector<thread> workers;
+        for (unsigned int t = 0; t < threads; t++) {
+            workers.emplace_back([&, t] {
+                local[t] = shared;
+                trainSelfPlay(local[t], TRAINER_EPISODES_PER_EPOCH, (uint64_t)epoch * threads + t,
+                              TRAINER_LEARNING_RATE / sqrt((float)epoch), TRAINER_EXPLORATION);
+            });
+        }
+        for (thread& worker : workers) worker.join();
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+        // Each thread started from the shared table; average what they learned
+        for (size_t i = 0; i < shared.size(); i++) {
+            float total = 0.0f;
+            for (const QTable& table : local) total += table[i];
+            shared[i] = total / threads;
         }
+        episodes += TRAINER_EPISODES_PER_EPOCH * threads;
+
+        vector<uint8_t> next_policy = greedyPolicy(shared);
+        int changed = 0;
+        for (int state = 0; state < POLICY_STATE_COUNT; state++) {
+            changed += next_policy[state] != policy[state] ? 1 : 0;
+        }
+        policy = next_policy;
+
+        snprintf(line, sizeof(line), "%5d %11lld %13.0f %11.2f%% %14d", epoch, episodes,
+                 TRAINER_EPISODES_PER_EPOCH * threads / seconds * 60.0,
+                 evaluatePolicy(policy, TRAINER_EVAL_EPISODES, 1) * 100.0, changed);
+        write_line(line);
+    }
+
+    if (!saveEnemyPolicy(policy)) {
+        write_line("Warning: Unable to write " + ENEMY_POLICY_FILE);
+        return 1;
     }
+    write_line("Policy written to " + ENEMY_POLICY_FILE);
+    return trainNeuralEvaluator();
 }
 
+#endif
+
 // ============================================================================
 // MAIN FUNCTION - Program entry point
 // ============================================================================
+#ifndef BUILD_ENV_LIBRARY
 
 int main() {
     // Initialize random number generator
     srand(time(nullptr));
 
+#ifdef RUN_BENCHMARKS
+    return runBenchmarks();
+#endif
+#ifdef RUN_SOLVER
+    return runSolver();
+#endif
+
+#ifdef RUN_TRAINER
+    return runTrainer();
+#endif
+
     // Load user data from file
     all_users = loadAllUsers();
+    leaderboard_index.rebuild(all_users);
+    user_journal.open(all_users);
+    persistence_writer.start(all_users);
+    password_workers.start(PASSWORD_WORKER_COUNT);
+    decoyPasswordRecord();
 
     font loaded_font = load_font(DEFAULT_FONT, DEFAULT_FONT_PATH);
     if (loaded_font == nullptr) {
         write_line("Warning: Unable to load font at " + DEFAULT_FONT_PATH + ". Using SplashKit default.");
     }
 
+    buildHitGrids();
+    startEnemyLineups();   // Solved once in the background, then read from LINEUP_CACHE_FILE
+    loadEnemyPolicy();     // Written by a -DRUN_TRAINER build; random moves without it
+    neural_evaluator.load(); // Also from -DRUN_TRAINER; the search falls back to heuristicEvaluate
+    enemy_search.start(searchThreadCount());
+    battle_telemetry.start();
+    startSimulationThread();
+
     // Open game window
     open_window("Pokemon Battle Simulator - Login", WINDOW_WIDTH, WINDOW_HEIGHT);
 
-    // Game loop
+    // Game loop - battle logic runs on the simulation thread at SIM_TICK_RATE
     while (!quit_requested()) {
         process_events();
-
-        // Only run battle logic when in battle
-        if (state == GameState::BATTLE) {
-            handleAnimation();
-            checkBattleEnd();
+        {
+            AllocationScope allocation_scope(ALLOC_INPUT);
+            handleInput();
         }
 
-        handleInput();
-        render();
-
-        refresh_screen(FRAME_RATE);
+        // Static scenes (e.g. while the AI is thinking) skip drawing entirely
+        bool needs_redraw;
+        {
+            AllocationScope allocation_scope(ALLOC_RENDER);
+            needs_redraw = updateDirtyRegions();
+            if (needs_redraw) {
+                render();
+            }
+        }
+        if (needs_redraw) {
+            refresh_screen(FRAME_RATE);
+        } else {
+            delay(1000 / FRAME_RATE);
+        }
+        endFrameAllocations();
     }
 
     // Cleanup
+    stopSimulationThread();
+    stopEnemyLineups();
+    enemy_search.stop();
+    battle_telemetry.stop(); // Writes out any battles still buffered
+    password_workers.stop();
+    persistence_writer.stop(); // Writes out any stat changes still queued
+    printPersistenceMetrics();
+    user_journal.close();
     stopBattleMusic();
     close_all_windows();
 
     return 0;
 }
+
+#endif
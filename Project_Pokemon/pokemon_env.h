@@ -0,0 +1,70 @@
+/**
+ * Pokemon Battle Simulator - Vectorized training environment
+ *
+ * C interface to N battles stepped together, for training agents outside
+ * the game. The agent plays the player's side; the enemy plays as it does
+ * in the game (the trained policy if loaded, otherwise random moves).
+ * Built from H3_Updated.cpp with -DBUILD_ENV_LIBRARY.
+ *
+ * All arrays are provided by the caller and hold one entry per environment
+ * (observations hold POKEMON_ENV_OBSERVATION_SIZE floats per environment).
+ * Stepping never allocates. Use one PokemonEnv per thread.
+ */
+
+#ifndef POKEMON_ENV_H
+#define POKEMON_ENV_H
+
+#include <stdint.h>
+
+#if defined(_WIN32)
+#define POKEMON_ENV_API __declspec(dllexport)
+#else
+#define POKEMON_ENV_API __attribute__((visibility("default")))
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define POKEMON_ENV_VERSION 1
+
+/* Actions: 0-3 use the active fighter's move, 4-6 switch to team slot 0-2.
+ * An illegal switch is played as move 0. */
+#define POKEMON_ENV_ACTION_COUNT 7
+
+/* Observation, all values in [0, 1]:
+ *   player slots 0-2, then enemy slots 0-2, 5 floats each:
+ *     species one-hot (Charizard, Blastoise, Venusaur), HP fraction, active
+ *   legal action mask, POKEMON_ENV_ACTION_COUNT floats */
+#define POKEMON_ENV_OBSERVATION_SIZE 37
+
+/* Rewards: +1 when the player wins, -1 when the player loses, 0 otherwise.
+ * A finished battle is reset straight away; the observation written with
+ * done = 1 is the first one of the next battle. */
+
+typedef struct PokemonEnv PokemonEnv;
+
+POKEMON_ENV_API int pokemon_env_version(void);
+
+/* Returns NULL if count < 1 or the fighter data doesn't fit the environment */
+POKEMON_ENV_API PokemonEnv* pokemon_env_create(int32_t count);
+POKEMON_ENV_API void pokemon_env_destroy(PokemonEnv* env);
+POKEMON_ENV_API int32_t pokemon_env_count(const PokemonEnv* env);
+
+/* Loads a policy written by a -DRUN_TRAINER build for the enemy side of every
+ * environment. Returns 1 on success; the enemy keeps playing randomly otherwise. */
+POKEMON_ENV_API int pokemon_env_load_enemy_policy(const char* path);
+
+/* Starts a new battle in every environment, each from its own seed. Reset and
+ * step do nothing when env is NULL. */
+POKEMON_ENV_API void pokemon_env_reset(PokemonEnv* env, const uint64_t* seeds, float* observations);
+
+/* Plays one player action and the enemy's reply in every environment */
+POKEMON_ENV_API void pokemon_env_step(PokemonEnv* env, const int32_t* actions, float* observations,
+                                      float* rewards, uint8_t* dones);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif